@@ -11,6 +11,9 @@
 * ------------|---------------|-------------------|-----------------------------
 * 1.0.0       | Aug 1, 2019   | Dwayne Alex       | Initial Release
 * 1.0.1		  | Nov 9, 2020   | Jai Prajapati     | Updated with library format
+* 1.0.2		  | Oct 16, 2026  | Arxtron           | GetMeasurements pipelines the voltage and current queries
+* 1.0.3		  | Oct 16, 2026  | Arxtron           | Setters use compiled command templates, write and read byte counts are no longer taken as errors
+* 1.0.4		  | Oct 16, 2026  | Arxtron           | Queries are one SerialTransact exchange
 *******************************************************************************/
 
 //! \cond
@@ -27,17 +30,48 @@
 //==============================================================================
 // Constants
 
+#define psuErrChk libErrChk(psuHandle > 0 ? 0 : -1, "PSU %s is not in the serial configuration, set it with SetPSUName", psuName)
+
 //==============================================================================
 // Types
 
+/***************************************************************************//*!
+* \brief Setter commands, compiled once by Initialize_AMETEK_LIB
+*******************************************************************************/
+typedef enum
+{
+	PSU_CMD_VOLT,
+	PSU_CMD_CURR,
+	PSU_CMD_FOLD,
+	PSU_CMD_POL,
+	PSU_CMD_SENS,
+	PSU_CMD_STAT,
+	PSU_CMD_DEL,
+	PSU_NUM_CMDS
+} PSUCommand;
+
 //==============================================================================
 // Static global variables
 
 static int libInitialized = 0;
 
+static const char *psuCommandTemplates[PSU_NUM_CMDS] = {
+	"SOUR:VOLT {f2}\r",
+	"SOUR:CURR {f2}\r",
+	"OUTP:PROT:FOLD {d}\r",
+	"OUTP:POL {d}\r",
+	"OUTP:SENS {d}\r",
+	"OUTP:STAT {d}\r",
+	"OUTP:PROT:DEL {f}\r"
+};
+static SerialTemplate *psuCommands[PSU_NUM_CMDS] = {0};
+static int psuHandle = 0;		// Serial handle of psuName, resolved by SetPSUName and Initialize_AMETEK_LIB
+
 //==============================================================================
 // Static functions
 
+static int queryPSU(const char *Query, char *Reply, int ReplyLen, char errmsg[ERRLEN]);
+
 //==============================================================================
 // Global variables
 
@@ -55,7 +89,8 @@ char projectDir[MAX_PATHNAME_LEN] = {0};
 
 /***************************************************************************//*!
 * \brief Initialize Ametek library. Requires SerialComm_LIB to be previously
-* 		 initialized and configured.
+* 		 initialized and configured. A PSU named with SetPSUName before has
+* 		 to be in the serial configuration.
 *
 *******************************************************************************/
 int Initialize_AMETEK_LIB(char errmsg[ERRLEN])
@@ -64,6 +99,15 @@ int Initialize_AMETEK_LIB(char errmsg[ERRLEN])
 	
 	GetProjectDir(projectDir);
 	
+	for (int i=0; i<PSU_NUM_CMDS; i++)
+		if (!psuCommands[i])
+			libErrChk(CompileSerialTemplate(psuCommandTemplates[i], &psuCommands[i], errmsg), "%s", errmsg);
+	if (psuName[0])
+	{
+		psuHandle = GetSerialDeviceHandle(psuName, errmsg);
+		libErrChk(psuHandle < 0 ? psuHandle : 0, "%s", errmsg);
+	}
+	
 	libInitialized = 1;
 	error = 0;
 	
@@ -73,6 +117,26 @@ Error:
 
 // -------------- START GETTER FUNCTIONS --------------
 
+/***************************************************************************//*!
+* \brief Send a query and read its CR terminated reply as one exchange, no
+* 		 other thread can use the PSU in between
+*
+* \return Length of the reply or negative error code
+*******************************************************************************/
+static int queryPSU(const char *Query, char *Reply, int ReplyLen, char errmsg[ERRLEN])
+{
+	static const SerialFrameRule replyRule = {SERIAL_FRAME_TERMINATOR, "\r", 1, 0, 0};
+	double timeout = 0;
+	fnInit;
+	
+	psuErrChk;
+	libErrChk(GetSerialTimeout(psuHandle, &timeout, errmsg), "%s", errmsg);
+	error = SerialTransactTimeout(psuHandle, Query, (int) strlen(Query), &replyRule, timeout, Reply, ReplyLen, 0, errmsg);
+	
+Error:
+	return error;
+}
+
 /***************************************************************************//*!
 * \brief Get Event status register
 *
@@ -92,9 +156,7 @@ int GetStatus_ESR(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 
-	libErrChk(WriteSerialDevice(psuName, "*ESR?", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("*ESR?", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0)
@@ -123,9 +185,7 @@ int GetStatus_SCPI(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "*STB?", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("*STB?", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) 
@@ -154,9 +214,7 @@ int GetStatus_PROT(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "STAT:PROT:COND?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("STAT:PROT:COND?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) {
@@ -178,9 +236,7 @@ int GetStatus_ERRs(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName,"SYST:ERR?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 12, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("SYST:ERR?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	return error;	
@@ -197,9 +253,7 @@ int GetStatus_OUT(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "SOUR:ONL?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("SOUR:ONL?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) {
@@ -219,9 +273,7 @@ double GetStatus_TRIP(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "OUTP:TRIP?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("OUTP:TRIP?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) {
@@ -241,9 +293,7 @@ double GetVoltage(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "MEAS:VOLT:AVE?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(error & ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("MEAS:VOLT:AVE?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) {
@@ -263,9 +313,7 @@ double GetCurr(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 	
-	libErrChk(WriteSerialDevice(psuName, "MEAS:CURR:AVE?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("MEAS:CURR:AVE?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 Error:
 	if (error < 0) {
@@ -274,12 +322,66 @@ Error:
 	return atof(readBuff);
 }
 
+/***************************************************************************//*!
+* \brief Get voltage and current output levels in one pass. Both queries are
+* 		 sent back to back in pipelined mode and the replies are collected
+* 		 together, instead of one full round trip per query.
+*
+* \param [out] Volts 		Measured voltage
+* \param [out] Curr 			Measured current
+*******************************************************************************/
+int GetMeasurements(double *Volts, double *Curr, char errmsg[ERRLEN])
+{
+	char *queries[2] = {"MEAS:VOLT:AVE?\r", "MEAS:CURR:AVE?\r"};
+	double *results[2] = {Volts, Curr};
+	char readBuff[500] = {0};
+	int handle = 0;
+	int previousMode = 0;
+	int locked = 0;
+	libInit;
+	
+	psuErrChk;
+	handle = psuHandle;
+	
+	// Held from the first query to the last reply, nobody else may use the
+	// PSU or change its mode in between
+	libErrChk(LockSerialHandle(handle, errmsg), "%s", errmsg);
+	locked = 1;
+	
+	// Switching the mode discards outstanding requests, leave it alone if on
+	previousMode = GetSerialPipelineMode(handle, errmsg);
+	libErrChk(previousMode < 0 ? previousMode : 0, "%s", errmsg);
+	if (!previousMode)
+		libErrChk(SetSerialPipelineMode(handle, 1, errmsg) < 0 ? -2 : 0, "%s", errmsg);
+	
+	for (int i=0; i<2; i++)
+		libErrChk(SubmitSerialRequest(handle, queries[i], (int) strlen(queries[i]), 13, 0, errmsg) < 0 ? -2 : 0, "Serial interface write error");
+	
+	// Replies come back in the order the queries were sent
+	for (int i=0; i<2; i++)
+	{
+		libErrChk(CollectSerialReply(handle, 0, readBuff, sizeof(readBuff), Timer() + 5.0, errmsg) < 0 ? -2 : 0, "Serial interface read error");
+		*results[i] = atof(readBuff);
+	}
+	
+Error:
+	if (locked)
+	{
+		char restoreErr[ERRLEN] = {0};
+		if (!previousMode)
+			SetSerialPipelineMode(handle, 0, restoreErr);
+		UnlockSerialHandle(handle, restoreErr);
+	}
+	return error;
+}
+
 
 // -------------- END GETTER FUNCTIONS --------------
 
 
 // -------------- START SETTER FUNCTIONS --------------
 
+
 /***************************************************************************//*!
 * \brief Sets the voltage on the PSU from the paramter given
 *
@@ -288,10 +390,8 @@ int SetVolt(double Volts, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "SOUR:VOLT %2.2f\r", Volts);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_VOLT], errmsg, Volts) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -308,10 +408,8 @@ int SetLimit_Curr(double Current, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "SOUR:CURR %3.2f\r", Current);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_CURR], errmsg, Current) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -332,10 +430,8 @@ int SetFold(int Type, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:PROT:FOLD %d\r", Type);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_FOLD], errmsg, Type) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -352,10 +448,8 @@ int SetPolarity(int Pol, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:POL %d\r", Pol);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_POL], errmsg, Pol) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -373,10 +467,8 @@ int SetSense(int Sense, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:SENS %d\r", Sense);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_SENS], errmsg, Sense) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -394,10 +486,8 @@ int SetState(int State, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:STAT %d\r", State);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_STAT], errmsg, State) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -415,10 +505,8 @@ int SetIsolation(int Iso, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:STAT %d\r", Iso);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_STAT], errmsg, Iso) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -436,10 +524,8 @@ int SetDelay(double Time, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	char command [20] = {0};
-	sprintf (command, "OUTP:PROT:DEL %f\r", Time);
-	
-	libErrChk(WriteSerialDevice(psuName, command, errmsg) ? -2 : 0, "Serial interface write error");
+	psuErrChk;
+	libErrChk(WriteSerialTemplate(psuHandle, psuCommands[PSU_CMD_DEL], errmsg, Time) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -491,9 +577,7 @@ int SelfTest(char errmsg[ERRLEN])
 	
 	char readBuff[500] = {0};
 
-	libErrChk(WriteSerialDevice(psuName, "*TST?\r", errmsg) ? -2 : 0, "Serial interface write error");
-	
-	libErrChk(ReadSerialDeviceUntilTermChar(psuName, readBuff, 10, 13, errmsg) ? -2 : 0, "Serial interface read error");
+	libErrChk(queryPSU("*TST?\r", readBuff, sizeof(readBuff), errmsg) < 0 ? -2 : 0, "Serial interface query error");
 	
 	if (strcmp(errmsg, "0")) //error reset psu
 	{
@@ -516,7 +600,7 @@ int ClearPSUStatus(char errmsg[ERRLEN])
 {
 	libInit;
 	
-	libErrChk(WriteSerialDevice(psuName, "*CLS\r", errmsg) ? -2 : 0, "Serial interface write error");
+	libErrChk(WriteSerialDevice(psuName, "*CLS\r", errmsg) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -533,7 +617,7 @@ int ResetPSU(char errmsg[ERRLEN])
 {
 	libInit;
 	
-	libErrChk(WriteSerialDevice(psuName, "*RST\r", errmsg) ? -2 : 0, "Serial interface write error");
+	libErrChk(WriteSerialDevice(psuName, "*RST\r", errmsg) < 0 ? -2 : 0, "Serial interface write error");
 	
 Error:
 	if (error < 0) {
@@ -576,7 +660,11 @@ Error:
 
 void SetPSUName(char *Name)
 {
+	char errmsg[ERRLEN] = {0};
+	
 	strcpy(psuName, Name);
+	// Checked by the calls, Initialize_AMETEK_LIB resolves it again with an error
+	psuHandle = GetSerialDeviceHandle(psuName, errmsg);
 }
 
 //! \cond
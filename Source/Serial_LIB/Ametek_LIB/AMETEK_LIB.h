@@ -50,6 +50,7 @@ int GetStatus_OUT(char errmsg[ERRLEN]);
 double GetStatus_TRIP(char errmsg[ERRLEN]);
 double GetVoltage(char errmsg[ERRLEN]);
 double GetCurr(char errmsg[ERRLEN]);
+int GetMeasurements(double *Volts, double *Curr, char errmsg[ERRLEN]);
 
 // -------------- END GETTER FUNCTIONS --------------
 
@@ -11,6 +11,12 @@
 * 05-15-2013  	| Arxtron		| 1.0.0			| Initial Release
 * 09-25-2020	| Chao Zhang	| 1.0.1			| Seperate RunStep into two functions SetStep and Run
 * 11-03-2020	| Jai Prajapati | 1.0.2			| Update main with library template
+* 10-16-2026	| Arxtron		| 1.0.3			| SMCQuery sends header, data and CRC as a vectored write
+* 10-16-2026	| Arxtron		| 1.0.4			| SMCQuery completes on the expected reply length instead of a quiet gap
+* 10-16-2026	| Arxtron		| 1.0.5			| Built-in table driven CRC16MODBUS replaces CRC_LIB
+* 10-16-2026	| Arxtron		| 1.0.6			| SMCGetStatus, wait loops read all status flags in one query
+* 10-16-2026	| Arxtron		| 1.0.7			| RS-485 bus scheduler thread shared by all axes of a port
+* 10-16-2026	| Arxtron		| 1.0.8			| Asynchronous motion with completion handles
 *******************************************************************************/
 
 //! \cond
@@ -23,7 +29,6 @@
 #include "toolbox.h"
 #include <ansi_c.h>
 #include <utility.h>
-#include "CRC_LIB.h"
 #include "SerialComm_LIB.h"
 #include "SMC_Actuators.h"
 
@@ -31,6 +36,16 @@
 // Constants
 
 #define TIMEOUT 5.0
+#define SMCMAXBUSES 8	// Ports with a bus scheduler
+#define SMCMAXWAITERS 32	// SMCGetStatus calls waiting on the polls of one bus, threads waiting on motions
+#define SMCMAXMOTIONS 32	// Motion handles not yet released
+
+// Phases of a motion, each polled by the monitor until it moves on or times out
+#define SMCPHASESERVO 0		// Waiting for SVRE
+#define SMCPHASEHOME 1		// Returning to origin until SETON
+#define SMCPHASEMOVE 2		// Waiting for INP
+#define SMCPHASEOFF 3		// Waiting for SVRE off, motions with specified data only
+#define SMCPHASECLEAR 4		// RESET held until ALARM clears, then back to the phase before
 
 //==============================================================================
 // Types
@@ -44,14 +59,110 @@
 	}\
 	libErrChk ((Timer()-startTime)>timeOut,"%s\nFunction timed out",__func__);
 
+/***************************************************************************//*!
+* \brief SMCQuery or SMCGetStatus call handed to a bus scheduler. Lives on the
+* 		 stack of the caller, which blocks until done is written.
+*******************************************************************************/
+typedef struct
+{
+	uint8_t				address;
+	uint8_t				function;		// 0 for a status wait
+	uint8_t				*data;
+	uint8_t				dataSize;
+	uint8_t				*reply;
+	struct SMCStatus	*status;
+	char				*errmsg;
+	int					error;
+	CmtTSQHandle		done;			// One int, the error, when the request is finished
+} SMCBusRequest;
+
+/***************************************************************************//*!
+* \brief Scheduler thread that owns one RS-485 port
+*******************************************************************************/
+typedef struct
+{
+	int					handle;			// Serial handle, 0 if the slot is free
+	char				deviceName[MAXDEVICENAMELEN];
+	CmtThreadFunctionID	functionID;
+	CmtTSQHandle		commands;		// SMCBusRequest pointers in arrival order
+	volatile int		stop;
+	uint8_t				addresses[SMCMAXAXES];
+	int					numAddresses;
+	int					next;			// Next address to poll
+	double				roundStart;
+	SMCBusRequest		*waiters[SMCMAXWAITERS];
+	int					numWaiters;
+	struct SMCBusStats	stats;
+} SMCBus;
+
+/***************************************************************************//*!
+* \brief Motion started by SMCRunStepAsync or SMCRunWithSpecifiedAsync
+*******************************************************************************/
+typedef struct
+{
+	int					id;				// Handle given to the caller, 0 if the slot is free
+	char				deviceName[MAXDEVICENAMELEN];
+	uint8_t				address;
+	int					specified;		// Motor off at INP instead of DRIVE off
+	uint8_t				step;			// Step to run once homed, unless specified
+	int					phase;			// SMCPHASE of the motion
+	int					resumePhase;	// Phase to go back to once SMCPHASECLEAR is done
+	double				startTime;		// Start of the current phase
+	int					started;		// Polled by the monitor once set
+	int					done;
+	int					error;
+	char				errmsg[ERRLEN];
+	int					released;		// Slot is freed when the motion is done
+	SMCMotionCallback	callback;
+	void				*callbackData;
+} SMCMotion;
+
 //==============================================================================
 // Static global variables
 
 static int libInitialized = 0;
 
+// Replies are Modbus RTU frames: length from function code and byte count, CRC16MODBUS checked
+static const SerialFrameRule smcReplyRule = {SERIAL_FRAME_MODBUS_RTU};
+
+// Bus schedulers, the lock guards the slots and their waiter lists
+static SMCBus smcBuses[SMCMAXBUSES];
+static CmtThreadLockHandle smcBusLock = 0;
+static CmtThreadPoolHandle smcBusThreadPool = 0;
+
+// Motions watched by the monitor thread, the lock guards the slots
+static SMCMotion smcMotions[SMCMAXMOTIONS];
+static CmtThreadLockHandle smcMotionLock = 0;
+static int smcMotionNextID = 0;
+static int smcMotionMonitorRunning = 0;
+
+// Seconds each phase may take, as in SMCMotorOn, SMCRun and SMCMotorOff
+static const double smcPhaseTimeouts[5] = {TIMEOUT, 20.0, TIMEOUT, 60.0, 60.0};
+
+// Wake queues of the threads in smcMotionWait, written when a motion is done or released
+static CmtTSQHandle smcMotionWakes[SMCMAXWAITERS];
+static int smcMotionNumWakes = 0;
+
 //==============================================================================
 // Static functions
 
+static int smcExchange(int handle, char *deviceName, uint8_t address, uint8_t function, uint8_t *data, uint8_t dataSize,
+					   uint8_t *reply, char errmsg[ERRLEN]);
+static void smcDecodeStatus(const uint8_t bits[2], struct SMCStatus *status);
+static SMCBus *smcFindBus(int handle);
+static int smcBusSubmit(int handle, SMCBusRequest *request, char errmsg[ERRLEN]);
+static void smcBusComplete(SMCBusRequest *request, int error);
+static int CVICALLBACK SMCBusThread(void *functionData);
+static int smcStartSpecified(char *SerialDeviceName, uint8_t Address, struct StepData StepData, char errmsg[ERRLEN]);
+static int smcWriteSpecified(char *SerialDeviceName, uint8_t Address, struct StepData StepData, char errmsg[ERRLEN]);
+static int smcRunSpecified(char *SerialDeviceName, uint8_t Address, char errmsg[ERRLEN]);
+static int smcMotionReserve(char *SerialDeviceName, uint8_t Address, int Specified, uint8_t Step, char errmsg[ERRLEN]);
+static void smcMotionBegin(int id, int startError);
+static SMCMotion *smcFindMotion(int id);
+static void smcMotionSignal(void);
+static int smcMotionWait(int *MotionHandles, int NumHandles, int All, double Deadline, int *Index, char errmsg[ERRLEN]);
+static int CVICALLBACK SMCMotionThread(void *functionData);
+
 //==============================================================================
 // Global variables
 
@@ -90,15 +201,34 @@ int SMCMotorOff (char* SerialDeviceName,
 * 								Pass 0 to create as parent panel
 *******************************************************************************/
 int Initialize_SMC_Actuators (char *SerialConfigFile, int MainPanelHandle, char errmsg[ERRLEN])
+{
+	return Initialize_SMC_ActuatorsEx(SerialConfigFile, MainPanelHandle, 0, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Initialize SMC_Actuators library with Serial_LIB options, e.g.
+* 		 SERIAL_INIT_HEADLESS to leave the serial panels until first use
+* 
+* \param [in] SerialConfigFile 	XML Configuration file for Serial_LIB
+* \param [in] MainPanelHandle	Parent panel handle for serial panel
+* 								Pass 0 to create as parent panel
+* \param [in] Flags				SERIAL_INIT_ flags passed to Serial_LIB
+*******************************************************************************/
+int Initialize_SMC_ActuatorsEx (char *SerialConfigFile, int MainPanelHandle, int Flags, char errmsg[ERRLEN])
 {
 	fnInit;
 	
-	// Make sure CRC_LIB.h is in CRC16MODBUS mode and the .lib is compiled as such
-	Initialize_CRC_LIB();
-	
-	tsErrChk(InitializeSerialPortLib(SerialConfigFile, MainPanelHandle, errmsg),
+	tsErrChk(InitializeSerialPortLibEx(SerialConfigFile, MainPanelHandle, Flags, errmsg),
 			 "Unable to initialize Serial Library, check config file path: %s", SerialConfigFile);
 	
+	if (!smcBusLock)
+	{
+		tsErrChk(CmtNewLock(0, 0, &smcBusLock) < 0 ? -1 : 0, "Unable to create the bus scheduler lock");
+		tsErrChk(CmtNewLock(0, 0, &smcMotionLock) < 0 ? -1 : 0, "Unable to create the motion lock");
+		tsErrChk(CmtNewThreadPool(UNLIMITED_THREAD_POOL_THREADS, &smcBusThreadPool) < 0 ? -1 : 0,
+				 "Unable to create the bus scheduler and motion monitor thread pool");
+	}
+	
 	libInitialized = 1;
 	error = 0;
 	
@@ -119,7 +249,7 @@ int SMCMotorOn (char* SerialDeviceName,
 	libInit;
 	
 	double startTime = 0.0;
-	uint8_t DataOut = 0;
+	struct SMCStatus status = {0};
 	
 	// Change to test mode
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,SERIALINPUT,1,errmsg),errmsg);
@@ -127,17 +257,14 @@ int SMCMotorOn (char* SerialDeviceName,
 	// Turn servo on
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,SVON,1,errmsg),errmsg);
 	// Wait until Servo Ready
-	whileTO(!DataOut,TIMEOUT,
-		libErrChk (SMCReadInput(SerialDeviceName,Address,SVRE,1,&DataOut,errmsg),errmsg);
+	whileTO(!status.ServoReady,TIMEOUT,
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);
 	)
 	
-	// Return to origin if not done already
-	uint8_t busyFlag = 0;
-	DataOut = 0;
-	whileTO(!DataOut,20.0,
-		libErrChk (SMCReadInput(SerialDeviceName,Address,SETON,1,&DataOut,errmsg),errmsg);\
-		libErrChk (SMCReadInput(SerialDeviceName,Address,BUSY,1,&busyFlag,errmsg),errmsg);\
-		if (!busyFlag && !DataOut)\
+	// Return to origin if not done already, the last status already tells
+	whileTO(!status.SetOn,20.0,
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);\
+		if (!status.Busy && !status.SetOn)\
 		{\
 			libErrChk (SMCForceOutput(SerialDeviceName,Address,SETUP,1,errmsg),errmsg);\
 		}
@@ -161,7 +288,8 @@ int SMCMotorOff (char* SerialDeviceName,
 	libInit;
 	
 	double startTime = 0.0;
-	uint8_t DataOut = 1;
+	struct SMCStatus status = {0};
+	status.ServoReady = 1;
 	
 	// Change to test mode
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,SERIALINPUT,0,errmsg),errmsg);
@@ -169,8 +297,8 @@ int SMCMotorOff (char* SerialDeviceName,
 	// Turn servo off
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,SVON,0,errmsg),errmsg);
 	// Wait until Servo Ready off
-	whileTO(DataOut,60.0,
-		libErrChk (SMCReadInput(SerialDeviceName,Address,SVRE,1,&DataOut,errmsg),errmsg);
+	whileTO(status.ServoReady,60.0,
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);
 	)
 	
 Error:
@@ -189,9 +317,9 @@ int SMCCheckError (char* SerialDeviceName,
 {
 	libInit;
 	
-	uint8_t DataOut = 0;
-	libErrChk (SMCReadInput(SerialDeviceName,Address,ALARM,1,&DataOut,errmsg),errmsg);
-	libErrChk (DataOut,"");
+	struct SMCStatus status = {0};
+	libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);
+	libErrChk (status.Alarm,"");
 	
 Error:
 	return error;
@@ -209,12 +337,13 @@ int SMCClearError (char* SerialDeviceName,
 {
 	libInit;
 	
-	uint8_t DataOut = 1;
+	struct SMCStatus status = {0};
+	status.Alarm = 1;
 	double startTime = 0.0;
 	
-	whileTO(DataOut,60.0,	
+	whileTO(status.Alarm,60.0,	
 		libErrChk (SMCForceOutput(SerialDeviceName,Address,RESET,1,errmsg),errmsg);\
-		libErrChk (SMCReadInput(SerialDeviceName,Address,ALARM,1,&DataOut,errmsg),errmsg);\
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);\
 	)
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,RESET,0,errmsg),errmsg);
 	
@@ -269,10 +398,10 @@ int SMCRun (char* SerialDeviceName,
 	}
 	// Start driving and wait until INP
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,DRIVE,1,errmsg),errmsg);
-	uint8_t DataOut = 0;
+	struct SMCStatus status = {0};
 	double startTime = 0.0;
-	whileTO(!DataOut,TIMEOUT,
-		libErrChk (SMCReadInput(SerialDeviceName,Address,INP,1,&DataOut,errmsg),errmsg);
+	whileTO(!status.InPos,TIMEOUT,
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);
 	)
 	libErrChk (SMCForceOutput(SerialDeviceName,Address,DRIVE,0,errmsg),errmsg);
 	
@@ -378,6 +507,48 @@ int SMCRunWithSpecified (char* SerialDeviceName,
 {
 	libInit;
 	
+	libErrChk (smcStartSpecified(SerialDeviceName,Address,StepData,errmsg),errmsg);
+	
+	// Wait until INP
+	struct SMCStatus status = {0};
+	double startTime = 0.0;
+	whileTO(!status.InPos,TIMEOUT,
+		libErrChk (SMCGetStatus(SerialDeviceName,Address,&status,errmsg),errmsg);
+	)
+	
+	// Motor off
+	libErrChk (SMCMotorOff(SerialDeviceName,Address,errmsg),errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Writes the specified data, turns the motor on and starts the operation
+*******************************************************************************/
+static int smcStartSpecified(char *SerialDeviceName, uint8_t Address, struct StepData StepData, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	libErrChk (smcWriteSpecified(SerialDeviceName,Address,StepData,errmsg),errmsg);
+	libErrChk (SMCMotorOn(SerialDeviceName,Address,errmsg),errmsg);
+	if (SMCCheckError(SerialDeviceName,Address,errmsg))
+	{
+		libErrChk (SMCClearError(SerialDeviceName,Address,errmsg),errmsg);
+	}
+	libErrChk (smcRunSpecified(SerialDeviceName,Address,errmsg),errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Writes the specified data of a one time command
+*******************************************************************************/
+static int smcWriteSpecified(char *SerialDeviceName, uint8_t Address, struct StepData StepData, char errmsg[ERRLEN])
+{
+	fnInit;
+	
 	checkStepData(&StepData);
 	
 	uint8_t BatchData[32] = {0};
@@ -395,27 +566,22 @@ int SMCRunWithSpecified (char* SerialDeviceName,
 	L2BE (StepData.InPos,4,BatchData+28);
 	libErrChk (SMCWriteData(SerialDeviceName,Address,(uint16_t) 0x9102,16,BatchData,errmsg),errmsg);
 	
-	// Start motor
-	libErrChk (SMCMotorOn(SerialDeviceName,Address,errmsg),errmsg);
-	if (SMCCheckError(SerialDeviceName,Address,errmsg))
-	{
-		libErrChk (SMCClearError(SerialDeviceName,Address,errmsg),errmsg);
-	}
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Starts the written one time command on a motor that is on, homed and
+* 		 has no alarm
+*******************************************************************************/
+static int smcRunSpecified(char *SerialDeviceName, uint8_t Address, char errmsg[ERRLEN])
+{
+	fnInit;
 	
 	// Start specified step
 	uint8_t StartOp[2] = {1,0};
 	libErrChk (SMCWriteData(SerialDeviceName,Address,(uint16_t) 0x9100,1,StartOp,errmsg),errmsg);
 	
-	// Wait until INP
-	uint8_t DataOut = 0;
-	double startTime = 0.0;
-	whileTO(!DataOut,TIMEOUT,
-		libErrChk (SMCReadInput(SerialDeviceName,Address,INP,1,&DataOut,errmsg),errmsg);
-	)
-	
-	// Motor off
-	libErrChk (SMCMotorOff(SerialDeviceName,Address,errmsg),errmsg);
-	
 Error:
 	return error;
 }
@@ -423,12 +589,10 @@ Error:
 /***************************************************************************//*!
 * \brief Get the current state of the controller
 * 
-* NOTE: May need to consider changing implementation of drive fns since they all
-* 	have while loops within. Which means this function can't be called while other
-* 	fns are running.
-* 
-* Either have this fn run in a separate thread, or have monitoring threads to turn
-* 	off the motor once INP is reached. Either way, there needs to be threads created.
+* NOTE: The blocking drive fns have while loops within, so this function can't
+* 	be called from the same thread while they run. Use SMCRunStepAsync or
+* 	SMCRunWithSpecifiedAsync, a monitor thread turns off the motor once INP is
+* 	reached.
 * 
 * \param [IN] 	SerialDeviceName Name of the controller found in configuration\\Serial.xml
 * \param [IN] 	Address 1-255 for Controller ID, 0 for broadcast
@@ -474,6 +638,10 @@ Error:
 * 	and reply integrity are checked via CRC16MODBUS. Reply is also checked for
 * 	error SMC errors.
 * 
+* The reply is complete as soon as the length given by its function code (and
+* byte count for 0x01-0x03) has arrived, there is no wait for the line to go
+* quiet. Reply does not include the CRC.
+* 
 * \param [IN] 	SerialDeviceName Name of the controller found in configuration\\Serial.xml
 * \param [IN] 	Address 1-255 for Controller ID, 0 for broadcast
 * \param [IN] 	Function SMC functions, see documentation "LEC Serial Communication Information"
@@ -489,82 +657,78 @@ int SMCQuery (char* SerialDeviceName,
 			  uint8_t Reply[MAXREPLYLEN],
 			  char errmsg[ERRLEN])
 {
-	int numRetry = 0;
-CRCRetry:
 	libInit;
 	
-	uint8_t msg[261] = {0};
-	crc crcMsg, crcCheck, * crcReply;
-		
-	msg[0] = Address;
-	msg[1] = Function;
-	
-	for (int i=0; i<DataSize; ++i)
-		msg[2+i] = Data[i];
+	// Resolve the device once, the exchange below runs on the handle
+	int handle = GetSerialDeviceHandle(SerialDeviceName, errmsg);
+	libErrChk (handle<0 ? handle : 0, errmsg);
 	
-	crcMsg = crcCalc((uint8_t*) msg,2+DataSize,errmsg);
-	libErrChk ((strlen(errmsg)>0),errmsg);
+	// With a bus scheduler on the port the exchange waits its turn in the queue
+	SMCBusRequest request = {Address, Function, Data, DataSize, Reply, 0, errmsg};
+	int queued = smcBusSubmit(handle, &request, errmsg);
+	libErrChk (queued<0 ? queued : 0, errmsg);
+	if (queued)
+		error = request.error;
+	else
+		error = smcExchange(handle, SerialDeviceName, Address, Function, Data, DataSize, Reply, errmsg);
 	
-	// crc should be type uint16_t (CRC16MODBUS) and message starts with the lower byte
-	// crcMsg should be in little Endian notation so it should already start with LB
-	msg[2+DataSize] = ((uint8_t*) &crcMsg)[0];
-	msg[2+DataSize+1] = ((uint8_t*) &crcMsg)[1];
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Frame, CRC, write and reply check of SMCQuery, on the calling thread
+*******************************************************************************/
+static int smcExchange(int handle, char *SerialDeviceName, uint8_t Address, uint8_t Function, uint8_t *Data, uint8_t DataSize,
+					   uint8_t *Reply, char errmsg[ERRLEN])
+{
+	int numRetry = 0;
+CRCRetry:
+	fnInit;
 	
-	int bytesWritten = WriteSerialDeviceRaw(SerialDeviceName,(char*) msg,DataSize+4, errmsg);
+	uint8_t header[2] = {Address, Function};
+	uint8_t crcMsg[2];
+	double timeout = 0;
 	
-	libErrChk (bytesWritten!=DataSize+4 || bytesWritten<0,
-			"%s\nError writing to %s",__func__,SerialDeviceName);
+	libErrChk (GetSerialTimeout(handle, &timeout, errmsg), errmsg);
+		
+	// CRC16MODBUS over address, function and data, sent lower byte first
+	uint16_t crcValue = SerialCrc16Update(SERIALCRC16INIT, header, 2);
+	crcValue = SerialCrc16Update(crcValue, Data, DataSize);
+	crcMsg[0] = (uint8_t) (crcValue & 0xFF);
+	crcMsg[1] = (uint8_t) (crcValue >> 8);
 	
-	DelayWithEventProcessing(SENDDELAY);
+	// Header, payload and CRC go out as they are, without assembling the frame
+	SerialIOVec frame[3] = {{header, 2}, {Data, DataSize}, {crcMsg, 2}};
 	
 	// Not a broadcast
 	if (Address!=0)
 	{
-		// Read reply
-		int replyLen = 0;
-		int replyLen2 = 0;
-		double startTime = 0.0;
+		// The framer knows the reply length from the function code and byte
+		// count, so the exchange ends the moment the last byte and CRC are in.
+		// A reply with a bad CRC is reported as soon as it is complete.
+		int replyLen = SerialTransactV(handle, frame, 3, &smcReplyRule, Timer()+timeout, (char*) Reply, MAXREPLYLEN, 0, errmsg);
 		
-		for (int i=0;i<5;++i)
+		if (replyLen==ERR_SERIAL_CRC && numRetry<5)
 		{
-			whileTO((!replyLen || replyLen<3),60.0,
-				replyLen = GetInQLenForDeviceName(SerialDeviceName, errmsg);\
-				DelayWithEventProcessing(SENDDELAY);\
-			)
-			if (replyLen2 != replyLen)
-			{
-				replyLen2 = replyLen;
-				i = 0;
-			}
-		}
-		
-		libErrChk (ReadSerialDevice(SerialDeviceName,(char*) Reply,replyLen, errmsg) < 0,
-					"%s\nError reading from %s",__func__,SerialDeviceName);
-	
-		// Check CRC
-		// Last 2 chars are CRC from reply
-		crcReply = (crc*) (Reply+(replyLen-2));
-		crcCheck = crcCalc((uint8_t*) Reply,replyLen-2,errmsg);
-		if (*crcReply!=crcCheck)
-		{
-			if (numRetry<5)
-			{
-				/* 20200608Biye: For some reason CRC for the motor response is just a huge pain in the a */
-				++numRetry;
-				DelayWithEventProcessing(1);
-				goto CRCRetry;
-			}
+			/* 20200608Biye: For some reason CRC for the motor response is just a huge pain in the a */
+			++numRetry;
+			goto CRCRetry;
 		}
-			
-		libErrChk ((strlen(errmsg)>0),errmsg);
-		
-		libErrChk ((*crcReply!=crcCheck),"CRC from reply does not match calculated CRC");
+		libErrChk (replyLen<0 ? replyLen : 0,"%s\nNo valid reply from %s%s",__func__,SerialDeviceName,
+				   replyLen==ERR_SERIAL_CRC ? ", CRC from reply does not match calculated CRC" : "");
 		
 		// Check error
 		// MSB of 2nd reply byte is set when there's an error
 		if (Reply[1] & 0x80)
 			libErrChk (SMCGetErrMsg(Reply[2],errmsg),errmsg);
 	}
+	else
+	{
+		int bytesWritten = WriteSerialHandleV(handle, frame, 3, errmsg);
+		libErrChk (bytesWritten!=DataSize+4 || bytesWritten<0,
+				"%s\nError writing to %s",__func__,SerialDeviceName);
+	}
 	
 Error:
 	return error;
@@ -670,6 +834,43 @@ Error:
 	return error;
 }
 
+/***************************************************************************//*!
+* \brief Reads all #StatusFlags (X40-X4F) with one 0x02 query
+* 
+* If a bus scheduler polls the address, waits for its next poll instead.
+* 
+* \param [IN] 	SerialDeviceName Name of the controller found in configuration\\Serial.xml
+* \param [IN] 	Address 1-255 for Controller ID
+* \param [OUT] 	Status Decoded flags
+*******************************************************************************/
+int SMCGetStatus (char* SerialDeviceName,
+				  uint8_t Address,
+				  struct SMCStatus *Status,
+				  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	int handle = GetSerialDeviceHandle(SerialDeviceName, errmsg);
+	libErrChk (handle<0 ? handle : 0, errmsg);
+	
+	// An address polled by a bus scheduler takes the result of its next poll
+	SMCBusRequest request = {Address, 0, 0, 0, 0, Status, errmsg};
+	int queued = smcBusSubmit(handle, &request, errmsg);
+	libErrChk (queued<0 ? queued : 0, errmsg);
+	if (queued)
+	{
+		error = request.error;
+		goto Error;
+	}
+	
+	uint8_t DataOut[16] = {0};
+	libErrChk (SMCReadInput(SerialDeviceName,Address,OUT0,16,DataOut,errmsg),errmsg);
+	smcDecodeStatus(DataOut, Status);
+	
+Error:
+	return error;
+}
+
 /***************************************************************************//*!
 * \brief Function 0x03 of SMC controller, reads specified words
 * 
@@ -833,6 +1034,888 @@ Error:
 //! \cond
 /// REGION END
 
+/// REGION START Bus Scheduler
+//! \endcond
+/***************************************************************************//*!
+* \brief Starts a scheduler thread that owns the port of a multi-drop RS-485 bus
+*
+* From then on every SMCQuery on the port, from any thread and for any address,
+* 	is queued and run by the scheduler in arrival order. Between queued
+* 	commands the scheduler polls round-robin the given addresses that have a
+* 	caller waiting on them. SMCGetStatus on one of them waits for its next poll
+* 	instead of adding a query, so several axes can move at once from their own
+* 	threads and share the bus without idle time between their polls.
+*
+* The serial lock is only taken for each exchange, SerialTransact, broadcasts
+* 	and the debug panel still get the port in between.
+*
+* \param [IN] SerialDeviceName Name of the port found in configuration\\Serial.xml
+* \param [IN] Addresses Controller IDs (1-255) to poll, 0 for none
+* \param [IN] NumAddresses Number of addresses, up to SMCMAXAXES
+*******************************************************************************/
+int SMCStartBusScheduler (char* SerialDeviceName,
+						  uint8_t* Addresses,
+						  int NumAddresses,
+						  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCBus *bus = 0;
+	int locked = 0;
+	
+	libErrChk (NumAddresses<0 || NumAddresses>SMCMAXAXES || (NumAddresses && !Addresses),
+			   "%s\nUp to %d addresses can be polled", __func__, SMCMAXAXES);
+	for (int i=0; i<NumAddresses; ++i)
+		libErrChk (Addresses[i]==0, "%s\nBroadcast address 0 cannot be polled", __func__);
+	
+	int handle = GetSerialDeviceHandle(SerialDeviceName, errmsg);
+	libErrChk (handle<0 ? handle : 0, errmsg);
+	
+	CmtGetLock(smcBusLock);
+	locked = 1;
+	libErrChk (smcFindBus(handle)!=0, "%s\nA bus scheduler is already running on %s", __func__, SerialDeviceName);
+	for (int i=0; i<SMCMAXBUSES && !bus; ++i)
+		if (!smcBuses[i].handle)
+			bus = &smcBuses[i];
+	libErrChk (!bus, "%s\nNo more than %d bus schedulers", __func__, SMCMAXBUSES);
+	
+	memset (bus, 0, sizeof(SMCBus));
+	libErrChk (CmtNewTSQ(SMCMAXWAITERS, sizeof(SMCBusRequest*), OPT_TSQ_DYNAMIC_SIZE, &bus->commands) < 0 ? -1 : 0,
+			   "%s\nUnable to create the command queue", __func__);
+	strncpy (bus->deviceName, SerialDeviceName, MAXDEVICENAMELEN-1);
+	memcpy (bus->addresses, Addresses, NumAddresses);
+	bus->numAddresses = NumAddresses;
+	bus->roundStart = Timer();
+	bus->handle = handle;
+	
+	if (CmtScheduleThreadPoolFunction(smcBusThreadPool, SMCBusThread, bus, &bus->functionID) < 0)
+	{
+		CmtDiscardTSQ(bus->commands);
+		bus->handle = 0;
+		libErrChk (-1, "%s\nUnable to start the bus scheduler for %s", __func__, SerialDeviceName);
+	}
+	
+Error:
+	if (locked)
+		CmtReleaseLock(smcBusLock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Stops the bus scheduler of a port. Commands still queued fail, later
+* 		 calls go to the port directly again.
+*
+* \param [IN] SerialDeviceName Name of the port found in configuration\\Serial.xml
+*******************************************************************************/
+int SMCStopBusScheduler (char* SerialDeviceName,
+						 char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCBus *bus = 0;
+	SMCBusRequest *request = 0;
+	
+	int handle = GetSerialDeviceHandle(SerialDeviceName, errmsg);
+	libErrChk (handle<0 ? handle : 0, errmsg);
+	
+	// No new requests once stop is set
+	CmtGetLock(smcBusLock);
+	bus = smcFindBus(handle);
+	if (bus)
+		bus->stop = 1;
+	CmtReleaseLock(smcBusLock);
+	libErrChk (!bus, "%s\nNo bus scheduler running on %s", __func__, SerialDeviceName);
+	
+	CmtWaitForThreadPoolFunctionCompletion(smcBusThreadPool, bus->functionID, OPT_TP_PROCESS_EVENTS_WHILE_WAITING);
+	CmtReleaseThreadPoolFunctionID(smcBusThreadPool, bus->functionID);
+	
+	CmtGetLock(smcBusLock);
+	while (CmtReadTSQData(bus->commands, &request, 1, 0, 0) > 0)
+	{
+		if (!request)
+			continue;
+		sprintf (request->errmsg, "(-1) %s\nBus scheduler of %s stopped", __func__, SerialDeviceName);
+		smcBusComplete(request, -1);
+	}
+	for (int i=0; i<bus->numWaiters; ++i)
+	{
+		sprintf (bus->waiters[i]->errmsg, "(-1) %s\nBus scheduler of %s stopped", __func__, SerialDeviceName);
+		smcBusComplete(bus->waiters[i], -1);
+	}
+	CmtDiscardTSQ(bus->commands);
+	bus->handle = 0;
+	CmtReleaseLock(smcBusLock);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Counters of the bus scheduler of a port
+*
+* \param [IN] 	SerialDeviceName Name of the port found in configuration\\Serial.xml
+* \param [OUT] 	Stats Commands, polls and time of the last poll round
+*******************************************************************************/
+int SMCGetBusStats (char* SerialDeviceName,
+					struct SMCBusStats *Stats,
+					char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCBus *bus = 0;
+	
+	int handle = GetSerialDeviceHandle(SerialDeviceName, errmsg);
+	libErrChk (handle<0 ? handle : 0, errmsg);
+	
+	CmtGetLock(smcBusLock);
+	bus = smcFindBus(handle);
+	if (bus)
+		*Stats = bus->stats;
+	CmtReleaseLock(smcBusLock);
+	libErrChk (!bus, "%s\nNo bus scheduler running on %s", __func__, SerialDeviceName);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Running scheduler of a serial handle, 0 if none. Call with smcBusLock.
+*******************************************************************************/
+static SMCBus *smcFindBus(int handle)
+{
+	for (int i=0; i<SMCMAXBUSES; ++i)
+		if (smcBuses[i].handle==handle && !smcBuses[i].stop)
+			return &smcBuses[i];
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Hands a request to the scheduler of the port and waits until it is done
+*
+* A status wait (function 0) is only taken when the scheduler polls its address.
+*
+* \return 1 if the scheduler ran the request and request->error is set, 0 if
+* 		  the caller has to do it itself, negative on error
+*******************************************************************************/
+static int smcBusSubmit(int handle, SMCBusRequest *request, char errmsg[ERRLEN])
+{
+	int error = 0;
+	SMCBus *bus = 0;
+	
+	if (!smcBusLock)
+		return 0;
+	
+	CmtGetLock(smcBusLock);
+	bus = smcFindBus(handle);
+	if (bus && request->function==0)
+	{
+		// Status waits ride on the round-robin polls
+		int polled = 0;
+		for (int i=0; i<bus->numAddresses; ++i)
+			polled |= bus->addresses[i]==request->address;
+		if (!polled || bus->numWaiters==SMCMAXWAITERS)
+			bus = 0;
+	}
+	if (!bus)
+	{
+		CmtReleaseLock(smcBusLock);
+		return 0;
+	}
+	
+	if (CmtNewTSQ(1, sizeof(int), 0, &request->done) < 0)
+		error = -1;
+	else if (request->function==0)
+	{
+		// Empty entry wakes the scheduler if it sleeps on an idle queue
+		SMCBusRequest *wake = 0;
+		bus->waiters[bus->numWaiters++] = request;
+		CmtWriteTSQData(bus->commands, &wake, 1, 0, 0);
+	}
+	else if (CmtWriteTSQData(bus->commands, &request, 1, 0, 0) != 1)
+	{
+		CmtDiscardTSQ(request->done);
+		error = -1;
+	}
+	CmtReleaseLock(smcBusLock);
+	if (error)
+	{
+		sprintf (errmsg, "(%d) %s\nUnable to queue the request on %s", error, __func__, bus->deviceName);
+		return error;
+	}
+	
+	CmtReadTSQData(request->done, &error, 1, TSQ_INFINITE_TIMEOUT, 0);
+	CmtDiscardTSQ(request->done);
+	return 1;
+}
+
+/***************************************************************************//*!
+* \brief Sets the result of a request and wakes its caller
+*******************************************************************************/
+static void smcBusComplete(SMCBusRequest *request, int error)
+{
+	request->error = error;
+	CmtWriteTSQData(request->done, &error, 1, 0, 0);
+}
+
+/***************************************************************************//*!
+* \brief Runs queued commands in order, with one status poll after each so
+* 		 the axes waiting on their status keep moving. Only addresses with a
+* 		 waiter are polled, with none the thread sleeps on the queue.
+*******************************************************************************/
+static int CVICALLBACK SMCBusThread(void *functionData)
+{
+	SMCBus *bus = (SMCBus*) functionData;
+	SMCBusRequest *request = 0;
+	int pollNext = 0;
+	char errmsg[ERRLEN] = {0};
+	
+	while (!bus->stop)
+	{
+		// First address from next on that someone waits for
+		int pending = -1;
+		CmtGetLock(smcBusLock);
+		for (int n=0; n<bus->numAddresses && pending<0; ++n)
+		{
+			int k = (bus->next+n) % bus->numAddresses;
+			for (int i=0; i<bus->numWaiters && pending<0; ++i)
+				if (bus->waiters[i]->address==bus->addresses[k])
+					pending = k;
+		}
+		if (pending<0)
+		{
+			bus->next = 0;
+			bus->roundStart = Timer();
+		}
+		CmtReleaseLock(smcBusLock);
+		
+		request = 0;
+		if (!pollNext || pending<0)
+			CmtReadTSQData(bus->commands, &request, 1, pending<0 ? 50 : 0, 0);
+	
+		if (request)
+		{
+			int error = smcExchange(bus->handle, bus->deviceName, request->address, request->function, request->data,
+									request->dataSize, request->reply, request->errmsg);
+			CmtGetLock(smcBusLock);
+			bus->stats.Commands++;
+			CmtReleaseLock(smcBusLock);
+			smcBusComplete(request, error);
+			pollNext = 1;
+			continue;
+		}
+		pollNext = 0;
+		if (pending<0)
+			continue;
+	
+		// X40-X4F of the address, handed to everyone waiting on it
+		uint8_t address = bus->addresses[pending];
+		uint8_t query[4] = {0, OUT0, 0, 16};
+		uint8_t reply[MAXREPLYLEN] = {0};
+		struct SMCStatus status = {0};
+		int error = smcExchange(bus->handle, bus->deviceName, address, 0x02, query, 4, reply, errmsg);
+		if (!error)
+			smcDecodeStatus(reply+3, &status);
+	
+		CmtGetLock(smcBusLock);
+		bus->stats.Polls++;
+		if (error)
+			bus->stats.PollErrors++;
+		for (int i=0; i<bus->numWaiters;)
+		{
+			request = bus->waiters[i];
+			if (request->address!=address)
+			{
+				++i;
+				continue;
+			}
+			*request->status = status;
+			if (error)
+				strcpy (request->errmsg, errmsg);
+			bus->waiters[i] = bus->waiters[--bus->numWaiters];
+			smcBusComplete(request, error);
+		}
+		bus->next = pending+1;
+		if (bus->next==bus->numAddresses)
+		{
+			bus->next = 0;
+			bus->stats.LastRound = Timer()-bus->roundStart;
+			bus->roundStart = Timer();
+		}
+		CmtReleaseLock(smcBusLock);
+	}
+	
+	return 0;
+}
+//! \cond
+/// REGION END
+
+/// REGION START Async Motion
+//! \endcond
+/***************************************************************************//*!
+* \brief Starts a step like SMCRunStep and returns without waiting for INP
+*
+* The calling thread only switches the controller to serial input and the servo
+* 	on. A monitor thread then polls the status, clears an alarm and returns to
+* 	origin if needed, runs the step and completes the handle at INP, ALARM
+* 	while moving or when a phase takes longer than the blocking version
+* 	allows, turning DRIVE off at INP. Check on
+* 	the motion with
+* 	SMCMotionPoll, SMCMotionWait, SMCMotionWaitAny, SMCMotionWaitAll or
+* 	SMCMotionSetCallback and free the handle with SMCMotionRelease.
+*
+* With a bus scheduler polling the address the monitor rides on its polls.
+*
+* \param [IN] 	SerialDeviceName Name of the controller found in configuration\\Serial.xml
+* \param [IN] 	Address 1-255 for Controller ID
+* \param [IN] 	Step 0-63 step number to run
+* \param [OUT] 	MotionHandle Handle of the motion, positive
+*******************************************************************************/
+int SMCRunStepAsync (char* SerialDeviceName,
+					 uint8_t Address,
+					 uint8_t Step,
+					 int* MotionHandle,
+					 char errmsg[ERRLEN])
+{
+	libInit;
+	
+	int id = 0;
+	
+	libErrChk (Address==0,"%s cannot use broadcasts",__func__);
+	libErrChk (Step>63,"Step # is from 0 to 63 only, please input a valid step #");
+	id = smcMotionReserve(SerialDeviceName, Address, 0, Step, errmsg);
+	libErrChk (id<0 ? id : 0, errmsg);
+	
+	// Servo ready, homing and the step itself are left to the monitor
+	libErrChk (SMCForceOutput(SerialDeviceName,Address,SERIALINPUT,1,errmsg),errmsg);
+	libErrChk (SMCForceOutput(SerialDeviceName,Address,SVON,1,errmsg),errmsg);
+	
+Error:
+	if (id>0)
+		smcMotionBegin(id, error);
+	if (MotionHandle)
+		*MotionHandle = error ? 0 : id;
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Starts a one time command like SMCRunWithSpecified and returns without
+* 		 waiting for INP. The data is written on the calling thread, turning
+* 		 the motor on and off is left to the monitor like in SMCRunStepAsync.
+*
+* \param [IN] 	SerialDeviceName Name of the controller found in configuration\\Serial.xml
+* \param [IN] 	Address 1-255 for Controller ID
+* \param [IN] 	StepData StepData structure containing all of the information required for a step
+* \param [OUT] 	MotionHandle Handle of the motion, positive
+*******************************************************************************/
+int SMCRunWithSpecifiedAsync (char* SerialDeviceName,
+							  uint8_t Address,
+							  struct StepData StepData,
+							  int* MotionHandle,
+							  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	int id = 0;
+	
+	libErrChk (Address==0,"%s cannot use broadcasts",__func__);
+	id = smcMotionReserve(SerialDeviceName, Address, 1, 0, errmsg);
+	libErrChk (id<0 ? id : 0, errmsg);
+	
+	libErrChk (smcWriteSpecified(SerialDeviceName,Address,StepData,errmsg),errmsg);
+	libErrChk (SMCForceOutput(SerialDeviceName,Address,SERIALINPUT,1,errmsg),errmsg);
+	libErrChk (SMCForceOutput(SerialDeviceName,Address,SVON,1,errmsg),errmsg);
+	
+Error:
+	if (id>0)
+		smcMotionBegin(id, error);
+	if (MotionHandle)
+		*MotionHandle = error ? 0 : id;
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Checks a motion without waiting
+*
+* \param [IN] 	MotionHandle Handle from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+* \param [OUT] 	Done 1 once the motion reached INP or failed
+*
+* \return The error of the motion once it is done, 0 while it is running
+*******************************************************************************/
+int SMCMotionPoll (int MotionHandle,
+				   int* Done,
+				   char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCMotion *motion = 0;
+	int motionError = 0;
+	
+	CmtGetLock(smcMotionLock);
+	motion = smcFindMotion(MotionHandle);
+	if (motion)
+	{
+		*Done = motion->done;
+		motionError = motion->done ? motion->error : 0;
+		strcpy (errmsg, motion->done ? motion->errmsg : "");
+	}
+	CmtReleaseLock(smcMotionLock);
+	libErrChk (!motion, "%s\nUnknown motion handle %d", __func__, MotionHandle);
+	error = motionError;
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Waits until a motion is done
+*
+* \param [IN] MotionHandle Handle from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+* \param [IN] Deadline Timer() value to give up at, 0 to wait without limit
+*
+* \return The error of the motion, ERR_SERIAL_TIMEOUT if it is still running
+* 		  at the deadline
+*******************************************************************************/
+int SMCMotionWait (int MotionHandle,
+				   double Deadline,
+				   char errmsg[ERRLEN])
+{
+	libInit;
+	
+	error = smcMotionWait(&MotionHandle, 1, 1, Deadline, 0, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Waits until the first of several motions is done
+*
+* \param [IN] 	MotionHandles Handles from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+* \param [IN] 	NumHandles Number of handles
+* \param [IN] 	Deadline Timer() value to give up at, 0 to wait without limit
+* \param [OUT] 	Index Position in MotionHandles of the motion that is done
+*
+* \return The error of that motion, ERR_SERIAL_TIMEOUT if none is done at the
+* 		  deadline
+*******************************************************************************/
+int SMCMotionWaitAny (int* MotionHandles,
+					  int NumHandles,
+					  double Deadline,
+					  int* Index,
+					  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	error = smcMotionWait(MotionHandles, NumHandles, 0, Deadline, Index, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Waits until all of several motions are done
+*
+* \param [IN] MotionHandles Handles from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+* \param [IN] NumHandles Number of handles
+* \param [IN] Deadline Timer() value to give up at, 0 to wait without limit
+*
+* \return The error of the first motion in MotionHandles that failed,
+* 		  ERR_SERIAL_TIMEOUT if any is still running at the deadline
+*******************************************************************************/
+int SMCMotionWaitAll (int* MotionHandles,
+					  int NumHandles,
+					  double Deadline,
+					  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	error = smcMotionWait(MotionHandles, NumHandles, 1, Deadline, 0, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Calls a function once the motion is done
+*
+* The callback runs on the monitor thread and should return quickly, other
+* 	motions are not checked while it runs. If the motion is already done it is
+* 	called right away on the calling thread.
+*
+* \param [IN] MotionHandle Handle from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+* \param [IN] Callback Function to call, 0 to remove it
+* \param [IN] CallbackData Passed to the callback as it is
+*******************************************************************************/
+int SMCMotionSetCallback (int MotionHandle,
+						  SMCMotionCallback Callback,
+						  void* CallbackData,
+						  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCMotion *motion = 0;
+	int done = 0, motionError = 0;
+	char motionErrmsg[ERRLEN] = {0};
+	
+	CmtGetLock(smcMotionLock);
+	motion = smcFindMotion(MotionHandle);
+	if (motion && motion->done)
+	{
+		done = 1;
+		motionError = motion->error;
+		strcpy (motionErrmsg, motion->errmsg);
+	}
+	else if (motion)
+	{
+		motion->callback = Callback;
+		motion->callbackData = CallbackData;
+	}
+	CmtReleaseLock(smcMotionLock);
+	libErrChk (!motion, "%s\nUnknown motion handle %d", __func__, MotionHandle);
+	
+	if (done && Callback)
+		Callback(MotionHandle, motionError, motionErrmsg, CallbackData);
+	error = 0;
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Frees a motion handle. A motion still running keeps going and its
+* 		 callback is still called, the handle just can't be used anymore.
+*
+* \param [IN] MotionHandle Handle from SMCRunStepAsync or SMCRunWithSpecifiedAsync
+*******************************************************************************/
+int SMCMotionRelease (int MotionHandle,
+					  char errmsg[ERRLEN])
+{
+	libInit;
+	
+	SMCMotion *motion = 0;
+	
+	CmtGetLock(smcMotionLock);
+	motion = smcFindMotion(MotionHandle);
+	if (motion && motion->done)
+		memset (motion, 0, sizeof(SMCMotion));
+	else if (motion)
+		motion->released = 1;
+	// Waits on the handle end with unknown handle
+	if (motion)
+		smcMotionSignal();
+	CmtReleaseLock(smcMotionLock);
+	libErrChk (!motion, "%s\nUnknown motion handle %d", __func__, MotionHandle);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Takes a slot for a motion about to be started
+*
+* \return The handle of the motion, negative on error
+*******************************************************************************/
+static int smcMotionReserve(char *SerialDeviceName, uint8_t Address, int Specified, uint8_t Step, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	SMCMotion *motion = 0;
+	int busy = 0, id = 0;
+	
+	CmtGetLock(smcMotionLock);
+	for (int i=0; i<SMCMAXMOTIONS; ++i)
+	{
+		if (!smcMotions[i].id && !motion)
+			motion = &smcMotions[i];
+		else if (smcMotions[i].id && !smcMotions[i].done && smcMotions[i].address==Address &&
+				 !strcmp(smcMotions[i].deviceName, SerialDeviceName))
+			busy = 1;
+	}
+	if (motion && !busy)
+	{
+		// Handles stay positive and are not reused until the counter wraps
+		smcMotionNextID = smcMotionNextID==INT_MAX ? 1 : smcMotionNextID+1;
+		memset (motion, 0, sizeof(SMCMotion));
+		motion->id = smcMotionNextID;
+		strncpy (motion->deviceName, SerialDeviceName, MAXDEVICENAMELEN-1);
+		motion->address = Address;
+		motion->specified = Specified;
+		motion->step = Step;
+		motion->phase = SMCPHASESERVO;
+		id = motion->id;
+	}
+	CmtReleaseLock(smcMotionLock);
+	libErrChk (busy ? -1 : 0, "%s\nAddress %d of %s is already moving", __func__, Address, SerialDeviceName);
+	libErrChk (!motion ? -1 : 0, "%s\nNo more than %d motion handles, release the ones that are done", __func__, SMCMAXMOTIONS);
+	error = id;
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Hands a started motion to the monitor thread, or frees its slot if it
+* 		 could not be started
+*******************************************************************************/
+static void smcMotionBegin(int id, int startError)
+{
+	CmtGetLock(smcMotionLock);
+	SMCMotion *motion = smcFindMotion(id);
+	if (motion && startError)
+		memset (motion, 0, sizeof(SMCMotion));
+	else if (motion)
+	{
+		motion->startTime = Timer();
+		motion->started = 1;
+		if (!smcMotionMonitorRunning)
+			smcMotionMonitorRunning = CmtScheduleThreadPoolFunction(smcBusThreadPool, SMCMotionThread, 0, 0) >= 0;
+	}
+	CmtReleaseLock(smcMotionLock);
+}
+
+/***************************************************************************//*!
+* \brief Motion of a handle, 0 if none. Call with smcMotionLock.
+*******************************************************************************/
+static SMCMotion *smcFindMotion(int id)
+{
+	for (int i=0; i<SMCMAXMOTIONS; ++i)
+		if (id>0 && smcMotions[i].id==id && !smcMotions[i].released)
+			return &smcMotions[i];
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Wakes every smcMotionWait. Call with smcMotionLock.
+*******************************************************************************/
+static void smcMotionSignal(void)
+{
+	// The queues hold one entry, a wake already pending is enough
+	int signal = 1;
+	for (int i=0; i<smcMotionNumWakes; ++i)
+		CmtWriteTSQData(smcMotionWakes[i], &signal, 1, 0, 0);
+}
+
+/***************************************************************************//*!
+* \brief Waits for any or all of the motions, checking again each time the
+* 		 monitor completes a motion or a handle is released
+*******************************************************************************/
+static int smcMotionWait(int *MotionHandles, int NumHandles, int All, double Deadline, int *Index, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	int unknown = 0, numDone = 0, first = -1, failed = -1;
+	CmtTSQHandle wake = 0;
+	int registered = 0, signal = 0;
+	
+	libErrChk (NumHandles<1 || !MotionHandles, "%s\nNo motion handles to wait on", __func__);
+	libErrChk (CmtNewTSQ(1, sizeof(int), 0, &wake) < 0 ? -1 : 0, "%s\nUnable to create the wake queue", __func__);
+	
+	// Registered before the first check so no completion is missed
+	CmtGetLock(smcMotionLock);
+	if (smcMotionNumWakes<SMCMAXWAITERS)
+	{
+		smcMotionWakes[smcMotionNumWakes++] = wake;
+		registered = 1;
+	}
+	CmtReleaseLock(smcMotionLock);
+	libErrChk (!registered, "%s\nNo more than %d threads can wait on motions", __func__, SMCMAXWAITERS);
+	
+	while (1)
+	{
+		unknown = 0;
+		numDone = 0;
+		first = -1;
+		failed = -1;
+		CmtGetLock(smcMotionLock);
+		for (int i=0; i<NumHandles && !unknown; ++i)
+		{
+			SMCMotion *motion = smcFindMotion(MotionHandles[i]);
+			if (!motion)
+				unknown = MotionHandles[i] ? MotionHandles[i] : -1;
+			else if (motion->done)
+			{
+				++numDone;
+				first = first<0 ? i : first;
+				failed = failed<0 && motion->error ? i : failed;
+			}
+		}
+		
+		// Result and message of the motion that ends the wait
+		int result = All ? failed : first;
+		if (!unknown && (All ? numDone==NumHandles : numDone>0))
+		{
+			SMCMotion *motion = result<0 ? 0 : smcFindMotion(MotionHandles[result]);
+			error = motion ? motion->error : 0;
+			strcpy (errmsg, motion ? motion->errmsg : "");
+			if (Index)
+				*Index = result;
+			CmtReleaseLock(smcMotionLock);
+			break;
+		}
+		CmtReleaseLock(smcMotionLock);
+		
+		libErrChk (unknown ? -1 : 0, "%s\nUnknown motion handle %d", __func__, unknown);
+		libErrChk (Deadline>0 && Timer()>Deadline ? ERR_SERIAL_TIMEOUT : 0,
+				   "%s\n%s still moving at the deadline", __func__, All ? "Not all motions done," : "No motion done,");
+		
+		// A deadline that passed since the check above must not turn into -1, which waits forever
+		int timeout = TSQ_INFINITE_TIMEOUT;
+		if (Deadline>0)
+		{
+			double remaining = Deadline-Timer();
+			timeout = remaining>0 ? (int) (remaining*1000)+1 : 0;
+		}
+		CmtReadTSQData(wake, &signal, 1, timeout, OPT_TSQ_READ_PROCESS_EVENTS_WHILE_WAITING);
+	}
+	
+Error:
+	if (registered)
+	{
+		CmtGetLock(smcMotionLock);
+		for (int i=0; i<smcMotionNumWakes; ++i)
+			if (smcMotionWakes[i]==wake)
+				smcMotionWakes[i] = smcMotionWakes[--smcMotionNumWakes];
+		CmtReleaseLock(smcMotionLock);
+	}
+	if (wake)
+		CmtDiscardTSQ(wake);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Polls the status of every started motion in turn and moves it through
+* 		 its phases, one poll at a time so no motion holds up the others.
+* 		 Completes it at INP, ALARM or when a phase times out. An ALARM before
+* 		 the step starts is cleared with RESET like SMCClearError, also one
+* 		 poll at a time. Ends when no motion is running and is started again
+* 		 with the next one.
+*******************************************************************************/
+static int CVICALLBACK SMCMotionThread(void *functionData)
+{
+	char errmsg[ERRLEN] = {0};
+	int running = 1;
+	
+	while (running)
+	{
+		for (int i=0; i<SMCMAXMOTIONS; ++i)
+		{
+			// Work on a copy, the caller only frees a running slot by marking it released
+			CmtGetLock(smcMotionLock);
+			SMCMotion motion = smcMotions[i];
+			CmtReleaseLock(smcMotionLock);
+			if (!motion.id || !motion.started || motion.done)
+				continue;
+			
+			struct SMCStatus status = {0};
+			int phase = motion.phase;
+			int resume = motion.resumePhase;
+			int finished = 0;
+			int error = SMCGetStatus(motion.deviceName, motion.address, &status, errmsg);
+			if (!error && status.Alarm && (motion.phase==SMCPHASESERVO || motion.phase==SMCPHASEHOME))
+			{
+				// Not moving yet, hold RESET and come back here once the alarm is gone
+				error = SMCForceOutput(motion.deviceName, motion.address, RESET, 1, errmsg);
+				resume = motion.phase;
+				phase = SMCPHASECLEAR;
+			}
+			else if (!error && motion.phase==SMCPHASECLEAR && !status.Alarm)
+			{
+				error = SMCForceOutput(motion.deviceName, motion.address, RESET, 0, errmsg);
+				phase = motion.resumePhase;
+			}
+			else if (!error && status.Alarm && motion.phase!=SMCPHASECLEAR)
+			{
+				error = -1;
+				sprintf (errmsg, "(%d) %s\nAlarm on address %d of %s", error, __func__, motion.address, motion.deviceName);
+			}
+			else if (!error && motion.phase==SMCPHASESERVO && status.ServoReady)
+				phase = SMCPHASEHOME;
+			else if (!error && motion.phase==SMCPHASEHOME && status.SetOn)
+			{
+				// Homed without alarm, start the step or the written one time command. The
+				// step goes straight to IN0-IN5, SMCSetStep would clear alarms in a blocking loop.
+				error = SMCForceOutput(motion.deviceName, motion.address, SETUP, 0, errmsg);
+				if (!error && motion.specified)
+					error = smcRunSpecified(motion.deviceName, motion.address, errmsg);
+				else if (!error)
+					error = SMCWriteBatchOutput(motion.deviceName, motion.address, IN0, 6, 1, &motion.step, errmsg);
+				if (!error && !motion.specified)
+					error = SMCForceOutput(motion.deviceName, motion.address, DRIVE, 1, errmsg);
+				phase = SMCPHASEMOVE;
+			}
+			else if (!error && motion.phase==SMCPHASEHOME && !status.Busy)
+				error = SMCForceOutput(motion.deviceName, motion.address, SETUP, 1, errmsg);
+			else if (!error && motion.phase==SMCPHASEMOVE && status.InPos && motion.specified)
+			{
+				error = SMCForceOutput(motion.deviceName, motion.address, SERIALINPUT, 0, errmsg);
+				if (!error)
+					error = SMCForceOutput(motion.deviceName, motion.address, SVON, 0, errmsg);
+				phase = SMCPHASEOFF;
+			}
+			else if (!error && motion.phase==SMCPHASEMOVE && status.InPos)
+			{
+				error = SMCForceOutput(motion.deviceName, motion.address, DRIVE, 0, errmsg);
+				finished = 1;
+			}
+			else if (!error && motion.phase==SMCPHASEOFF && !status.ServoReady)
+				finished = 1;
+			
+			if (!error && !finished && phase==motion.phase && Timer()-motion.startTime>smcPhaseTimeouts[phase])
+			{
+				error = -1;
+				sprintf (errmsg, "(%d) %s\nFunction timed out on address %d of %s", error, __func__, motion.address, motion.deviceName);
+			}
+			if (!error && !finished)
+			{
+				if (phase!=motion.phase)
+				{
+					CmtGetLock(smcMotionLock);
+					if (smcMotions[i].id==motion.id)
+					{
+						smcMotions[i].phase = phase;
+						smcMotions[i].resumePhase = resume;
+						smcMotions[i].startTime = Timer();
+					}
+					CmtReleaseLock(smcMotionLock);
+				}
+				continue;
+			}
+			
+			// Done, the callback is taken in the same lock so it runs exactly once
+			CmtGetLock(smcMotionLock);
+			smcMotions[i].error = error;
+			strcpy (smcMotions[i].errmsg, error ? errmsg : "");
+			smcMotions[i].done = 1;
+			SMCMotionCallback callback = smcMotions[i].callback;
+			void *callbackData = smcMotions[i].callbackData;
+			smcMotionSignal();
+			CmtReleaseLock(smcMotionLock);
+			
+			if (callback)
+				callback(motion.id, error, error ? errmsg : "", callbackData);
+			
+			// The slot may have been released and taken by a new motion during the callback
+			CmtGetLock(smcMotionLock);
+			if (smcMotions[i].id==motion.id && smcMotions[i].released)
+				memset (&smcMotions[i], 0, sizeof(SMCMotion));
+			CmtReleaseLock(smcMotionLock);
+		}
+		
+		// Checked in the lock smcMotionBegin takes, so no motion is left unwatched
+		CmtGetLock(smcMotionLock);
+		running = 0;
+		for (int i=0; i<SMCMAXMOTIONS; ++i)
+			running |= smcMotions[i].id && smcMotions[i].started && !smcMotions[i].done;
+		if (!running)
+			smcMotionMonitorRunning = 0;
+		CmtReleaseLock(smcMotionLock);
+	}
+	
+	return 0;
+}
+//! \cond
+/// REGION END
+
 /// REGION START Utility Fns
 //! \endcond
 /***************************************************************************//*!
@@ -861,6 +1944,25 @@ void B2LE (uint8_t* Input, int Size, int* Buffer)
 		((uint8_t*) Buffer)[i] = Input[Size-i-1];
 }
 
+/***************************************************************************//*!
+* \brief Decodes the two data bytes of a 16 bit read from X40
+*******************************************************************************/
+static void smcDecodeStatus(const uint8_t bits[2], struct SMCStatus *status)
+{
+	// First byte holds X40-X47, the second X48-X4F, lowest address in bit 0
+	status->Raw = (uint16_t) (bits[0] | (bits[1] << 8));
+	for (int i=0; i<6; ++i)
+		status->Out[i] = (status->Raw >> i) & 1;
+	status->Busy		= (status->Raw >> (BUSY-OUT0)) & 1;
+	status->ServoReady	= (status->Raw >> (SVRE-OUT0)) & 1;
+	status->SetOn		= (status->Raw >> (SETON-OUT0)) & 1;
+	status->InPos		= (status->Raw >> (INP-OUT0)) & 1;
+	status->Area		= (status->Raw >> (AREA-OUT0)) & 1;
+	status->WArea		= (status->Raw >> (WAREA-OUT0)) & 1;
+	status->EStop		= (status->Raw >> (ESTOP-OUT0)) & 1;
+	status->Alarm		= (status->Raw >> (ALARM-OUT0)) & 1;
+}
+
 #define checkLim(var,lowlim,hilim)\
 	var = (var<lowlim ? lowlim : var);\
 	var = (var>hilim ? hilim : var)
@@ -881,4 +1983,37 @@ void checkStepData (struct StepData *StepData)
 }
 //! \cond
 /// REGION END
+
+/// REGION START CRC16MODBUS
+//! \endcond
+/***************************************************************************//*!
+* \brief Continues a CRC16MODBUS over more data, see SerialCrc16Update
+* 
+* Start with SMCCRC16INIT and feed the message in pieces of any size, for
+* 	example as the bytes come in. The result is sent lower byte first.
+* 
+* \param [IN] 	Crc CRC of the data so far
+* \param [IN] 	Data Next bytes of the message
+* \param [IN] 	Len Number of bytes
+*******************************************************************************/
+uint16_t SMCCrc16Update (uint16_t Crc, const uint8_t *Data, int Len)
+{
+	return SerialCrc16Update(Crc, Data, Len);
+}
+
+/***************************************************************************//*!
+* \brief Times the CRC16MODBUS variants over a pseudo random frame, see
+* 	SerialCrc16Benchmark
+* 
+* \param [IN] 	FrameLen Bytes per frame, 1-65536
+* \param [IN] 	Iterations Frames per variant
+* \param [OUT] 	NsPerFrame Bit by bit (the CRC_LIB algorithm), byte table and
+* 				slice-by-8, in nanoseconds per frame
+*******************************************************************************/
+int SMCCrc16Benchmark (int FrameLen, int Iterations, double NsPerFrame[3], char errmsg[ERRLEN])
+{
+	return SerialCrc16Benchmark(FrameLen, Iterations, NsPerFrame, errmsg);
+}
+//! \cond
+/// REGION END
 //! \endcond
\ No newline at end of file
@@ -73,6 +73,42 @@ enum StatusFlags
 	ALARM			= 0x4F
 };
 
+/***************************************************************************//*!
+* \brief All #StatusFlags (X40-X4F) from one read, see SMCGetStatus. Each flag
+* 		 is 0 or 1.
+*******************************************************************************/
+struct SMCStatus
+{
+	uint16_t	Raw;		//! X40 in bit 0 to X4F in bit 15
+	uint8_t		Out[6];		//! OUT0-OUT5
+	uint8_t		Busy;		//! Servo is moving
+	uint8_t		ServoReady;	//! SVRE, on when SVON=1
+	uint8_t		SetOn;		//! On when return to origin is done
+	uint8_t		InPos;		//! INP, on when operation is complete
+	uint8_t		Area;		//! On when between Area1 and Area2
+	uint8_t		WArea;
+	uint8_t		EStop;
+	uint8_t		Alarm;
+};
+
+/***************************************************************************//*!
+* \brief Counters of a bus scheduler, see SMCGetBusStats
+*******************************************************************************/
+struct SMCBusStats
+{
+	unsigned int	Commands;	//! Queries run for callers
+	unsigned int	Polls;		//! Status polls
+	unsigned int	PollErrors;
+	double			LastRound;	//! Seconds to poll every address once, commands included
+};
+
+/***************************************************************************//*!
+* \brief Called once when an asynchronous motion is done, see SMCMotionSetCallback
+* 
+* Result is 0 at INP, the error otherwise with Errmsg describing it
+*******************************************************************************/
+typedef void (CVICALLBACK *SMCMotionCallback) (int MotionHandle, int Result, const char *Errmsg, void *CallbackData);
+
 /***************************************************************************//*!
 * \brief State Data (D9000-D9006 and D000E words)
 *******************************************************************************/
@@ -115,6 +151,8 @@ struct StepData
 
 #define SENDDELAY 0.02	// Roughly 20ms delay between messages based on default settings
 #define MAXREPLYLEN 2060	// 2048+9 for reading from D0410 to D07FF and a little buffer
+#define SMCCRC16INIT 0xFFFF	// Start value of SMCCrc16Update
+#define SMCMAXAXES 16		// Addresses one bus scheduler polls
 #endif
 
 //==============================================================================
@@ -129,6 +167,7 @@ int CVICALLBACK FunctionSelect(int panel, int control, int event, void *callback
 int CVICALLBACK RunFunction(int panel, int control, int event, void *callbackData, int eventData1, int eventData2);
 
 int Initialize_SMC_Actuators (char *SerialConfigFile, int MainPanelHandle, char errmsg[ERRLEN]);
+int Initialize_SMC_ActuatorsEx (char *SerialConfigFile, int MainPanelHandle, int Flags, char errmsg[ERRLEN]);
 
 int SMCMotorOn (char* SerialDeviceName,
 				uint8_t Address,
@@ -179,6 +218,10 @@ int SMCReadInput (char* SerialDeviceName,
 				  uint16_t NumBitsToRead,
 				  uint8_t DataOut[16],
 				  char errmsg[ERRLEN]);
+int SMCGetStatus (char* SerialDeviceName,
+				  uint8_t Address,
+				  struct SMCStatus *Status,
+				  char errmsg[ERRLEN]);
 int SMCReadData (char* SerialDeviceName,
 				 uint8_t Address,
 				 uint16_t DataStartAddress,
@@ -217,6 +260,56 @@ int SMCGetStateData (char* SerialDeviceName,
 					 uint16_t* StepNo,
 					 char errmsg[ERRLEN]);
 
+int SMCRunStepAsync (char* SerialDeviceName,
+					 uint8_t Address,
+					 uint8_t Step,
+					 int* MotionHandle,
+					 char errmsg[ERRLEN]);
+int SMCRunWithSpecifiedAsync (char* SerialDeviceName,
+							  uint8_t Address,
+							  struct StepData StepData,
+							  int* MotionHandle,
+							  char errmsg[ERRLEN]);
+int SMCMotionPoll (int MotionHandle,
+				   int* Done,
+				   char errmsg[ERRLEN]);
+int SMCMotionWait (int MotionHandle,
+				   double Deadline,
+				   char errmsg[ERRLEN]);
+int SMCMotionWaitAny (int* MotionHandles,
+					  int NumHandles,
+					  double Deadline,
+					  int* Index,
+					  char errmsg[ERRLEN]);
+int SMCMotionWaitAll (int* MotionHandles,
+					  int NumHandles,
+					  double Deadline,
+					  char errmsg[ERRLEN]);
+int SMCMotionSetCallback (int MotionHandle,
+						  SMCMotionCallback Callback,
+						  void* CallbackData,
+						  char errmsg[ERRLEN]);
+int SMCMotionRelease (int MotionHandle,
+					  char errmsg[ERRLEN]);
+
+int SMCStartBusScheduler (char* SerialDeviceName,
+						  uint8_t* Addresses,
+						  int NumAddresses,
+						  char errmsg[ERRLEN]);
+int SMCStopBusScheduler (char* SerialDeviceName,
+						 char errmsg[ERRLEN]);
+int SMCGetBusStats (char* SerialDeviceName,
+					struct SMCBusStats *Stats,
+					char errmsg[ERRLEN]);
+
+uint16_t SMCCrc16Update (uint16_t Crc,
+						 const uint8_t *Data,
+						 int Len);
+int SMCCrc16Benchmark (int FrameLen,
+					   int Iterations,
+					   double NsPerFrame[3],
+					   char errmsg[ERRLEN]);
+
 #ifdef __cplusplus
 	}
 #endif
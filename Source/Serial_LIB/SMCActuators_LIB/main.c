@@ -29,6 +29,10 @@
 //==============================================================================
 // Include files
 
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <poll.h>
+#endif
 #include "SMC_Actuators.h"
 #include "SerialComm_LIB.h"
 #include <formatio.h>
@@ -53,6 +57,11 @@
 #define MAX_FUNCTIONS 100
 #define MAX_PARAMETERS 16
 
+#define BUSSIMCONFIG "SMCBusSim.xml"
+#define BUSSIMDEVICE "SMC_BUS_SIM"
+#define BUSSIMAXES 4
+#define BUSSIMMAXPOLLS 4096
+
 #define RunMotors(fnCall)\
 	for (int i=0; strlen(MotorNames[i])>0 && i<1000; ++i)\
 	{\
@@ -63,6 +72,19 @@
 //==============================================================================
 // Types
 
+/***************************************************************************//*!
+* \brief Simulated controllers behind one PTY, one state per address
+*******************************************************************************/
+typedef struct
+{
+	int				peer;						// Controller end of the PTY pair
+	volatile int	running;
+	int				drive[BUSSIMAXES];			// DRIVE on
+	int				pollsToInPos[BUSSIMAXES];	// Status polls left until INP after DRIVE on
+	uint8_t			polls[BUSSIMMAXPOLLS];		// Address of every status poll, in order
+	int				numPolls;
+} BusSimulator;
+
 //==============================================================================
 // Static global variables
 
@@ -106,6 +128,10 @@ static void usage (char *name)
 	fprintf (stderr, "Order of operation: Change based on library\n");
 	fprintf (stderr, "flag: function 1\n");
 	fprintf (stderr, "flag: function 2\n");
+	fprintf (stderr, "-crcbench [iterations]: time CRC16MODBUS bitwise, table and slice-by-8, no controller needed\n");
+	fprintf (stderr, "-bus: run step 0 on all motors at once through bus schedulers\n");
+	fprintf (stderr, "-async: start step 0 on all motors, wait for the first and then the rest\n");
+	fprintf (stderr, "-bussim: step 0 on %d simulated controllers sharing one PTY bus, checks that their polls interleave\n", BUSSIMAXES);
 	exit (1);
 }
 
@@ -138,6 +164,217 @@ int CVICALLBACK QuitUICB(int panel, int event, void *callbackData, int eventData
 //! \cond
 /// REGION END
 
+/// REGION START Bus Simulation
+//! \endcond
+#ifndef _WIN32
+/***************************************************************************//*!
+* \brief Answer one Modbus request for the simulated controller at an address
+* 
+* Every controller is servo ready and homed. INP goes off when DRIVE is turned
+* 	on and comes back after a few status polls, so the axes wait on the bus at
+* 	the same time.
+* 
+* \return Reply length with CRC, 0 if the address is not simulated
+*******************************************************************************/
+static int BusSimReply (BusSimulator *Sim, const uint8_t *Request, uint8_t *Reply)
+{
+	int axis = Request[0]-1;
+	int len = 0;
+	
+	if (axis<0 || axis>=BUSSIMAXES)
+		return 0;
+	Reply[0] = Request[0];
+	Reply[1] = Request[1];
+	switch (Request[1])
+	{
+		case 0x02:
+		{
+			// X40-X4F, only SVRE, SETON and INP are used
+			if (Sim->numPolls<BUSSIMMAXPOLLS)
+				Sim->polls[Sim->numPolls++] = Request[0];
+			if (Sim->pollsToInPos[axis]>0)
+				--Sim->pollsToInPos[axis];
+			int inPos = !Sim->drive[axis] || !Sim->pollsToInPos[axis];
+			uint16_t raw = (uint16_t) ((1 << (SVRE-OUT0)) | (1 << (SETON-OUT0)) | (inPos << (INP-OUT0)));
+			Reply[2] = 2;
+			Reply[3] = (uint8_t) (raw & 0xFF);
+			Reply[4] = (uint8_t) (raw >> 8);
+			len = 5;
+			break;
+		}
+		case 0x01:
+		case 0x03:
+		{
+			int count = Request[1]==0x01 ? (Request[5]+7)/8 : 2*Request[5];
+			Reply[2] = (uint8_t) count;
+			memset (Reply+3, 0, (size_t) count);
+			len = 3+count;
+			break;
+		}
+		case 0x05:
+			if (Request[3]==DRIVE)
+			{
+				Sim->drive[axis] = Request[4]==0xFF;
+				Sim->pollsToInPos[axis] = 3;
+			}
+			// fall through, the reply echoes the request
+		case 0x06:
+		case 0x08:
+		case 0x0F:
+		case 0x10:
+			memcpy (Reply+2, Request+2, 4);
+			len = 6;
+			break;
+		default:
+			Reply[1] |= 0x80;
+			Reply[2] = 1;
+			len = 3;
+			break;
+	}
+	uint16_t crc = SerialCrc16Update(SERIALCRC16INIT, Reply, len);
+	Reply[len] = (uint8_t) (crc & 0xFF);
+	Reply[len+1] = (uint8_t) (crc >> 8);
+	return len+2;
+}
+
+/***************************************************************************//*!
+* \brief Reads the requests on the bus and answers them like the controllers
+*******************************************************************************/
+static int CVICALLBACK BusSimThread (void *functionData)
+{
+	BusSimulator *sim = (BusSimulator*) functionData;
+	uint8_t buffer[600];
+	uint8_t reply[300];
+	int len = 0;
+	
+	while (sim->running)
+	{
+		struct pollfd pfd = {sim->peer, POLLIN, 0};
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+		ssize_t count = read(sim->peer, buffer+len, sizeof(buffer)-(size_t) len);
+		if (count <= 0)
+			continue;
+		len += (int) count;
+		
+		// Requests are 8 bytes, the batch writes carry a byte count
+		while (len >= 8)
+		{
+			int requestLen = buffer[1]==0x0F || buffer[1]==0x10 ? 9+buffer[6] : 8;
+			if (requestLen > (int) sizeof(buffer))
+			{
+				len = 0;
+				break;
+			}
+			if (len < requestLen)
+				break;
+			int replyLen = BusSimReply(sim, buffer, reply);
+			if (replyLen)
+				write(sim->peer, reply, (size_t) replyLen);
+			memmove (buffer, buffer+requestLen, (size_t) (len-requestLen));
+			len -= requestLen;
+		}
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief One axis of the simulated bus, functionData is its address
+*******************************************************************************/
+static int CVICALLBACK BusSimAxisThread (void *functionData)
+{
+	char errmsg[ERRLEN] = {0};
+	
+	int error = SMCRunStep(BUSSIMDEVICE, (uint8_t) (intptr_t) functionData, 0, errmsg);
+	if (error)
+		fprintf (stderr, "Address %d: %s\n", (int) (intptr_t) functionData, errmsg);
+	return error;
+}
+#endif
+
+/***************************************************************************//*!
+* \brief Runs step 0 on BUSSIMAXES simulated controllers that share one PTY
+* 		 bus through a bus scheduler, and checks that the scheduler polled
+* 		 them in turn instead of one axis after the other
+* 
+* Writes BUSSIMCONFIG to the current directory and reads it, call it before
+* 	any port is opened.
+*******************************************************************************/
+static int RunBusSimulation (char errmsg[ERRLEN])
+{
+	fnInit;
+	
+#ifndef _WIN32
+	static BusSimulator sim = {0};
+	uint8_t addresses[BUSSIMAXES] = {0};
+	CmtThreadFunctionID simID = 0;
+	CmtThreadFunctionID axisIDs[BUSSIMAXES] = {0};
+	struct SMCBusStats stats = {0};
+	int schedulerStarted = 0, moveError = 0, switches = 0;
+	char cleanupErrmsg[ERRLEN] = {0};
+	FILE *config = fopen(BUSSIMCONFIG, "w");
+	
+	tsErrChk (config ? 0 : -1, "Unable to write %s", BUSSIMCONFIG);
+	fprintf (config, "<?xml version=\"1.0\"?>\n<SerialHW>\n<Serial>\n<DeviceName>%s</DeviceName>\n<Comport>PTY</Comport>\n"
+			 "<BaudRate>38400</BaudRate>\n<Parity>None</Parity>\n<DataBits>8</DataBits>\n<StopBits>1</StopBits>\n"
+			 "<CTSMode>Off</CTSMode>\n<XonXoff>Off</XonXoff>\n<Timeout>2</Timeout>\n</Serial>\n</SerialHW>\n", BUSSIMDEVICE);
+	fclose (config);
+	tsErrChk (ReadSerialConfigurationFile(BUSSIMCONFIG) < 1 ? -1 : 0, "No devices found in %s", BUSSIMCONFIG);
+	tsErrChk (InitSerialDevice(BUSSIMDEVICE, errmsg), errmsg);
+	
+	memset (&sim, 0, sizeof(sim));
+	sim.peer = GetSerialLoopbackPeer(GetSerialDeviceHandle(BUSSIMDEVICE, errmsg), errmsg);
+	tsErrChk (sim.peer<0 ? sim.peer : 0, errmsg);
+	sim.running = 1;
+	CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, BusSimThread, &sim, &simID);
+	
+	for (int i=0; i<BUSSIMAXES; ++i)
+		addresses[i] = (uint8_t) (i+1);
+	tsErrChk (SMCStartBusScheduler(BUSSIMDEVICE, addresses, BUSSIMAXES, errmsg), errmsg);
+	schedulerStarted = 1;
+	
+	for (int i=0; i<BUSSIMAXES; ++i)
+		CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, BusSimAxisThread, (void*) (intptr_t) addresses[i], &axisIDs[i]);
+	for (int i=0; i<BUSSIMAXES; ++i)
+	{
+		int threadError = 0;
+		CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, axisIDs[i], OPT_TP_PROCESS_EVENTS_WHILE_WAITING);
+		CmtGetThreadPoolFunctionAttribute(DEFAULT_THREAD_POOL_HANDLE, axisIDs[i], ATTR_TP_FUNCTION_RETURN_VALUE, &threadError);
+		CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, axisIDs[i]);
+		moveError = moveError ? moveError : threadError;
+	}
+	tsErrChk (moveError, "Step 0 failed on the simulated bus, see above");
+	
+	// Polled one axis after the other the address would change BUSSIMAXES-1 times
+	tsErrChk (SMCGetBusStats(BUSSIMDEVICE, &stats, errmsg), errmsg);
+	for (int i=1; i<sim.numPolls; ++i)
+		switches += sim.polls[i]!=sim.polls[i-1];
+	fprintf (stderr, "%u commands, %u polls, %u poll errors, %.3fs per round, %d address changes\n",
+			 stats.Commands, stats.Polls, stats.PollErrors, stats.LastRound, switches);
+	tsErrChk (stats.Polls!=(unsigned int) sim.numPolls || stats.PollErrors ? -1 : 0,
+			  "Bus stats show %u polls and %u errors, the controllers answered %d polls", stats.Polls, stats.PollErrors, sim.numPolls);
+	tsErrChk (switches<=BUSSIMAXES-1 ? -1 : 0, "Polls were not interleaved, the address changed %d times", switches);
+	
+Error:
+	if (schedulerStarted)
+		SMCStopBusScheduler(BUSSIMDEVICE, cleanupErrmsg);
+	sim.running = 0;
+	if (simID)
+	{
+		CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, simID, 0);
+		CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, simID);
+	}
+	CloseSerialDevice(BUSSIMDEVICE, cleanupErrmsg);
+#else
+	tsErrChk (-1, "The bus simulation needs PTY devices, which Windows does not have");
+	
+Error:
+#endif
+	return error;
+}
+//! \cond
+/// REGION END
+
 /// REGION START UI Callbacks
 //! \endcond
 /***************************************************************************//*!
@@ -233,7 +470,10 @@ int CVICALLBACK RunMotorThread (void *functionData)
 {
 	char errmsg[ERRLEN] = {0};
 	
-	SMCRunStep(MotorNames[((int*)functionData)[0]],1,((int*)functionData)[1],errmsg);
+	int error = SMCRunStep(MotorNames[((int*)functionData)[0]],1,((int*)functionData)[1],errmsg);
+	if (error)
+		fprintf (stderr, "%s: %s\n", MotorNames[((int*)functionData)[0]], errmsg);
+	return error;
 }
 
 //! \cond
@@ -312,10 +552,34 @@ int main (int argc, char *argv[])
 	if(argc > 1 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")))
 		usage(argv[0]);
 	
+	if(argc > 1 && !strcmp(argv[1], "-crcbench"))
+	{
+		// Frame sizes of a bit read, SMCWriteStep, the largest SMCWriteData request and SMCReadData reply
+		int frameLens[] = {6, 39, 257, 2057};
+		int iterations = argc > 2 ? atoi(argv[2]) : 100000;
+		double nsPerFrame[3] = {0};
+		
+		fprintf (stderr, "Bytes\tBitwise ns\tTable ns\tSlice-by-8 ns\n");
+		for (int i=0; i<4; ++i)
+		{
+			tsErrChk (SMCCrc16Benchmark(frameLens[i], iterations, nsPerFrame, errmsg), errmsg);
+			fprintf (stderr, "%d\t%.0f\t\t%.0f\t\t%.0f\n", frameLens[i], nsPerFrame[0], nsPerFrame[1], nsPerFrame[2]);
+		}
+		error = 0;
+		goto Error;
+	}
+	
 	fprintf (stderr, "Initializing SMC Library\n");
 	tsErrChk (Initialize_SMC_Actuators("Serial.xml", glbMainPanelHandle, errmsg), errmsg);
 	fprintf (stderr, "SMC Library Iniialized\n");
 	
+	if(argc > 1 && !strcmp(argv[1], "-bussim"))
+	{
+		tsErrChk (RunBusSimulation(errmsg), errmsg);
+		fprintf (stderr, "Polls of the simulated controllers were interleaved\n");
+		goto Error;
+	}
+	
 	// Parser for input arguments
 	for(int i = 0; i < argc; i++)
 	{
@@ -345,10 +609,91 @@ int main (int argc, char *argv[])
 	//uint16_t curSpd, curThrust, stepNo;
 	//RunMotors (SMCGetStateData(MotorNames[i],1,&curPos,&curSpd,&curThrust,&targPos,&stepNo,errmsg));
 	
-	for(int i = 0; i<4; i++)
+	int busMode = 0, asyncMode = 0;
+	for(int i = 0; i < argc; i++)
+	{
+		busMode |= !strcmp(argv[i], "-bus");
+		asyncMode |= !strcmp(argv[i], "-async");
+	}
+	
+	if (asyncMode)
+	{
+		// All four start right away, other instruments could be measured while they move
+		fprintf (stderr, "Start step 0 on all motors\n");
+		int motions[4] = {0};
+		int first = -1;
+		for (int i=0; i<4 && !error; ++i)
+			error = SMCRunStepAsync(MotorNames[i], 1, 0, &motions[i], errmsg);
+		
+		if (!error)
+			error = SMCMotionWaitAny(motions, 4, Timer()+10.0, &first, errmsg);
+		if (!error)
+			fprintf (stderr, "%s in position first\n", MotorNames[first]);
+		if (!error)
+			error = SMCMotionWaitAll(motions, 4, Timer()+10.0, errmsg);
+		
+		// Also the motions started before a start failed, their slots would stay taken
+		char releaseErrmsg[ERRLEN] = {0};
+		for (int i=0; i<4; ++i)
+			if (motions[i])
+				SMCMotionRelease(motions[i], releaseErrmsg);
+		tsErrChk (error, errmsg);
+	}
+	else if (busMode)
+	{
+		// One scheduler per port polls the address of its axis, all four move at once
+		fprintf (stderr, "Run step 0 on all motors through bus schedulers\n");
+		uint8_t address = 1;
+		int started[4] = {0};
+		int moveError = 0;
+		for (int i=0; i<4 && !error; ++i)
+		{
+			error = SMCStartBusScheduler(MotorNames[i], &address, 1, errmsg);
+			started[i] = !error;
+		}
+		
+		CmtThreadPoolHandle MotorMoveHandle = 0;
+		CmtThreadFunctionID moveIDs[4] = {0};
+		int threadData[4][2] = {{0,0},{1,0},{2,0},{3,0}};
+		if (!error)
+		{
+			CmtNewThreadPool(4,&MotorMoveHandle);
+			for (int i=0; i<4; ++i)
+				CmtScheduleThreadPoolFunction(MotorMoveHandle,RunMotorThread,threadData[i],&moveIDs[i]);
+			for (int i=0; i<4; ++i)
+			{
+				int threadError = 0;
+				CmtWaitForThreadPoolFunctionCompletion(MotorMoveHandle,moveIDs[i],OPT_TP_PROCESS_EVENTS_WHILE_WAITING);
+				CmtGetThreadPoolFunctionAttribute(MotorMoveHandle,moveIDs[i],ATTR_TP_FUNCTION_RETURN_VALUE,&threadError);
+				CmtReleaseThreadPoolFunctionID(MotorMoveHandle,moveIDs[i]);
+				moveError = moveError ? moveError : threadError;
+			}
+			CmtDiscardThreadPool(MotorMoveHandle);
+		}
+		
+		// Every started scheduler is stopped, the stats are only printed
+		struct SMCBusStats stats = {0};
+		char busErrmsg[ERRLEN] = {0};
+		for (int i=0; i<4; ++i)
+		{
+			if (!started[i])
+				continue;
+			if (!SMCGetBusStats(MotorNames[i], &stats, busErrmsg))
+				fprintf (stderr, "%s: %u commands, %u polls, %u poll errors, %.3fs per round\n", MotorNames[i],
+						 stats.Commands, stats.Polls, stats.PollErrors, stats.LastRound);
+			if (SMCStopBusScheduler(MotorNames[i], busErrmsg))
+				fprintf (stderr, "%s\n", busErrmsg);
+		}
+		tsErrChk (error, "%s", errmsg);
+		tsErrChk (moveError, "Moving the motors through the bus schedulers failed, see above");
+	}
+	else
 	{
-		if(error = SMCRunStep(MotorNames[i], 1, 0,errmsg)) //Address = 1???? Chao: How to choose Address Num?
-			goto Error; // Check connections for 4 motors
+		for(int i = 0; i<4; i++)
+		{
+			if(error = SMCRunStep(MotorNames[i], 1, 0,errmsg)) //Address = 1???? Chao: How to choose Address Num?
+				goto Error; // Check connections for 4 motors
+		}
 	}
 	
 	
@@ -14,6 +14,27 @@
 * ------------|---------------|-------------------|-----------------------------
 * 1.0.0       | May 5, 2014   | Arxtron      	  | Initial Release
 * 1.0.1		  | Nov 9, 2020   | Jai Prajapati     | Updated with library format
+* 1.1.0		  | Oct 16, 2026  | Arxtron      	  | Device handles with hashed name lookup
+* 1.1.1		  | Oct 16, 2026  | Arxtron      	  | Settings decoded once into port descriptors
+* 1.2.0		  | Oct 16, 2026  | Arxtron      	  | Background receive engine with ring buffers
+* 1.2.1		  | Oct 16, 2026  | Arxtron      	  | WaitForBytes and WaitForPattern
+* 1.3.0		  | Oct 16, 2026  | Arxtron      	  | Transport layer with RS-232, termios and PTY backends
+* 1.3.1		  | Oct 16, 2026  | Arxtron      	  | Vectored writes (WriteSerialDeviceV)
+* 1.4.0		  | Oct 16, 2026  | Arxtron      	  | Pipelined request mode with tagged requests
+* 1.4.1		  | Oct 16, 2026  | Arxtron      	  | Fair per-port locks and transaction lock
+* 1.5.0		  | Oct 16, 2026  | Arxtron      	  | Error event queue, popups only in UI debug mode
+* 1.5.1		  | Oct 16, 2026  | Arxtron      	  | Binary wire capture and offline decoder
+* 1.5.2		  | Oct 16, 2026  | Arxtron      	  | GetSerialHandleSettings, PTY benchmark in main
+* 1.6.0		  | Oct 16, 2026  | Arxtron      	  | Streaming configuration parser with binary snapshot, no port limit
+* 1.6.1		  | Oct 16, 2026  | Arxtron      	  | Incremental configuration reload
+* 1.6.2		  | Oct 16, 2026  | Arxtron      	  | Headless initialization, panels created on first use
+* 1.7.0		  | Oct 16, 2026  | Arxtron      	  | Parallel port scanner with device identification
+* 1.7.1		  | Oct 16, 2026  | Arxtron      	  | Response latency histogram and adaptive timeouts
+* 1.8.0		  | Oct 16, 2026  | Arxtron      	  | Framing rules with zero-copy frames from the receive engine
+* 1.8.1		  | Oct 16, 2026  | Arxtron      	  | Compiled command templates, debug write box decodes escapes in one pass
+* 1.8.2		  | Oct 16, 2026  | Arxtron      	  | Broadcast a request to several devices and gather the replies concurrently
+* 1.8.3		  | Oct 16, 2026  | Arxtron      	  | SerialTransact write-then-read under one lock with a timing breakdown per device
+* 1.8.4		  | Oct 16, 2026  | Arxtron      	  | SerialTransactV sends the request as a vectored write
 *******************************************************************************/
 
 //! \cond
@@ -23,7 +44,25 @@
 //==============================================================================
 // Include files
 
+#ifndef _WIN32
+	#define _GNU_SOURCE		// posix_openpt and cfmakeraw
+#endif
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <stdlib.h>
+	#include <pthread.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <termios.h>
+	#include <poll.h>
+	#include <sys/ioctl.h>
+	#include <sys/uio.h>
+	#include <dirent.h>
+#endif
 #include "cvixml.h"
+#include <stdint.h>
 #include <ansi_c.h>
 #include <userint.h>
 #include <utility.h>
@@ -34,17 +73,546 @@
 //==============================================================================
 // Constants
 
+#define SERIALPORTCHUNK		64		// Ports allocated together, a port never moves once allocated
+#define SERIALMAXCHUNKS		256		// Up to 16384 ports
+#define SERIALHASHMINSIZE	128		// Smallest name hash table, power of 2
+
+#define SERIALLATENCYBUCKETS	280		// 8 per power of 2 of microseconds, up to about 19 hours
+#define SERIALLATENCYWINDOW		1000	// Counts are halved at this many samples, recent replies weigh more
+#define SERIALLATENCYMINSAMPLES	20		// Below this the configured timeout is used
+#define SERIALADAPTIVEFACTOR	3.0		// Defaults of SetSerialAdaptiveTimeout
+#define SERIALADAPTIVEFLOOR		0.05
+
+#define SERIALSCANMAXCOM		256		// COM1 to COM256 are checked on Windows
+#define SERIALSCANMAXPORTS		512
+#define SERIALSCANBAUDRATES		{38400, 9600, 115200, 19200, 57600}		// Tried in this order
+
+#define SERIALREOPEN			1		// Returned by reconfigure when the settings can not be changed on an open port
+#define SERIALRECONFIGURED		2
+
+#define SERIALSNAPSHOTEXT		".cache"	// Appended to the configuration file path
+#define SERIALSNAPSHOTMAGIC		"SCFG"
+#define SERIALSNAPSHOTVERSION	2			// 2: settings validated when parsed
+
+#define CRC16SLICES			8		// Bytes per step of the slice-by-N CRC, one table per byte
+
+#define SERIALRXMINSIZE		4096	// Smallest receive engine ring, power of 2
+#define SERIALRXDEFAULTSIZE	65536
+#define SERIALRXPOLLTIME	0.05	// Port timeout while the receive engine runs, bounds how long stopping takes
+
+#define SERIALPIPELINEDEPTH	32		// Requests that can be outstanding on a pipelined device
+
+#define SERIALFRAMEGAP		0.02	// Silence after which a partial Modbus frame is taken as noise, above USB adapter latency
+
+#define SERIALTEMPLATEMAXLEN	1024	// Longest command WriteSerialTemplate renders
+
+#define SERIALERRORQUEUELEN	128		// Error events kept until popped, power of 2
+
+#define SERIALCAPTUREMAGIC			"SCAP"
+#define SERIALCAPTUREVERSION		1
+#define SERIALCAPTUREMINSIZE		4096	// Smallest capture ring, power of 2
+#define SERIALCAPTUREDEFAULTSIZE	262144
+#define SERIALCAPTUREFLUSHTIME		0.05	// Interval of the capture writer
+
 //==============================================================================
 // Types
 
+// Handles of devices removed by ReloadSerialConfigurationFile stay invalid
+#define handleErrChk(Handle)\
+	libErrChk (serialHandleValid(Handle) ? 0 : ERR_INVALID_SERIAL_HANDLE, "Invalid serial device handle: %d", Handle)
+
+// Takes the port lock, the device may have been removed while waiting for it
+#define handleLock(Handle,lock)\
+	lock = serialLockAcquire(&serialPort((Handle)-1)->lock);\
+	libErrChk (serialPort((Handle)-1)->name[0] ? 0 : ERR_INVALID_SERIAL_HANDLE, "Serial device handle %d was removed", Handle)
+
+#define nameToHandle(SerialDeviceName,Handle)\
+	Handle = getFileInfoIndexFromName(SerialDeviceName) + 1;\
+	libErrChk (Handle < 1 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName)
+
+#define serialPort(Index)	(&glbSerialPortChunks[(Index) / SERIALPORTCHUNK][(Index) % SERIALPORTCHUNK])
+
+#define openErrChk(Handle)\
+	libErrChk (serialPort((Handle)-1)->desc.portOpen!=1 ? -1 : 0, "Device %s is not open", serialPort((Handle)-1)->name)
+
+#ifdef _WIN32
+	#define SerialMemoryBarrier()	MemoryBarrier()
+	#define SerialCompareExchange(Target,Expected,Value)	(InterlockedCompareExchange((Target), (Value), (Expected)) == (Expected))
+	#define SerialAtomicIncrement(Target)					InterlockedIncrement(Target)
+#else
+	#define SerialMemoryBarrier()	__sync_synchronize()
+	#define SerialCompareExchange(Target,Expected,Value)	__sync_bool_compare_and_swap((Target), (Expected), (Value))
+	#define SerialAtomicIncrement(Target)					__sync_add_and_fetch((Target), 1)
+#endif
+
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE				event;
+#else
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	int					signaled;
+#endif
+} SerialSignal;
+
+/***************************************************************************//*!
+* \brief Fair recursive lock of one port, see serialLockAcquire
+*******************************************************************************/
+typedef struct
+{
+#ifdef _WIN32
+	CRITICAL_SECTION		cs;
+	CONDITION_VARIABLE		cond;
+#else
+	pthread_mutex_t			mutex;
+	pthread_cond_t			cond;
+#endif
+	unsigned int			nextTicket;
+	unsigned int			nowServing;
+	int						owner;			// CVI thread ID of the holder
+	int						depth;
+} SerialPortLock;
+
+/***************************************************************************//*!
+* \brief Receive engine of one port. head is only written by the reader thread
+* 		 and tail only by the consumer; both run freely and are masked with
+* 		 size-1 when indexing the buffer.
+*******************************************************************************/
+typedef struct
+{
+	unsigned char			*buffer;
+	unsigned int			size;			// Power of 2
+	volatile unsigned int	head;
+	volatile unsigned int	tail;
+	volatile int			running;
+	int						pumped;			// Ring without reader thread, filled by the consumer, see rxPumpStart
+	int						index;			// Index of the port, handle-1
+	int						threadID;
+	unsigned int			stalls;			// Times the reader found the ring full
+	int						lastError;		// Last transport error seen by the reader
+	SerialSignal			dataReady;
+	int						signalReady;	// dataReady is initialized
+	int						waiters;		// WaitForBytes/WaitForPattern calls sleeping without the port lock
+} SerialRxEngine;
+
+/***************************************************************************//*!
+* \brief Request sent in pipelined mode that still waits for its reply
+*******************************************************************************/
+typedef struct
+{
+	int						tag;
+	int						terminationByte;
+} SerialPendingRequest;
+
+/***************************************************************************//*!
+* \brief Pipelined session of one port. Requests are queued at head when sent
+* 		 and matched to replies from tail, in order.
+*******************************************************************************/
+typedef struct
+{
+	int						enabled;
+	int						startedEngine;	// Turning the mode on started the receive engine
+	unsigned int			nextTag;
+	unsigned int			head;
+	unsigned int			tail;
+	SerialPendingRequest	pending[SERIALPIPELINEDEPTH];
+} SerialPipeline;
+
+/***************************************************************************//*!
+* \brief Slot of the error queue. sequence tells whose turn the slot is: equal
+* 		 to the write position when free, one past it once filled.
+*******************************************************************************/
+typedef struct
+{
+	volatile long			sequence;
+	SerialErrorEvent		event;
+} SerialErrorSlot;
+
+/***************************************************************************//*!
+* \brief Start of a capture file, followed by records
+*******************************************************************************/
+typedef struct
+{
+	char					magic[4];		// SERIALCAPTUREMAGIC
+	uint32_t				version;
+	uint64_t				startNs;		// Monotonic time the capture started
+	uint64_t				wallTime;		// time() the capture started
+} SerialCaptureFileHeader;
+
+/***************************************************************************//*!
+* \brief Header of one captured chunk, followed by length bytes of data. A
+* 		 SERIAL_CAPTURE_NAME record carries the device name of the handle.
+*******************************************************************************/
+typedef struct
+{
+	uint64_t				timestamp;		// Monotonic nanoseconds
+	uint16_t				handle;
+	uint8_t					direction;		// #SerialCaptureDirection
+	uint8_t					reserved;
+	uint32_t				length;
+} SerialCaptureRecord;
+
+/***************************************************************************//*!
+* \brief Capture ring of one port. Producers serialize on busy, the writer
+* 		 thread is the only consumer.
+*******************************************************************************/
+typedef struct
+{
+	unsigned char			*buffer;
+	unsigned int			size;			// Power of 2
+	volatile unsigned int	head;
+	volatile unsigned int	tail;
+	volatile long			busy;
+} SerialCaptureRing;
+
+typedef struct
+{
+	SerialCaptureRecord		record;
+	unsigned char			*data;
+	int						order;			// Position in the file, keeps the sort stable
+} SerialCaptureEntry;
+
+typedef struct
+{
+	unsigned char			data[1024];
+	int						len;
+} SerialCaptureStream;
+
+typedef struct SerialTransport SerialTransport;
+
+/***************************************************************************//*!
+* \brief Operations of a transport backend. Every call returns a negative
+* 		 error code on failure, read, write and wait return a byte count
+* 		 otherwise.
+*******************************************************************************/
+typedef struct
+{
+	const char	*name;
+	int			(*open)(SerialTransport *port, const SerialPortDesc *desc, const char *path);
+	int			(*close)(SerialTransport *port);
+	int			(*write)(SerialTransport *port, const SerialIOVec *segments, int numSegments);
+	int			(*read)(SerialTransport *port, char *data, int len, int terminationByte);	// Blocks up to the port timeout, -1 for no terminator
+	int			(*inQLen)(SerialTransport *port);
+	int			(*flush)(SerialTransport *port, int inQueue);
+	int			(*wait)(SerialTransport *port, char *data, int len, double timeout);		// Reads what has arrived, blocking up to timeout for the first byte, 0 on timeout
+	int			(*setTimeout)(SerialTransport *port, double timeout);
+	int			(*reconfigure)(SerialTransport *port, const SerialPortDesc *from, const SerialPortDesc *to);	// SERIALREOPEN if the port has to be reopened
+} SerialTransportOps;
+
+/***************************************************************************//*!
+* \brief Open connection of one port
+*******************************************************************************/
+struct SerialTransport
+{
+	const SerialTransportOps	*ops;
+	int							comport;		// RS-232 backend
+	int							fd;				// termios and PTY backends
+	int							peerFd;			// Master side of a PTY pair, -1 otherwise
+	double						timeout;
+	int							lastErrno;
+};
+
+/***************************************************************************//*!
+* \brief Response latency of one port: time from a write to the first data
+* 		 read after it, in a histogram with about 12% resolution
+*******************************************************************************/
+typedef struct
+{
+	uint32_t					buckets[SERIALLATENCYBUCKETS];
+	uint32_t					count;
+	uint32_t					timeouts;		// Reads after a write that returned nothing
+	uint64_t					maxNs;
+	uint64_t					lastWriteNs;	// Start of the exchange, 0 once its reply was seen
+	int							adaptive;
+	double						safetyFactor;
+	double						floor;
+	double						ceiling;
+} SerialLatency;
+
+/***************************************************************************//*!
+* \brief Framing state of one port. Positions are receive ring positions like
+* 		 head and tail.
+*******************************************************************************/
+typedef struct
+{
+	int							active;
+	SerialFrameRule				rule;
+	unsigned int				scanned;		// Terminator search resumes here
+	unsigned int				frameLen;		// Frame handed out and not released yet, at tail
+	unsigned int				idleHead;		// Head when the last byte arrived
+	double						idleSince;
+	unsigned int				dropped;		// Bytes discarded to find the next frame
+	unsigned int				crcErrors;
+} SerialFramer;
+
+/***************************************************************************//*!
+* \brief Step of a compiled command template
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_TEMPLATE_LITERAL	= 0,	// Bytes from the literal pool
+	SERIAL_TEMPLATE_INT		= 1,	// {d}, {dN}: int, decimal, at least N digits
+	SERIAL_TEMPLATE_DOUBLE	= 2,	// {f}, {fN}: double, N decimals, 6 by default
+	SERIAL_TEMPLATE_HEX		= 3,	// {x}, {xN}: unsigned int, upper case hex, at least N digits
+	SERIAL_TEMPLATE_STRING	= 4,	// {s}: null terminated string
+	SERIAL_TEMPLATE_BYTE	= 5		// {c}: int sent as one byte, can be 0
+} SerialTemplateOpType;
+
+typedef struct
+{
+	unsigned char				type;			// #SerialTemplateOpType
+	unsigned char				digits;
+	unsigned short				len;			// Literal length
+	unsigned int				offset;			// Literal offset in the pool
+} SerialTemplateOp;
+
+struct SerialTemplate
+{
+	int							numOps;
+	int							numSlots;
+	int							literalLen;		// Bytes sent whatever the arguments are
+	SerialTemplateOp			*ops;
+	unsigned char				*literals;
+};
+
+/***************************************************************************//*!
+* \brief Running totals of the SerialTransact calls of one port, the phase
+* 		 arrays are indexed queue wait, write, first byte, last byte
+*******************************************************************************/
+typedef struct
+{
+	int							count;
+	int							failed;
+	int							timeouts;
+	double						sum[4];
+	double						max[4];
+	int64_t						bytesWritten;
+	int64_t						bytesRead;
+	int							maxWritten;
+	int							maxRead;
+} SerialTransactTotals;
+
+/***************************************************************************//*!
+* \brief Everything the library keeps for one port
+*******************************************************************************/
+typedef struct
+{
+	SerialPortDesc				desc;
+	char						name[MAXDEVICENAMELEN];
+	char						path[MAXDEVICENAMELEN];		// Comport setting as written in the configuration file
+	SerialTransport				transport;
+	SerialRxEngine				rx;
+	SerialPipeline				pipeline;
+	SerialPortLock				lock;						// Serializes all I/O calls on the port
+	SerialCaptureRing			capture;
+	SerialLatency				latency;
+	SerialFramer				framer;
+	SerialTransactTotals		transact;
+} SerialPort;
+
+/***************************************************************************//*!
+* \brief One device as read from the configuration file, also the record of
+* 		 the configuration snapshot
+*******************************************************************************/
+typedef struct
+{
+	SerialPortDesc				desc;
+	char						name[MAXDEVICENAMELEN];
+	char						path[MAXDEVICENAMELEN];
+} SerialConfigEntry;
+
+/***************************************************************************//*!
+* \brief Start of a configuration snapshot, followed by count entries
+*******************************************************************************/
+typedef struct
+{
+	char						magic[4];		// SERIALSNAPSHOTMAGIC
+	uint32_t					version;
+	uint32_t					entrySize;		// sizeof(SerialConfigEntry), catches layout changes
+	uint32_t					count;
+	uint64_t					xmlHash;		// FNV-1a of the XML file the snapshot was made from
+	uint64_t					xmlSize;
+} SerialConfigSnapshotHeader;
+
+/***************************************************************************//*!
+* \brief Work of one scanner thread, a single port
+*******************************************************************************/
+typedef struct
+{
+	char						port[MAXDEVICENAMELEN];
+	double						probeTimeout;
+	int							smcFirstAddress;	// SMC controller addresses to probe
+	int							smcLastAddress;
+	int							threadID;
+	SerialScanResult			result;
+} SerialScanJob;
+
+/***************************************************************************//*!
+* \brief Work of one broadcast thread, a single device
+*******************************************************************************/
+typedef struct
+{
+	const char					*request;
+	int							requestLen;
+	const SerialFrameRule		*rule;
+	double						timeout;
+	double						start;
+	int							threadID;
+	SerialBroadcastResult		*result;
+} SerialBroadcastJob;
+
+typedef struct
+{
+	int							handle;			// Device handle (index+1), 0 if empty
+	unsigned int				key;			// Full hash of the name
+} SerialNameSlot;
+
+/***************************************************************************//*!
+* \brief Open addressing table of device names, replaced as a whole when it
+* 		 has to grow
+*******************************************************************************/
+typedef struct
+{
+	unsigned int				size;			// Power of 2, at least twice the number of devices
+	SerialNameSlot				*slots;
+} SerialNameHash;
+
 //==============================================================================
 // Static global variables
 
 static int libInitialized = 0;
 
+static SerialNameHash *volatile glbSerialNameHash = 0;
+
+static SerialPortLock glbSerialConfigLock;					// Held while the port table is rebuilt
+static volatile long glbSerialConfigLockState = 0;		// 0 none, 1 being created, 2 ready
+
+static SerialPort *glbSerialPortChunks[SERIALMAXCHUNKS] = {0};
+static int glbSerialPortsAllocated = 0;
+
+static CmtThreadPoolHandle glbSerialRxThreadPool = 0;		// Receive engines and the capture writer
+
+
+static SerialErrorSlot glbSerialErrorQueue[SERIALERRORQUEUELEN];
+static volatile long glbSerialErrorWritePos = 0;
+static volatile long glbSerialErrorReadPos = 0;
+static volatile long glbSerialErrorsDropped = 0;
+static SerialErrorCallback glbSerialErrorCallback = 0;
+static void *glbSerialErrorCallbackData = 0;
+static int glbSerialUIDebugMode = 0;
+
+static FILE *glbSerialCaptureFile = 0;
+static char glbSerialCapturePath[MAX_PATHNAME_LEN] = {0};
+static volatile int glbSerialCaptureActive = 0;		// Producers record while set
+static volatile int glbSerialCaptureRunning = 0;		// Writer thread runs while set
+static int glbSerialCaptureThreadID = 0;
+static volatile long glbSerialCaptureDropped = 0;
+
 //==============================================================================
 // Static functions
 
+static unsigned int hashDeviceName(const char *DeviceName);
+static int buildDeviceNameHash(void);
+static int decodeSerialParam(SerialPortDesc *desc, char *deviceName, char *devicePath, int param, const char *value);
+static void formatSerialFileInfo(int index, SerialFileInfoStruct *info);
+static int reserveSerialPorts(int count);
+static int reloadSerialPort(int index, const SerialConfigEntry *entry, char errmsg[ERRLEN]);
+static int loadSerialConfig(const char *filePath, SerialConfigEntry **entries, int *count, char errmsg[ERRLEN]);
+static int parseSerialConfig(const char *xml, size_t len, const char *filePath, SerialConfigEntry **entries, int *count, char errmsg[ERRLEN]);
+static void defaultSerialConfigEntry(SerialConfigEntry *entry);
+static void unescapeXmlValue(char *value);
+static int xmlLineAt(const char *xml, size_t offset);
+static uint64_t hashConfigFile(const char *data, size_t len);
+static int readConfigSnapshot(const char *snapshotPath, uint64_t xmlHash, uint64_t xmlSize, SerialConfigEntry **entries, int *count);
+static void writeConfigSnapshot(const char *snapshotPath, uint64_t xmlHash, uint64_t xmlSize, const SerialConfigEntry *entries, int count);
+
+static int CVICALLBACK SerialRxThread(void *functionData);
+static void stopRxEngine(SerialRxEngine *rx);
+static void rxSignalInit(SerialRxEngine *rx);
+static int rxWaitUnlocked(int Handle, SerialPortLock **Lock, double Timeout);
+static int rxFill(SerialRxEngine *rx, double timeout);
+static int rxPumpStart(SerialRxEngine *rx, int index);
+static int rxRead(SerialRxEngine *rx, char *ReadData, int numBytes, double Deadline, int terminationByte);
+static int flushRx(SerialRxEngine *rx);
+
+static const SerialTransportOps *getTransportOps(int transport);
+static const char *transportErrorText(SerialTransport *port, int error);
+static int rs232Open(SerialTransport *port, const SerialPortDesc *desc, const char *path);
+static int rs232Close(SerialTransport *port);
+static int rs232Write(SerialTransport *port, const SerialIOVec *segments, int numSegments);
+static int rs232Read(SerialTransport *port, char *data, int len, int terminationByte);
+static int rs232InQLen(SerialTransport *port);
+static int rs232Flush(SerialTransport *port, int inQueue);
+static int rs232Wait(SerialTransport *port, char *data, int len, double timeout);
+static int rs232SetTimeout(SerialTransport *port, double timeout);
+static int rs232Reconfigure(SerialTransport *port, const SerialPortDesc *from, const SerialPortDesc *to);
+#ifndef _WIN32
+static int termiosOpen(SerialTransport *port, const SerialPortDesc *desc, const char *path);
+static int termiosClose(SerialTransport *port);
+static int termiosWrite(SerialTransport *port, const SerialIOVec *segments, int numSegments);
+static int termiosRead(SerialTransport *port, char *data, int len, int terminationByte);
+static int termiosInQLen(SerialTransport *port);
+static int termiosFlush(SerialTransport *port, int inQueue);
+static int termiosWait(SerialTransport *port, char *data, int len, double timeout);
+static int termiosSetTimeout(SerialTransport *port, double timeout);
+static int termiosReconfigure(SerialTransport *port, const SerialPortDesc *from, const SerialPortDesc *to);
+static int ptyOpen(SerialTransport *port, const SerialPortDesc *desc, const char *path);
+#endif
+
+static int initSerialShared(void);
+
+static void reportSerialError(int Handle, int Code, const char *Title, const char *Message);
+
+static void captureTraffic(int index, int direction, const SerialIOVec *segments, int numSegments);
+static unsigned int captureRingPut(SerialCaptureRing *ring, unsigned int head, const void *data, unsigned int len);
+static int CVICALLBACK SerialCaptureThread(void *functionData);
+static void drainCapture(void);
+static void stopCapture(void);
+static void printCaptureBytes(FILE *out, const unsigned char *data, int len, int hex);
+static int compareCaptureEntries(const void *a, const void *b);
+
+static int framerNext(int index, SerialFrame *Frame, double Deadline, double *FirstByte, int FailOnCrc, char errmsg[ERRLEN]);
+static int framerScan(SerialPort *port, int failOnCrc);
+static void framerReset(SerialPort *port);
+static int modbusFrameLength(const unsigned char *header, int len);
+static uint16_t crc16ModbusBitwise(uint16_t crc, const uint8_t *data, int len);
+static uint16_t crc16ModbusTable(uint16_t crc, const uint8_t *data, int len);
+static uint16_t crc16ModbusSlice(uint16_t crc, const uint8_t *data, int len);
+
+static int renderTemplate(const SerialTemplate *Template, char *Buffer, int BufferLen, va_list Args);
+static int renderUnsigned(char *Buffer, int BufferLen, unsigned int Value, unsigned int Base, int Digits, int Negative);
+
+static int CVICALLBACK SerialBroadcastThread(void *functionData);
+
+static void transactRecord(SerialTransactTotals *Totals, const SerialTransactStats *Stats, int Error);
+static int serialTransact(int Handle, const SerialIOVec *Segments, int NumSegments, const SerialFrameRule *Rule, double Deadline,
+						  double Timeout, char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN]);
+static void restoreFrameRule(int Handle, const SerialFramer *Previous);
+
+static double serialTimeout(int index);
+static void latencyStart(int index);
+static void latencyReply(int index, int bytesRead);
+static int latencyBucket(uint64_t ns);
+static double latencyBucketLimit(int bucket);
+static double latencyPercentile(const SerialLatency *latency, double percentile);
+static int enumerateSerialPorts(char (*ports)[MAXDEVICENAMELEN], int maxPorts);
+static int CVICALLBACK SerialScanThread(void *functionData);
+static int probeSerialPort(SerialTransport *port, int type, int address, char *ident, int identLen, double timeout);
+static void scanDeviceName(const SerialScanResult *result, int index, char *deviceName);
+static int writeScanConfig(const char *filePath, const SerialScanResult *results, int count);
+
+static uint64_t serialMonotonicNs(void);
+static void serialSignalInit(SerialSignal *signal);
+static void serialSignalSet(SerialSignal *signal);
+static int serialSignalWait(SerialSignal *signal, double timeout);
+static void serialSignalDiscard(SerialSignal *signal);
+static void serialLockInit(SerialPortLock *lock);
+static SerialPortLock *serialLockAcquire(SerialPortLock *lock);
+static int serialLockRelease(SerialPortLock *lock);
+static SerialPortLock *serialConfigLock(void);
+static int serialHandleValid(int Handle);
+
 //==============================================================================
 // Global variables
 
@@ -52,17 +620,18 @@ char tempCheckSum[4] = {0};
 char glbPathToSerialConfigFile[256] = {0};
 int glbSerialConfigurationPanelHandle = 0;
 int glbSerialConfigTableHandle = 0;
-int glbSerialDebugPanelHandle;
-int glbNumOfComPorts = 0;
+int glbSerialDebugPanelHandle = 0;
+volatile int glbNumOfComPorts = 0;				// Published after the ports below it are filled in
 int glbSerialRingDebugMenuHandle;
 int glbWriteBoxHandle;
 int glbSerialThreadID = 0;
-int glbSerialThread = 0;
+volatile int glbSerialThread = 0;
 static int glbSerialReadThreadHandle;
+static int glbSerialMainPanelHandle = 0;		// Parent of the panels created on first use
 int glbReadBoxHandle;
 
-SerialFileInfoStruct glbSerialFileInfo[MAXNUMOFSERIALPORTS]= {0};
 char glbSerialParamName[9][20]= {"DeviceName","Comport","BaudRate","Parity","DataBits","StopBits","CTSMode","XonXoff","Timeout"};
+char glbSerialParityName[5][8]= {"None","Odd","Even","Mark","Space"};
 
 //==============================================================================
 // Global functions
@@ -108,14 +677,38 @@ int ISValidXMLSerial (char * string);
 * 									    panels under
 *******************************************************************************/
 int InitializeSerialPortLib(char *SerialConfigurationFile, int MainPanelHandle, char errmsg[ERRLEN])
+{
+	return InitializeSerialPortLibEx(SerialConfigurationFile, MainPanelHandle, 0, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Initialize the serial library with configuration file and options
+*
+* With SERIAL_INIT_HEADLESS no panel is built during initialization. The
+* configuration and debug panels are created the first time their handles are
+* requested, so a library without an operator only pays for its devices.
+* 
+* \param [in] SerialConfiguarationFile 	Path to config XML file
+* \param [in] MainPanelHandle			Parent panel handle to create serial child
+* 									    panels under
+* \param [in] Flags						SERIAL_INIT_ flags
+*******************************************************************************/
+int InitializeSerialPortLibEx(char *SerialConfigurationFile, int MainPanelHandle, int Flags, char errmsg[ERRLEN])
 {
 	fnInit;
 	
-	glbNumOfComPorts = ReadSerialConfigurationFile(SerialConfigurationFile);
-	tsErrChk(glbNumOfComPorts < 0 ? -1 : 0, "No communication ports found in configuration file");
+	// The count is published by ReadSerialConfigurationFile, only once the file was read
+	int numPorts = ReadSerialConfigurationFile(SerialConfigurationFile);
+	tsErrChk(numPorts < 0 ? numPorts : 0, "No communication ports found in configuration file");
 	
-	CreateSerialConfigurationTable(MainPanelHandle);
-	CreateSerialDebugPanel(MainPanelHandle);
+	tsErrChk(initSerialShared(), "Unable to create receive engine thread pool");
+	
+	glbSerialMainPanelHandle = MainPanelHandle;
+	if (!(Flags & SERIAL_INIT_HEADLESS))
+	{
+		CreateSerialConfigurationTable(MainPanelHandle);
+		CreateSerialDebugPanel(MainPanelHandle);
+	}
 	
 	libInitialized = 1;
 	
@@ -151,7 +744,10 @@ void CreateSerialConfigurationTable(int MainPanelHandle)
 	int DelButtonHandle = NewCtrl (glbSerialConfigurationPanelHandle, CTRL_SQUARE_COMMAND_BUTTON, "Delete Row", 660, 75);
 	SetCtrlAttribute (glbSerialConfigurationPanelHandle,DelButtonHandle, ATTR_CALLBACK_FUNCTION_POINTER,DelRowSerialConfigTableCB);
 
-	InsertTableRows(glbSerialConfigurationPanelHandle,glbSerialConfigTableHandle,-1,glbNumOfComPorts,VAL_CELL_STRING);
+	int numRows = 0;
+	for (int i=0; i<glbNumOfComPorts; i++)
+		numRows += serialPort(i)->name[0] ? 1 : 0;
+	InsertTableRows(glbSerialConfigurationPanelHandle,glbSerialConfigTableHandle,-1,numRows,VAL_CELL_STRING);
 	
 	#define insertTableColumn(colIndex, paramIndex, cellType, colWidth)\
 		InsertTableColumns (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, colIndex, 1, cellType);\
@@ -166,40 +762,40 @@ void CreateSerialConfigurationTable(int MainPanelHandle)
 	insertTableColumn(4, 3, VAL_CELL_COMBO_BOX, 50);
 	insertTableColumn(5, 4, VAL_CELL_COMBO_BOX, 50);
 	
-	if(glbNumOfComPorts>0)
-	{
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM1" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM2" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM3" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM4" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM5" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM6" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM7" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM8" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM9" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, glbNumOfComPorts, 1), -1,"COM10" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"110" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"110" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"300" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"600" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"1200" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"2400" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"4800" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"9600" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"19200" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"38400" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"57600" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"115200" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, glbNumOfComPorts, 1), -1,"230400" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, glbNumOfComPorts, 1), -1,"None" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, glbNumOfComPorts, 1), -1,"Odd" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, glbNumOfComPorts, 1), -1,"Even" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, glbNumOfComPorts, 1), -1,"Mark" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, glbNumOfComPorts, 1), -1,"Space" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, glbNumOfComPorts, 1), -1,"5" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, glbNumOfComPorts, 1), -1,"6" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, glbNumOfComPorts, 1), -1,"7" );
-		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, glbNumOfComPorts, 1), -1,"8" );
+	if(numRows>0)
+	{
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM1" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM2" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM3" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM4" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM5" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM6" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM7" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM8" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM9" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 2, numRows, 1), -1,"COM10" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"110" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"110" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"300" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"600" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"1200" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"2400" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"4800" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"9600" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"19200" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"38400" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"57600" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"115200" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 3, numRows, 1), -1,"230400" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, numRows, 1), -1,"None" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, numRows, 1), -1,"Odd" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, numRows, 1), -1,"Even" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, numRows, 1), -1,"Mark" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 4, numRows, 1), -1,"Space" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, numRows, 1), -1,"5" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, numRows, 1), -1,"6" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, numRows, 1), -1,"7" );
+		InsertTableCellRangeRingItem (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakeRect(1, 5, numRows, 1), -1,"8" );
 	}
 	
 	insertTableColumn(6, 5, VAL_CELL_BUTTON, 50);
@@ -211,8 +807,17 @@ void CreateSerialConfigurationTable(int MainPanelHandle)
 }
 
 /***************************************************************************//*!
-* \brief read the xml Serial configuration from specified path and populate 
-* 		 glbSerialFileInfo structure
+* \brief read the xml Serial configuration from specified path and decode it
+* 		 into the port descriptors
+*
+* The file is parsed in one pass without building a DOM. The decoded table is
+* saved next to it (path + SERIALSNAPSHOTEXT) with the hash of the file, the
+* next call with an unchanged file loads the snapshot instead of parsing. The
+* number of devices is only limited by memory.
+*
+* Handles follow the rows of the file. Reading a file again is refused while
+* a device is open, use ReloadSerialConfigurationFile to apply a changed file
+* to open devices, it matches them by name.
 *
 * \param [in] filePath 		Path to serial configuration XML file
 * 
@@ -223,64 +828,257 @@ int ReadSerialConfigurationFile(char *filePath)
 	char errmsg[ERRLEN] = {0};
 	fnInit;
 	
-	CVIXMLElement    curElem = 0;
-	CVIXMLDocument   doc;
-	CVIXMLElement 	 childElem = 0;
-	CVIXMLElement 	 childElem1 = 0;
-	int numChildren = 0;
-	int numSubChildren = 0;
-	char value[120];
-	int address;
+	SerialConfigEntry *entries = 0;
+	int count = 0;
+	SerialPortLock *configLock = serialLockAcquire(serialConfigLock());
+	
+	// Rows map to handles by position, an open port could end up with another device's name
+	for (int i=0; i<glbNumOfComPorts; i++)
+		tsErrChk(serialPort(i)->name[0] && serialPort(i)->desc.portOpen ? -1 : 0,
+				 "Device %s is open, apply %s with ReloadSerialConfigurationFile instead", serialPort(i)->name, filePath);
 	
 	sprintf(glbPathToSerialConfigFile,"%s",filePath);
 	
-	// load document
-	tsErrChk(CVIXMLLoadDocument(filePath, &doc), errmsg);
-	tsErrChk(CVIXMLGetRootElement(doc, &curElem), errmsg);
-
-	tsErrChk(CVIXMLGetNumChildElements(curElem,&numChildren), errmsg);
+	tsErrChk(loadSerialConfig(filePath, &entries, &count, errmsg), "%s", errmsg);
+	tsErrChk(reserveSerialPorts(count), "Unable to allocate %d serial ports", count);
 	
-	for (int i=0; i<numChildren; i++)
+	for (int i=0; i<count; i++)
 	{
-		CVIXMLGetChildElementByIndex(curElem,i,&childElem);
-		CVIXMLGetNumChildElements(childElem,&numSubChildren);
-		for(int j=0; j<numSubChildren; j++)
+		SerialPort *port = serialPort(i);
+		SerialPortLock *lock = serialLockAcquire(&port->lock);
+		
+		// Opened since the check above, it keeps its name and the read fails
+		if (port->desc.portOpen && strcmp(port->name, entries[i].name))
 		{
-			CVIXMLGetChildElementByTag(childElem,glbSerialParamName[j],&childElem1);
-			CVIXMLGetElementValue(childElem1,value);
-
-			//Take the address glbSerialFileInfo[k].DeviceName[0] and cast it to int. Since all elements of this
-			//SerialInfo[0] struct are the same size to go to the next element we simply add the size of it.
-			address =  ((int)&(glbSerialFileInfo[i].DeviceName[0]))+(j*sizeof(glbSerialFileInfo[0].DeviceName)) ;
-			sprintf((char*)address,"%s",value);
-
-			if(childElem1)
-				CVIXMLDiscardElement(childElem1);
+			serialLockRelease(lock);
+			tsErrChk(-1, "Device %s was opened while %s was read", port->name, filePath);
+		}
+		if (strcmp(port->name, entries[i].name))
+		{
+			// Another device now, nothing learned about the old one applies
+			memset(&port->framer, 0, sizeof(SerialFramer));
+			memset(&port->latency, 0, sizeof(SerialLatency));
+			memset(&port->transact, 0, sizeof(SerialTransactTotals));
 		}
-		if(childElem)
-			CVIXMLDiscardElement(childElem);
+		int portOpen = port->desc.portOpen;
+		port->desc = entries[i].desc;
+		port->desc.portOpen = portOpen;
+		strcpy(port->name, entries[i].name);
+		strcpy(port->path, entries[i].path);
+		serialLockRelease(lock);
 	}
 	
-	if(curElem)
-		CVIXMLDiscardElement(curElem);
+	// Ports past the end of the new file lose their handle
+	for (int i=count; i<glbNumOfComPorts; i++)
+	{
+		SerialPort *port = serialPort(i);
+		SerialPortLock *lock = 0;
+		
+		if (!port->name[0])
+			continue;
+		if (port->desc.portOpen)
+			CloseSerialHandle(i+1, errmsg);
+		lock = serialLockAcquire(&port->lock);
+		port->name[0] = 0;
+		serialLockRelease(lock);
+	}
 	
-	if(doc)
-		CVIXMLDiscardDocument(doc);
+	// Readers check handles against the count without a lock, the ports come first
+	SerialMemoryBarrier();
+	glbNumOfComPorts = count;
+	tsErrChk(buildDeviceNameHash(), "Out of memory building the device name table of %s", filePath);
 	
 Error:
+	serialLockRelease(configLock);
+	free(entries);
 	if(error)
 		return error;
 	else
-		return(numChildren);
+		return(count);
+}
+
+/***************************************************************************//*!
+* \brief Apply a changed configuration file to the running library
+*
+* Devices are matched to the live ports by name, so a device keeps its handle
+* even if its row moved in the file.
+* - Unchanged devices are not touched, open ports stay open with their buffers
+* - Changed devices are updated in place. An open port is reconfigured if the
+*   transport allows it (termios: all settings, RS-232: timeout and
+*   handshaking) and closed and reopened otherwise, a running receive engine
+*   is restarted with the same buffer size after a reopen.
+* - Removed devices are closed, their handles become invalid
+* - Added devices get new handles after the existing ones, handles of removed
+*   devices are never reused
+*
+* Reloads and ReadSerialConfigurationFile are serialized. A reload is not
+* rolled back when a device fails to reconfigure or reopen: the devices
+* before it in the file keep their new settings, the failing one is left as
+* the error describes, and nothing is removed or added. Summary counts what
+* was applied. Reloading again once the cause is fixed completes the change.
+*
+* \param [in]  filePath 			Path to serial configuration XML file
+* \param [in]  OpenAdded 			Open the added devices
+* \param [out] Summary 			What changed, can be 0
+*******************************************************************************/
+int ReloadSerialConfigurationFile(char *filePath, int OpenAdded, SerialReloadSummary *Summary, char errmsg[ERRLEN])
+{
+	SerialConfigEntry *entries = 0;
+	char *kept = 0;				// Per live port, still in the file
+	int count = 0;
+	int numPorts = 0;
+	int numAdded = 0;
+	SerialReloadSummary summary = {0};
+	SerialPortLock *configLock = 0;
+	libInit;
+	
+	configLock = serialLockAcquire(serialConfigLock());
+	numPorts = glbNumOfComPorts;
+	libErrChk(loadSerialConfig(filePath, &entries, &count, errmsg), "%s", errmsg);
+	kept = calloc((size_t) (numPorts ? numPorts : 1), 1);
+	libErrChk(kept ? 0 : -1, "Out of memory reloading %s", filePath);
+	libErrChk(reserveSerialPorts(numPorts + count), "Unable to allocate %d serial ports", numPorts + count);
+	sprintf(glbPathToSerialConfigFile,"%s",filePath);
+	
+	for (int i=0; i<count; i++)
+	{
+		int index = getFileInfoIndexFromName(entries[i].name);
+		
+		if (index < 0 || kept[index])
+		{
+			// New device, published with the others once all are filled in
+			SerialPort *port = serialPort(numPorts + numAdded);
+			port->desc = entries[i].desc;
+			port->desc.portOpen = 0;
+			strcpy(port->name, entries[i].name);
+			strcpy(port->path, entries[i].path);
+			numAdded++;
+			continue;
+		}
+		
+		kept[index] = 1;
+		error = reloadSerialPort(index, &entries[i], errmsg);
+		if (error < 0)
+			goto Error;
+		if (error == SERIALREOPEN)
+			summary.reopened++;
+		else if (error == SERIALRECONFIGURED)
+			summary.reconfigured++;
+		else
+			summary.unchanged++;
+		error = 0;
+	}
+	
+	for (int i=0; i<numPorts; i++)
+	{
+		SerialPortLock *lock = 0;
+		
+		if (kept[i] || !serialPort(i)->name[0])
+			continue;
+		CloseSerialHandle(i+1, errmsg);
+		lock = serialLockAcquire(&serialPort(i)->lock);
+		serialPort(i)->name[0] = 0;
+		serialLockRelease(lock);
+		summary.removed++;
+	}
+	
+	SerialMemoryBarrier();
+	glbNumOfComPorts = numPorts + numAdded;
+	libErrChk(buildDeviceNameHash(), "Out of memory building the device name table of %s", filePath);
+	summary.added = numAdded;
+	
+	for (int i=numPorts; OpenAdded && i<numPorts+numAdded; i++)
+		libErrChk(InitSerialHandle(i+1, errmsg), "%s", errmsg);
+	
+Error:
+	serialLockRelease(configLock);
+	if (Summary)
+		*Summary = summary;
+	free(entries);
+	free(kept);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Bring one live port to the settings of its configuration entry
+*
+* \return 0 if nothing changed, SERIALRECONFIGURED if changed in place,
+* 		  SERIALREOPEN if the port was reopened or negative error code
+*******************************************************************************/
+static int reloadSerialPort(int index, const SerialConfigEntry *entry, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	SerialPort *port = serialPort(index);
+	SerialPortLock *lock = serialLockAcquire(&port->lock);
+	SerialPortDesc from = port->desc;
+	SerialPortDesc to = entry->desc;
+	int change = SERIALRECONFIGURED;
+	
+	to.portOpen = from.portOpen;
+	if (from.transport == to.transport && from.comport == to.comport && from.baudRate == to.baudRate
+		&& from.parity == to.parity && from.dataBits == to.dataBits && from.stopBits == to.stopBits
+		&& from.flowControl == to.flowControl && from.timeout == to.timeout && !strcmp(port->path, entry->path))
+	{
+		error = 0;
+		goto Error;
+	}
+	
+	strcpy(port->name, entry->name);		// May differ in case
+	if (!from.portOpen)
+	{
+		port->desc = to;
+		strcpy(port->path, entry->path);
+		error = change;
+		goto Error;
+	}
+	
+	if (from.transport == to.transport && from.comport == to.comport && !strcmp(port->path, entry->path))
+		error = port->transport.ops->reconfigure(&port->transport, &from, &to);
+	else
+		error = SERIALREOPEN;
+	
+	if (error == SERIALREOPEN)
+	{
+		// An engine the pipeline mode started is started by it again
+		int pipelined = port->pipeline.enabled;
+		int rxSize = port->rx.running && !(pipelined && port->pipeline.startedEngine) ? (int) port->rx.size : 0;
+		
+		change = SERIALREOPEN;
+		tsErrChk(CloseSerialHandle(index+1, errmsg), "%s", errmsg);
+		port->desc = to;
+		port->desc.portOpen = 0;
+		strcpy(port->path, entry->path);
+		tsErrChk(InitSerialHandle(index+1, errmsg), "%s", errmsg);
+		if (rxSize)
+			tsErrChk(StartSerialRxEngine(index+1, rxSize, errmsg), "%s", errmsg);
+		if (pipelined)
+			tsErrChk(SetSerialPipelineMode(index+1, 1, errmsg), "%s", errmsg);
+	}
+	else
+	{
+		tsErrChk(error, "Unable to reconfigure %s for device %s: %s", entry->path, entry->name, transportErrorText(&port->transport, error));
+		port->desc = to;
+		if (!port->rx.running)
+			tsErrChk(port->transport.ops->setTimeout(&port->transport, to.timeout), "Unable to set the timeout of device %s", entry->name);
+	}
+	error = change;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
 }
 
 /***************************************************************************//*!
-* \brief Get SerialConfiguration panel handle
+* \brief Get SerialConfiguration panel handle, the panel is created here on
+* 		 the first call after a headless initialization
 *
 * \return glbSerialConfigurationPanelHandle
 *******************************************************************************/
 int GetSerialConfigurationPanelHandle(void)
 {
+	if (!glbSerialConfigurationPanelHandle && libInitialized)
+		CreateSerialConfigurationTable(glbSerialMainPanelHandle);
 	return  glbSerialConfigurationPanelHandle;
 }
 
@@ -346,7 +1144,7 @@ int SaveBackupXmlFilenameSerial(const char *filename)
 	pch = strstr(backUpFilename,".xml");
 	sprintf(tempStr,"%04d%02d%02d%02d%02d%02d.bak",year,month,day,hour,min,sec);
 	strncpy(pch,tempStr,19);
-	tsErrChk(CopyFile(filename,backUpFilename), errmsg);
+	tsErrChk(CopyFile(filename,backUpFilename), "%s", errmsg);
 	
 Error:
 	return error;
@@ -386,15 +1184,18 @@ void CreateSerialDebugPanel(int MainPanelHandle)
 	int InitSerialHandle = NewCtrl (glbSerialDebugPanelHandle, CTRL_SQUARE_COMMAND_BUTTON, "Initialize", 417, 400);
 	SetCtrlAttribute (glbSerialDebugPanelHandle,InitSerialHandle, ATTR_CALLBACK_FUNCTION_POINTER,InitSerialDebugCB);
 	for(int i=0; i<glbNumOfComPorts; i++)
-		InsertListItem(glbSerialDebugPanelHandle,glbSerialRingDebugMenuHandle,-1,glbSerialFileInfo[i].DeviceName,i);
+		InsertListItem(glbSerialDebugPanelHandle,glbSerialRingDebugMenuHandle,-1,serialPort(i)->name,i);
 }
 
 /***************************************************************************//*!
-* \brief Get SerialDebug panel handle
+* \brief Get SerialDebug panel handle, the panel is created here on the first
+* 		 call after a headless initialization
 *
 *******************************************************************************/
 int GetSerialDebugPanelHandle(void)
 {
+	if (!glbSerialDebugPanelHandle && libInitialized)
+		CreateSerialDebugPanel(glbSerialMainPanelHandle);
 	return  glbSerialDebugPanelHandle;
 }
 
@@ -410,7 +1211,7 @@ int GetDeviceName(int index, char *devName, char errmsg[ERRLEN])
 	
 	libErrChk(glbNumOfComPorts <= (index-1) ? -1 : 0, "Invalid serial port index: %d. Ports initialized: %d", index, glbNumOfComPorts);
 	
-	strcpy (devName, glbSerialFileInfo[index-1].DeviceName);
+	strcpy (devName, serialPort(index-1)->name);
 	
 Error:
 	if(error)
@@ -444,179 +1245,336 @@ int SerialReadThread (void *dummy)
 		GetLabelFromIndex (glbSerialDebugPanelHandle, glbSerialRingDebugMenuHandle,index, deviceName);
 
 		int i = getFileInfoIndexFromName(deviceName);
-		if(glbSerialFileInfo[i].PortOpen==1)
+		if(i>=0 && serialPort(i)->desc.portOpen==1)
 		{
-			int inqlen = GetInQLenForDeviceName(deviceName, errmsg);
+			// With the receive engine this wakes up as soon as data arrives, the
+			// timeout only bounds how long it takes to notice the panel was closed
+			int inqlen = 0;
+			if (serialPort(i)->rx.running)
+				inqlen = WaitForBytes(i+1, 1, Timer() + 0.2, 0, errmsg);
+			else if ((inqlen = GetInQLenForHandle(i+1, errmsg)) == 0)
+				DelayWithEventProcessing(0.2);
 			if(inqlen>0)
 			{
-				ReadSerialDevice(deviceName, data, inqlen, errmsg);
-				strcat(data,"\0");
+				ReadSerialHandle(i+1, data, inqlen < (int) sizeof(data) ? inqlen : (int) sizeof(data)-1, errmsg);
 				SetCtrlVal (glbSerialDebugPanelHandle, glbReadBoxHandle, data);
 			}
 		}
-		DelayWithEventProcessing(0.2);
+		else
+			DelayWithEventProcessing(0.2);
 	}
 	return 0;
 }
 
 /***************************************************************************//*!
-* \brief Initialize a Serial Device
+* \brief Get the handle of a configured serial device
 *
-* \param [in] SerialDeviceName 		Name of serial device to initialize
+* Name resolution goes through a hash table built when the configuration file
+* is read, so callers that keep the handle skip the lookup on every call.
+*
+* \param [in] SerialDeviceName 		Name of serial device to find
+*
+* \return The device handle (>0) or negative error code
 *******************************************************************************/
-int InitSerialDevice (char *SerialDeviceName, char errmsg[ERRLEN])
+int GetSerialDeviceHandle(char *SerialDeviceName, char errmsg[ERRLEN])
 {
+	int handle = 0;
 	libInit;
 	
-	int index = 0;
-	int comport = 0;
-	int parity = 0;
-	int baudRate = 0;
-	int databits = 0;
-	int stopbits = 0;
-	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
-	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-
-	if(stricmp(glbSerialFileInfo[index].Parity, "None")==0)
-		parity = 0;
-	else if(stricmp(glbSerialFileInfo[index].Parity, "Odd")==0)
-		parity = 1;
-	else if(stricmp(glbSerialFileInfo[index].Parity, "Even")==0)
-		parity = 2;
-	else if(stricmp(glbSerialFileInfo[index].Parity, "Mark")==0)
-		parity = 3;
-	else if(stricmp(glbSerialFileInfo[index].Parity, "Space")==0)
-		parity = 4;
-
-	DisableBreakOnLibraryErrors ();
-	baudRate = atoi(glbSerialFileInfo[index].BaudRate);
-	databits = atoi(glbSerialFileInfo[index].DataBits);
-	stopbits = atoi(glbSerialFileInfo[index].StopBits);
-
-	error = OpenComConfig(comport, glbSerialFileInfo[index].Comport, baudRate, parity,databits, stopbits, 512, 512);
-	EnableBreakOnLibraryErrors ();
-
-	if (error)
-	{
-		glbSerialFileInfo[index].PortOpen=0;
-		DisplayRS232Error (error);
-		return -1;
-	}
-	else
-	{
-		glbSerialFileInfo[index].PortOpen=1;
-		if(stricmp(glbSerialFileInfo[index].XonXoff, "On")==0)
-			SetXMode (comport, 1);
-		else
-			SetXMode (comport, 0);
-		if(stricmp(glbSerialFileInfo[index].CTSMode, "On")==0)
-			SetCTSMode (comport, 1);
-		else
-			SetCTSMode (comport, 0);
-		SetComTime (comport, atoi(glbSerialFileInfo[index].Timeout));
-	}
+	nameToHandle(SerialDeviceName, handle);
 	
 Error:
-	return error;
+	if(error)
+		return error;
+	else
+		return handle;
 }
 
 /***************************************************************************//*!
-* \brief Close a Serial Device
+* \brief Get the decoded port settings of a device
 *
-* \param [in] SerialDeviceName 		Name of serial device to close
+* \param [in] Handle 				Handle of serial device
+* \param [out] Settings 				Copy of the port descriptor
 *******************************************************************************/
-int CloseSerialDevice (char *SerialDeviceName, char errmsg[ERRLEN])
+int GetSerialHandleSettings(int Handle, SerialPortDesc *Settings, char errmsg[ERRLEN])
 {
 	libInit;
 	
-	int index = 0;
-	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
-			  
-	error = CloseCom(atoi(glbSerialFileInfo[index].Comport + 3));
-	if (error)
-		DisplayRS232Error (error);
-	glbSerialFileInfo[index].PortOpen=0;
+	handleErrChk(Handle);
+	*Settings = serialPort(Handle-1)->desc;
 	
 Error:
 	return error;
 }
 
 /***************************************************************************//*!
-* \brief Write To a specified serial device
+* \brief Get the handle of a serial device and initialize it if it is not open
 *
-* \param [in] SerialDeviceName 		Name of serial device to write to
-* \param [in] data 					Data to write
+* \param [in] SerialDeviceName 		Name of serial device to open
 *
-* \return The number of bytes written or negative error code
+* \return The device handle (>0) or negative error code
 *******************************************************************************/
-int WriteSerialDevice(char *SerialDeviceName, char *data, char errmsg[ERRLEN])
+int OpenSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN])
 {
-	int bytesWritten = 0;
+	int handle = 0;
 	libInit;
 	
-	int index = 0;
-	int comport = 0;
+	nameToHandle(SerialDeviceName, handle);
 	
-	int stringsize = StringLength (data);
-	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
-	
-	if(glbSerialFileInfo[index].PortOpen!=1)
-	{
-		sprintf(errmsg,"Please Initalize device %s before trying to write",SerialDeviceName);
-		MessagePopup ("WriteSerialDevice Error", errmsg);
-		libErrChk(-1, errmsg);
-	}
-	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-	FlushInQ(comport);
-	bytesWritten = ComWrt(comport, data, stringsize);
+	if(serialPort(handle-1)->desc.portOpen!=1)
+		libErrChk(InitSerialHandle(handle, errmsg), "%s", errmsg);
 	
 Error:
 	if(error)
 		return error;
 	else
-		return bytesWritten;
+		return handle;
 }
 
 /***************************************************************************//*!
-* \brief Write To specified serial device with specified data length
+* \brief Initialize a Serial Device
 *
-* \param [in] SerialDeviceName 		Name of serial device to write to
-* \param [in] data 					Data to write
-* \param [in] dataLen 				Length of data
-* 
-* \return The number of bytes written or negative error code
+* \param [in] SerialDeviceName 		Name of serial device to initialize
 *******************************************************************************/
-int WriteSerialDeviceRaw(char *SerialDeviceName, char *data, int dataLen, char errmsg[ERRLEN])
+int InitSerialDevice (char *SerialDeviceName, char errmsg[ERRLEN])
 {
-	int bytesWritten = 0;
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = InitSerialHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Initialize a Serial Device by handle
+*
+* A device that is already open is left as it is, reopening the transport
+* would leak the handle of the open one.
+*
+* \param [in] Handle 				Handle of serial device to initialize
+*******************************************************************************/
+int InitSerialHandle (int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialPortDesc *desc = &serialPort(Handle-1)->desc;
+	SerialTransport *port = &serialPort(Handle-1)->transport;
+	
+	if (desc->portOpen)
+	{
+		error = 0;
+		goto Error;
+	}
+	
+	port->ops = getTransportOps(desc->transport);
+	libErrChk(port->ops ? 0 : ERR_SERIAL_TRANSPORT, "%s for device %s is not available on this platform", serialPort(Handle-1)->path, serialPort(Handle-1)->name);
+	
+	error = port->ops->open(port, desc, serialPort(Handle-1)->path);
+	if (error)
+	{
+		desc->portOpen=0;
+		reportSerialError(Handle, error, "RS232 Message", transportErrorText(port, error));
+		libErrChk(error, "Unable to open %s for device %s: %s", serialPort(Handle-1)->path, serialPort(Handle-1)->name, transportErrorText(port, error));
+	}
+	desc->portOpen=1;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Close a Serial Device
+*
+* \param [in] SerialDeviceName 		Name of serial device to close
+*******************************************************************************/
+int CloseSerialDevice (char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = CloseSerialHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Close a Serial Device by handle
+*
+* \param [in] Handle 				Handle of serial device to close
+*******************************************************************************/
+int CloseSerialHandle (int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	
+	stopRxEngine(&serialPort(Handle-1)->rx);
+	memset(&serialPort(Handle-1)->pipeline, 0, sizeof(SerialPipeline));
+	
+	if (serialPort(Handle-1)->desc.portOpen)
+	{
+		error = serialPort(Handle-1)->transport.ops->close(&serialPort(Handle-1)->transport);
+		if (error)
+			reportSerialError(Handle, error, "RS232 Message", transportErrorText(&serialPort(Handle-1)->transport, error));
+	}
+	serialPort(Handle-1)->desc.portOpen=0;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Write To a specified serial device
+*
+* \param [in] SerialDeviceName 		Name of serial device to write to
+* \param [in] data 					Data to write
+*
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialDevice(char *SerialDeviceName, char *data, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = WriteSerialHandle(handle, data, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Write a null terminated string to a serial device by handle
+*
+* \param [in] Handle 				Handle of serial device to write to
+* \param [in] data 					Data to write
+*
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialHandle(int Handle, char *data, char errmsg[ERRLEN])
+{
+	return WriteSerialHandleRaw(Handle, data, StringLength (data), errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Write To specified serial device with specified data length
+*
+* \param [in] SerialDeviceName 		Name of serial device to write to
+* \param [in] data 					Data to write
+* \param [in] dataLen 				Length of data
+* 
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialDeviceRaw(char *SerialDeviceName, char *data, int dataLen, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = WriteSerialHandleRaw(handle, data, dataLen, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Write to a serial device by handle with specified data length
+*
+* \param [in] Handle 				Handle of serial device to write to
+* \param [in] data 					Data to write
+* \param [in] dataLen 				Length of data
+* 
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialHandleRaw(int Handle, char *data, int dataLen, char errmsg[ERRLEN])
+{
+	SerialIOVec segment = {data, dataLen};
+	
+	return WriteSerialHandleV(Handle, &segment, 1, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Write a frame made of several buffers to a specified serial device
+*
+* \param [in] SerialDeviceName 		Name of serial device to write to
+* \param [in] Segments 				Buffers to send, in order
+* \param [in] NumSegments 			Number of segments (1-MAXSERIALIOVEC)
+* 
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialDeviceV(char *SerialDeviceName, const SerialIOVec *Segments, int NumSegments, char errmsg[ERRLEN])
+{
+	int handle = 0;
 	libInit;
 	
-	int index = 0;
-	int comport = 0;
+	nameToHandle(SerialDeviceName, handle);
+	error = WriteSerialHandleV(handle, Segments, NumSegments, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Write a frame made of several buffers to a serial device by handle
+*
+* The segments go to the transport as they are (writev on termios, one ComWrt
+* per segment on RS-232), so a header, payload and checksum kept in separate
+* buffers never have to be copied into one frame.
+*
+* \param [in] Handle 				Handle of serial device to write to
+* \param [in] Segments 				Buffers to send, in order
+* \param [in] NumSegments 			Number of segments (1-MAXSERIALIOVEC)
+* 
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialHandleV(int Handle, const SerialIOVec *Segments, int NumSegments, char errmsg[ERRLEN])
+{
+	int bytesWritten = 0;
+	SerialPortLock *lock = 0;
+	libInit;
 	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	libErrChk(NumSegments < 1 || NumSegments > MAXSERIALIOVEC ? -1 : 0, "Number of segments must be between 1 and %d", MAXSERIALIOVEC);
+	for (int i=0; i<NumSegments; i++)
+		libErrChk(Segments[i].len < 0 || (Segments[i].len && !Segments[i].data) ? -1 : 0, "Invalid write segment %d", i);
 	
-	if(glbSerialFileInfo[index].PortOpen!=1)
+	if(serialPort(Handle-1)->desc.portOpen!=1)
 	{
-		sprintf(errmsg,"Please Initalize device %s before trying to write",SerialDeviceName);
-		MessagePopup ("WriteSerialDevice Error", errmsg);
-		libErrChk(-1, errmsg);
+		sprintf(errmsg,"Please Initalize device %s before trying to write",serialPort(Handle-1)->name);
+		reportSerialError(Handle, -1, "WriteSerialDevice Error", errmsg);
+		libErrChk(-1, "%s", errmsg);
 	}
 	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-	FlushInQ(comport);
-	bytesWritten = ComWrt(comport, data, dataLen);
+	// A pipelined device keeps the replies of the requests still in flight
+	SerialTransport *port = &serialPort(Handle-1)->transport;
+	if (!serialPort(Handle-1)->pipeline.enabled)
+	{
+		libErrChk(flushRx(&serialPort(Handle-1)->rx), "Release the frame of %s before writing to it", serialPort(Handle-1)->name);
+		port->ops->flush(port, 1);
+	}
+	bytesWritten = port->ops->write(port, Segments, NumSegments);
+	if (bytesWritten > 0)
+	{
+		captureTraffic(Handle-1, SERIAL_CAPTURE_TX, Segments, NumSegments);
+		if (!serialPort(Handle-1)->pipeline.enabled)
+			latencyStart(Handle-1);
+	}
 	
 Error:
+	serialLockRelease(lock);
 	if(error)
 		return error;
 	else
@@ -633,27 +1591,135 @@ Error:
 * \return The number of bytes read or negative errorcode
 *******************************************************************************/
 int ReadSerialDevice(char *SerialDeviceName, char *ReadData, int numByteToRead, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = ReadSerialHandle(handle, ReadData, numByteToRead, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Read from a serial device by handle
+*
+* \param [in] 	Handle 						Handle of serial device to read from
+* \param [out]  ReadData 					
+* \param [in] 	numBytesToRead 				Number of bytes to read
+*
+* \return The number of bytes read or negative errorcode
+*******************************************************************************/
+int ReadSerialHandle(int Handle, char *ReadData, int numByteToRead, char errmsg[ERRLEN])
 {
 	int bytesRead = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	
+	if(serialPort(Handle-1)->desc.portOpen!=1)
+	{
+		sprintf(errmsg,"Please Initalize device %s before trying to read",serialPort(Handle-1)->name);
+		reportSerialError(Handle, -1, "ReadSerialDevice Error", errmsg);
+		libErrChk(-1, "%s", errmsg);
+	}
+	
+	double timeout = serialTimeout(Handle-1);
+	if (serialPort(Handle-1)->rx.running)
+		bytesRead = rxRead(&serialPort(Handle-1)->rx, ReadData, numByteToRead, Timer() + timeout, -1);
+	else
+	{
+		SerialTransport *port = &serialPort(Handle-1)->transport;
+		if (port->timeout != timeout)
+			port->ops->setTimeout(port, timeout);
+		bytesRead = port->ops->read(port, ReadData, numByteToRead, -1);
+		SerialIOVec chunk = {ReadData, bytesRead};
+		if (bytesRead > 0)
+			captureTraffic(Handle-1, SERIAL_CAPTURE_RX, &chunk, 1);
+	}
+	latencyReply(Handle-1, bytesRead);
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return bytesRead;
+}
+
+/***************************************************************************//*!
+* \brief Read from specified serial device until termination char is found or 
+* 		 timeout or number of byte to read is reached.
+*
+* \param [in] 	SerialDeviceName 			Name of serial device to read from
+* \param [out]  ReadData 					
+* \param [in] 	numBytesToRead 				Number of bytes to read
+* \param [in]   terminationByte				Termination char to stop reading
+*
+* \return The number of bytes read or negative error code
+*******************************************************************************/
+int ReadSerialDeviceUntilTermChar(char *SerialDeviceName, char *ReadData, int numByteToRead, int terminationByte, char errmsg[ERRLEN])
+{
+	int handle = 0;
 	libInit;
 	
-	int index = 0;
-	int comport = 0;
+	nameToHandle(SerialDeviceName, handle);
+	error = ReadSerialHandleUntilTermChar(handle, ReadData, numByteToRead, terminationByte, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Read from a serial device by handle until termination char is found
+* 		 or timeout or number of byte to read is reached.
+*
+* \param [in] 	Handle 						Handle of serial device to read from
+* \param [out]  ReadData 					
+* \param [in] 	numBytesToRead 				Number of bytes to read
+* \param [in]   terminationByte				Termination char to stop reading
+*
+* \return The number of bytes read or negative error code
+*******************************************************************************/
+int ReadSerialHandleUntilTermChar(int Handle, char *ReadData, int numByteToRead, int terminationByte, char errmsg[ERRLEN])
+{
+	int bytesRead = 0;
+	SerialPortLock *lock = 0;
+	libInit;
 	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
 	
-	if(glbSerialFileInfo[index].PortOpen!=1)
+	if(serialPort(Handle-1)->desc.portOpen!=1)
 	{
-		sprintf(errmsg,"Please Initalize device %s before trying to read",SerialDeviceName);
-		MessagePopup ("ReadSerialDevice Error", errmsg);
-		libErrChk(-1, errmsg);
+		sprintf(errmsg,"Please Initalize device %s before trying to read",serialPort(Handle-1)->name);
+		reportSerialError(Handle, -1, "ReadSerialDevice Error", errmsg);
+		libErrChk(-1, "%s", errmsg);
 	}
 	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-	bytesRead = ComRd(comport, ReadData, numByteToRead);
+	double timeout = serialTimeout(Handle-1);
+	if (serialPort(Handle-1)->rx.running)
+		bytesRead = rxRead(&serialPort(Handle-1)->rx, ReadData, numByteToRead, Timer() + timeout, terminationByte);
+	else
+	{
+		SerialTransport *port = &serialPort(Handle-1)->transport;
+		if (port->timeout != timeout)
+			port->ops->setTimeout(port, timeout);
+		bytesRead = port->ops->read(port, ReadData, numByteToRead, terminationByte);
+		// The terminator is not counted, capture it too when it was left behind the data
+		SerialIOVec chunk = {ReadData, bytesRead};
+		if (bytesRead >= 0 && bytesRead < numByteToRead && (unsigned char) ReadData[bytesRead] == (unsigned char) terminationByte)
+			chunk.len++;
+		if (chunk.len > 0)
+			captureTraffic(Handle-1, SERIAL_CAPTURE_RX, &chunk, 1);
+	}
+	latencyReply(Handle-1, bytesRead);
 	
 Error:
+	serialLockRelease(lock);
 	if(error)
 		return error;
 	else
@@ -661,303 +1727,4763 @@ Error:
 }
 
 /***************************************************************************//*!
-* \brief Read from specified serial device until termination char is found or 
-* 		 timeout or number of byte to read is reached.
-*
-* \param [in] 	SerialDeviceName 			Name of serial device to read from
-* \param [out]  ReadData 					
-* \param [in] 	numBytesToRead 				Number of bytes to read
-* \param [in]   terminationByte				Termination char to stop reading
-*
-* \return The number of bytes read or negative error code
+* \brief returns the port index (handle-1) of the deviceName
+*
+* \param [in] DeviceName 		Name of device to find
+*******************************************************************************/
+int getFileInfoIndexFromName(char *DeviceName)
+{
+	SerialNameHash *table = glbSerialNameHash;
+	if(!table)
+		return -1;
+	
+	unsigned int key = hashDeviceName(DeviceName);
+	unsigned int slot = key & (table->size-1);
+	
+	while(table->slots[slot].handle)
+	{
+		int i = table->slots[slot].handle-1;
+		if(table->slots[slot].key==key && stricmp(serialPort(i)->name,DeviceName)==0)
+			return i;
+		slot = (slot+1) & (table->size-1);
+	}
+	return -1;
+}
+
+/***************************************************************************//*!
+* \brief Case insensitive FNV-1a hash of a device name
+*
+* \param [in] DeviceName 		Name of device to hash
+*******************************************************************************/
+static unsigned int hashDeviceName(const char *DeviceName)
+{
+	unsigned int key = 2166136261u;
+	
+	for(; *DeviceName; DeviceName++)
+	{
+		key ^= (unsigned char) tolower((unsigned char) *DeviceName);
+		key *= 16777619u;
+	}
+	return key;
+}
+
+/***************************************************************************//*!
+* \brief Rebuild the device name hash table from the port names. Devices
+* 		 with duplicate names resolve to the first entry, as before.
+* 
+* The new table is filled in completely before it is published, a lookup on
+* another thread sees either the old or the new table, never one half built.
+* The old table is not freed since such a lookup may still be reading it, the
+* table is only rebuilt when a configuration file is read.
+*
+* \return 0, or -1 if out of memory. The current table is kept in that case.
+*******************************************************************************/
+static int buildDeviceNameHash(void)
+{
+	SerialNameHash *table = 0;
+	unsigned int size = SERIALHASHMINSIZE;
+	
+	while (size < 2 * (unsigned int) glbNumOfComPorts)
+		size <<= 1;
+	table = malloc(sizeof(SerialNameHash) + size * sizeof(SerialNameSlot));
+	if (!table)
+		return -1;
+	table->size = size;
+	table->slots = (SerialNameSlot*) (table + 1);
+	memset(table->slots, 0, table->size * sizeof(SerialNameSlot));
+	
+	for(int i=0; i<glbNumOfComPorts; i++)
+	{
+		unsigned int key = hashDeviceName(serialPort(i)->name);
+		unsigned int slot = key & (table->size-1);
+		
+		while(table->slots[slot].handle)
+			slot = (slot+1) & (table->size-1);
+		table->slots[slot].handle = i+1;
+		table->slots[slot].key = key;
+	}
+	
+	SerialMemoryBarrier();
+	glbSerialNameHash = table;
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Make sure ports 0 to count-1 exist. Ports are allocated in chunks
+* 		 that are never moved or freed, so a port can be used without a
+* 		 lock on the table.
+*
+* \return 0, or -1 if out of memory or past the chunk directory
+*******************************************************************************/
+static int reserveSerialPorts(int count)
+{
+	while (glbSerialPortsAllocated < count)
+	{
+		int chunk = glbSerialPortsAllocated / SERIALPORTCHUNK;
+		if (chunk >= SERIALMAXCHUNKS)
+			return -1;
+		
+		SerialPort *ports = calloc(SERIALPORTCHUNK, sizeof(SerialPort));
+		if (!ports)
+			return -1;
+		for (int i=0; i<SERIALPORTCHUNK; i++)
+		{
+			serialLockInit(&ports[i].lock);
+			ports[i].rx.index = chunk * SERIALPORTCHUNK + i;
+		}
+		glbSerialPortChunks[chunk] = ports;
+		SerialMemoryBarrier();
+		glbSerialPortsAllocated += SERIALPORTCHUNK;
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief This function takes the data previously loaded into Serial struct
+* 		 and populats the test configuration table for each com port opened
+*
+*******************************************************************************/
+void LoadSerialConfigFile(void)
+{
+	SerialFileInfoStruct info;
+	int row = 0;
+	
+	for(int i=0; i<glbNumOfComPorts; i++)
+	{
+		if (!serialPort(i)->name[0])
+			continue;			// Removed by a reload
+		row++;
+		formatSerialFileInfo(i, &info);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (1, row), info.DeviceName);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (2, row), info.Comport);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (3, row), info.BaudRate);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (4, row), info.Parity);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (5, row), info.DataBits);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (6, row), info.StopBits);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (7, row), info.CTSMode);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (8, row), info.XonXoff);
+		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (9, row), (int) serialPort(i)->desc.timeout);
+	}
+}
+
+/***************************************************************************//*!
+* \brief Decode one XML setting of a serial device into its port descriptor
+*
+* \param [out] desc 			Port descriptor to update
+* \param [out] deviceName 		Device name buffer (MAXDEVICENAMELEN)
+* \param [out] devicePath 		Comport setting buffer (MAXDEVICENAMELEN)
+* \param [in]  param 			Index into glbSerialParamName
+* \param [in]  value 			Value read from the XML file
+*
+* \return 0 on success, -1 if the value can not be decoded
+*******************************************************************************/
+static int decodeSerialParam(SerialPortDesc *desc, char *deviceName, char *devicePath, int param, const char *value)
+{
+	char *end = 0;
+	long number = 0;
+	
+	switch (param)
+	{
+		case 0:
+			if(strlen(value)>=MAXDEVICENAMELEN)
+				return -1;
+			strcpy(deviceName, value);
+			break;
+		case 1:
+			// COMn uses the RS-232 library, a device path termios and PTY a pseudo-terminal pair
+			if(strlen(value)>=MAXDEVICENAMELEN)
+				return -1;
+			if(stricmp(value, "PTY")==0)
+				desc->transport = SERIAL_TRANSPORT_PTY;
+			else if(value[0]=='/')
+				desc->transport = SERIAL_TRANSPORT_TERMIOS;
+			else if(strnicmp(value, "COM", 3)==0 && atoi(value+3)>=1)
+			{
+				desc->transport = SERIAL_TRANSPORT_RS232;
+				desc->comport = atoi(value+3);
+			}
+			else
+				return -1;
+			strcpy(devicePath, value);
+			break;
+		case 2:
+			// Whole positive numbers only, atoi would open the port at 0 baud on a typo
+			number = strtol(value, &end, 10);
+			if(end==value || *end || number<1 || number>INT_MAX)
+				return -1;
+			desc->baudRate = (int) number;
+			break;
+		case 3:
+			desc->parity = 0xFF;
+			for(int i=0; i<5; i++)
+			{
+				if(stricmp(value, glbSerialParityName[i])==0)
+					desc->parity = (unsigned char) i;
+			}
+			if(desc->parity==0xFF)
+				return -1;
+			break;
+		case 4:
+			number = strtol(value, &end, 10);
+			if(end==value || *end || number<5 || number>8)
+				return -1;
+			desc->dataBits = (unsigned char) number;
+			break;
+		case 5:
+			number = strtol(value, &end, 10);
+			if(end==value || *end || number<1 || number>2)
+				return -1;
+			desc->stopBits = (unsigned char) number;
+			break;
+		case 6:
+			if(stricmp(value, "On")==0)
+				desc->flowControl |= SERIAL_FLOW_CTS;
+			else
+				desc->flowControl &= ~SERIAL_FLOW_CTS;
+			break;
+		case 7:
+			if(stricmp(value, "On")==0)
+				desc->flowControl |= SERIAL_FLOW_XONXOFF;
+			else
+				desc->flowControl &= ~SERIAL_FLOW_XONXOFF;
+			break;
+		case 8:
+			desc->timeout = atof(value);
+			break;
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Format the port descriptor of a device back into the strings shown
+* 		 in the configuration table
+*
+* \param [in]  index 			Index of the device
+* \param [out] info 			String form of the device settings
+*******************************************************************************/
+static void formatSerialFileInfo(int index, SerialFileInfoStruct *info)
+{
+	SerialPortDesc *desc = &serialPort(index)->desc;
+	
+	strcpy(info->DeviceName, serialPort(index)->name);
+	strcpy(info->Comport, serialPort(index)->path);
+	sprintf(info->BaudRate, "%d", desc->baudRate);
+	strcpy(info->Parity, glbSerialParityName[desc->parity < 5 ? desc->parity : 0]);
+	sprintf(info->DataBits, "%d", desc->dataBits);
+	sprintf(info->StopBits, "%d", desc->stopBits);
+	strcpy(info->CTSMode, (desc->flowControl & SERIAL_FLOW_CTS) ? "On" : "Off");
+	strcpy(info->XonXoff, (desc->flowControl & SERIAL_FLOW_XONXOFF) ? "On" : "Off");
+	sprintf(info->Timeout, "%g", desc->timeout);
+}
+
+/***************************************************************************//*!
+* \brief Read the device table of a configuration file, from its snapshot
+* 		 when the file has not changed since the snapshot was written
+*
+* \param [in]  filePath 			Configuration XML file
+* \param [out] entries 			Devices, free() when done
+* \param [out] count 				Number of devices
+*******************************************************************************/
+static int loadSerialConfig(const char *filePath, SerialConfigEntry **entries, int *count, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	FILE *file = 0;
+	char *xml = 0;
+	char snapshotPath[MAX_PATHNAME_LEN] = {0};
+	
+	*entries = 0;
+	*count = 0;
+	
+	file = fopen(filePath, "rb");
+	tsErrChk(file ? 0 : -1, "Unable to open serial configuration file %s", filePath);
+	fseek(file, 0, SEEK_END);
+	long len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	xml = malloc((size_t) len + 1);
+	tsErrChk(xml ? 0 : -1, "Out of memory reading %s", filePath);
+	tsErrChk(fread(xml, 1, (size_t) len, file) != (size_t) len ? -1 : 0, "Unable to read %s", filePath);
+	xml[len] = 0;
+	
+	uint64_t xmlHash = hashConfigFile(xml, (size_t) len);
+	snprintf(snapshotPath, sizeof(snapshotPath), "%s%s", filePath, SERIALSNAPSHOTEXT);
+	if (readConfigSnapshot(snapshotPath, xmlHash, (uint64_t) len, entries, count) == 0)
+		goto Error;
+	
+	tsErrChk(parseSerialConfig(xml, (size_t) len, filePath, entries, count, errmsg), "%s", errmsg);
+	writeConfigSnapshot(snapshotPath, xmlHash, (uint64_t) len, *entries, *count);
+	
+Error:
+	if (file)
+		fclose(file);
+	free(xml);
+	if (error)
+	{
+		free(*entries);
+		*entries = 0;
+		*count = 0;
+	}
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Single pass parser of the configuration XML. Elements directly under
+* 		 the root are devices, their children are the settings named in
+* 		 glbSerialParamName. Other elements, comments and declarations are
+* 		 skipped.
+*
+* \param [in]  xml 				File content
+* \param [in]  len 				Length of the content
+* \param [in]  filePath 			File name for error messages
+* \param [out] entries 			Devices, free() when done
+* \param [out] count 				Number of devices
+*******************************************************************************/
+static int parseSerialConfig(const char *xml, size_t len, const char *filePath, SerialConfigEntry **entries, int *count, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	int depth = 0;
+	int param = -1;
+	int capacity = 0;
+	char value[MAXCHARARRAYLENGTH] = {0};
+	size_t valueLen = 0;
+	size_t i = 0;
+	
+	for (i=0; i<len; i++)
+	{
+		if (xml[i] != '<')
+		{
+			// Longer values are cut, decodeSerialParam rejects names that do not fit
+			if (depth == 3 && param >= 0 && valueLen < sizeof(value)-1)
+				value[valueLen++] = xml[i];
+			continue;
+		}
+		
+		const char *end = 0;
+		if (!strncmp(xml+i, "<!--", 4))
+		{
+			end = strstr(xml+i+4, "-->");
+			tsErrChk(end ? 0 : -1, "Unterminated comment at line %d of %s", xmlLineAt(xml, i), filePath);
+			i = (size_t) (end - xml) + 2;
+			continue;
+		}
+		end = memchr(xml+i, '>', len-i);
+		tsErrChk(end ? 0 : -1, "Unterminated tag at line %d of %s", xmlLineAt(xml, i), filePath);
+		const char *tag = xml+i+1;
+		size_t tagLen = (size_t) (end - tag);
+		i = (size_t) (end - xml);
+		
+		if (tag[0] == '?' || tag[0] == '!' || (tagLen && tag[tagLen-1] == '/'))
+			continue;				// Declaration, DOCTYPE or empty element
+		
+		if (tag[0] == '/')
+		{
+			if (depth == 3 && param >= 0)
+			{
+				SerialConfigEntry *entry = &(*entries)[*count-1];
+				value[valueLen] = 0;
+				unescapeXmlValue(value);
+				tsErrChk(decodeSerialParam(&entry->desc, entry->name, entry->path, param, value),
+						 "Invalid %s \"%s\" for serial device %d at line %d of %s", glbSerialParamName[param], value, *count,
+						 xmlLineAt(xml, i), filePath);
+			}
+			depth--;
+			param = -1;
+			tsErrChk(depth < 0 ? -1 : 0, "Unexpected closing tag at line %d of %s", xmlLineAt(xml, i), filePath);
+			continue;
+		}
+		
+		depth++;
+		if (depth == 2)
+		{
+			if (*count == capacity)
+			{
+				capacity = capacity ? capacity*2 : 64;
+				SerialConfigEntry *grown = realloc(*entries, (size_t) capacity * sizeof(SerialConfigEntry));
+				tsErrChk(grown ? 0 : -1, "Out of memory reading %s", filePath);
+				*entries = grown;
+			}
+			defaultSerialConfigEntry(&(*entries)[(*count)++]);
+		}
+		else if (depth == 3)
+		{
+			size_t nameLen = strcspn(tag, " \t\r\n>");
+			param = -1;
+			valueLen = 0;
+			for (int j=0; j<9; j++)
+			{
+				if (strlen(glbSerialParamName[j]) == nameLen && !strncmp(tag, glbSerialParamName[j], nameLen))
+					param = j;
+			}
+		}
+	}
+	tsErrChk(depth ? -1 : 0, "Unexpected end of %s", filePath);
+	
+Error:
+	if (error)
+	{
+		free(*entries);
+		*entries = 0;
+		*count = 0;
+	}
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief The same defaults a new row gets in the configuration table
+*******************************************************************************/
+static void defaultSerialConfigEntry(SerialConfigEntry *entry)
+{
+	memset(entry, 0, sizeof(SerialConfigEntry));
+	entry->desc.transport = SERIAL_TRANSPORT_RS232;
+	entry->desc.baudRate = 9600;
+	entry->desc.timeout = 5.0;
+	entry->desc.parity = SERIAL_PARITY_NONE;
+	entry->desc.dataBits = 8;
+	entry->desc.stopBits = 1;
+}
+
+/***************************************************************************//*!
+* \brief Trim whitespace and replace the predefined XML entities in place
+*******************************************************************************/
+static void unescapeXmlValue(char *value)
+{
+	static const char *entities[5][2] = {{"&lt;","<"}, {"&gt;",">"}, {"&amp;","&"}, {"&quot;","\""}, {"&apos;","'"}};
+	char *out = value;
+	char *in = value;
+	
+	while (isspace((unsigned char) *in))
+		in++;
+	while (*in)
+	{
+		int matched = 0;
+		for (int i=0; i<5 && *in=='&' && !matched; i++)
+		{
+			size_t entityLen = strlen(entities[i][0]);
+			if (!strncmp(in, entities[i][0], entityLen))
+			{
+				*out++ = entities[i][1][0];
+				in += entityLen;
+				matched = 1;
+			}
+		}
+		if (!matched)
+			*out++ = *in++;
+	}
+	while (out > value && isspace((unsigned char) out[-1]))
+		out--;
+	*out = 0;
+}
+
+static int xmlLineAt(const char *xml, size_t offset)
+{
+	int line = 1;
+	
+	for (size_t i=0; i<offset; i++)
+	{
+		if (xml[i] == '\n')
+			line++;
+	}
+	return line;
+}
+
+/***************************************************************************//*!
+* \brief 64 bit FNV-1a of the configuration file, identifies its snapshot
+*******************************************************************************/
+static uint64_t hashConfigFile(const char *data, size_t len)
+{
+	uint64_t key = 14695981039346656037ull;
+	
+	for (size_t i=0; i<len; i++)
+	{
+		key ^= (unsigned char) data[i];
+		key *= 1099511628211ull;
+	}
+	return key;
+}
+
+/***************************************************************************//*!
+* \brief Load the device table from a snapshot
+* 
+* \return 0 if the snapshot exists and matches the file, -1 otherwise
+*******************************************************************************/
+static int readConfigSnapshot(const char *snapshotPath, uint64_t xmlHash, uint64_t xmlSize, SerialConfigEntry **entries, int *count)
+{
+	SerialConfigSnapshotHeader header = {0};
+	FILE *file = fopen(snapshotPath, "rb");
+	
+	if (!file)
+		return -1;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, SERIALSNAPSHOTMAGIC, 4)
+		|| header.version != SERIALSNAPSHOTVERSION || header.entrySize != sizeof(SerialConfigEntry)
+		|| header.xmlHash != xmlHash || header.xmlSize != xmlSize)
+	{
+		fclose(file);
+		return -1;
+	}
+	
+	*entries = malloc(header.count ? header.count * sizeof(SerialConfigEntry) : 1);
+	if (!*entries || fread(*entries, sizeof(SerialConfigEntry), header.count, file) != header.count)
+	{
+		free(*entries);
+		*entries = 0;
+		fclose(file);
+		return -1;
+	}
+	*count = (int) header.count;
+	fclose(file);
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Save the device table for the next start. Written to a temporary
+* 		 file first so a reader never sees half a snapshot, failures are
+* 		 ignored (the XML is simply parsed again next time).
+*******************************************************************************/
+static void writeConfigSnapshot(const char *snapshotPath, uint64_t xmlHash, uint64_t xmlSize, const SerialConfigEntry *entries, int count)
+{
+	SerialConfigSnapshotHeader header = {SERIALSNAPSHOTMAGIC, SERIALSNAPSHOTVERSION, sizeof(SerialConfigEntry), (uint32_t) count, xmlHash, xmlSize};
+	char tempPath[MAX_PATHNAME_LEN] = {0};
+	
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", snapshotPath);
+	FILE *file = fopen(tempPath, "wb");
+	if (!file)
+		return;
+	int written = fwrite(&header, sizeof(header), 1, file) == 1
+				  && fwrite(entries, sizeof(SerialConfigEntry), (size_t) count, file) == (size_t) count;
+	if (fclose(file) || !written)
+	{
+		remove(tempPath);
+		return;
+	}
+	remove(snapshotPath);
+	rename(tempPath, snapshotPath);
+}
+
+/***************************************************************************//*!
+* \brief Check if string is a valid XML tag
+*
+* \param [in] string
+*******************************************************************************/
+int ISValidXMLSerial (char * string)
+{
+	int 	i = 0;
+	size_t	len = 0;
+	int 	allNums = 0;
+
+	if (string[0] == '\0')
+		return 0;
+
+	len = strlen(string);
+	for (i = 0; i < len; i++)
+	{
+		if (isdigit (string[i]))
+		{
+			if (i == 0)
+				allNums = 1;
+		}
+		else
+		{
+			allNums = 0;
+		}
+
+		if (!isalnum (string[i]) || isspace (string[i]))
+			return 0;
+	}
+
+	if (allNums)
+		return 0;
+
+	return 1;
+} 
+
+/***************************************************************************//*!
+* \brief Display help information to the user based on RS232Error code
+*
+* \param [in] RS232Error 	Error code
+*******************************************************************************/
+void DisplayRS232Error (int RS232Error)
+{
+	char ErrorMessage[200];
+	switch (RS232Error)
+	{
+		default :
+			if (RS232Error < 0)
+			{
+				Fmt (ErrorMessage, "%s<RS232 error number %i", RS232Error);
+				MessagePopup ("RS232 Message", ErrorMessage);
+			}
+			break;
+		case 0  :
+			MessagePopup ("RS232 Message", "No errors.");
+			break;
+		case -2 :
+			Fmt (ErrorMessage, "%s", "Invalid port number (must be in the "
+				 "range 1 to 8).");
+			MessagePopup ("RS232 Message", ErrorMessage);
+			break;
+		case -3 :
+			Fmt (ErrorMessage, "%s", "No port is open.\n"
+				 "Check COM Port setting in Configure.");
+			MessagePopup ("RS232 Message", ErrorMessage);
+			break;
+		case -99 :
+			Fmt (ErrorMessage, "%s", "Timeout error.\n\n"
+				 "Either increase timeout value,\n"
+				 "       check COM Port setting, or\n"
+				 "       check device.");
+			MessagePopup ("RS232 Message", ErrorMessage);
+			break;
+	}
+}
+
+/***************************************************************************//*!
+* \brief Get the in queue length for a specified device
+*
+* \param [in] SerialDeviceName 	Name of device  
+* 
+* \return the in queue length or error code
+* 		  - 0 -> COM Port status error
+*******************************************************************************/
+int GetInQLenForDeviceName(char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = GetInQLenForHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Get the in queue length for a device handle
+*
+* \param [in] Handle 			Handle of device
+* 
+* \return the in queue length or error code
+* 		  - 0 -> COM Port status error
+*******************************************************************************/
+int GetInQLenForHandle(int Handle, char errmsg[ERRLEN])
+{
+	int queueLength = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	
+	if (serialPort(Handle-1)->rx.running)
+	{
+		queueLength = (int) (serialPort(Handle-1)->rx.head - serialPort(Handle-1)->rx.tail);
+		goto Error;
+	}
+
+	if (serialPort(Handle-1)->desc.portOpen==1)
+		queueLength = serialPort(Handle-1)->transport.ops->inQLen(&serialPort(Handle-1)->transport);
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return queueLength;
+}
+
+/***************************************************************************//*!
+* \brief Decode the escapes of a string in place, kept for existing callers.
+* 		 Use CompileSerialTemplate for new code.
+*
+* The string is decoded by the template compiler, so besides \\0xNN it also
+* takes the other escapes of CompileSerialTemplate. Braces have to be escaped
+* as \\{ and \\}, a string with parameter slots is left unchanged. A decoded
+* 0x00 byte ends the string.
+*
+* \param [in,out] string 			String to decode
+*
+* \return Length of the decoded bytes or -1 if the string was left unchanged
+*******************************************************************************/
+int HexToCharInString(char *string)
+{
+	SerialTemplate *compiled = 0;
+	char errmsg[ERRLEN] = {0};
+	int len = -1;
+	
+	// Escapes only get shorter, the decoded bytes fit the string
+	if (!CompileSerialTemplate(string, &compiled, errmsg) && !GetSerialTemplateSlots(compiled))
+		len = RenderSerialTemplate(compiled, string, (int) strlen(string)+1, errmsg);
+	if (len >= 0)
+		string[len] = 0;
+	FreeSerialTemplate(compiled);
+	return len < 0 ? -1 : len;
+}
+
+/***************************************************************************//*!
+* \brief get library revision
+*
+*******************************************************************************/
+char *getSerialLibRevision (void)
+{
+	return SERIALLIBREV;
+}
+
+/***************************************************************************//*!
+* \brief Wait up to 10 s for a motor to answer ACK, the in queue is flushed
+* 		 before and after
+*
+* With the receive engine running this is WaitForPattern. Otherwise a pumped
+* ring (see rxPumpStart) is filled here while waiting, no reader thread is
+* started.
+*
+* \return 0, or -1 if no ACK came
+*******************************************************************************/
+int ReadMotor(char *Motor)
+{
+	char errmsg[ERRLEN] = {0};
+	SerialPortLock *lock = 0;
+	SerialRxEngine *rx = 0;
+	int handle = 0;
+	int found = 0;
+	libInit;
+	
+	nameToHandle(Motor, handle);
+	rx = &serialPort(handle-1)->rx;
+	
+	if (rx->running)
+	{
+		// The reader thread fills the ring, the wait leaves the device to others
+		FlushInQHandle(handle, errmsg);
+		found = WaitForPattern(handle, "ACK", 3, Timer() + 10.0, 0, errmsg) >= 0;
+		FlushInQHandle(handle, errmsg);
+		goto Error;
+	}
+	
+	handleLock(handle, lock);
+	openErrChk(handle);
+	SerialTransport *port = &serialPort(handle-1)->transport;
+	libErrChk(rxPumpStart(rx, handle-1), "Unable to allocate the receive buffer of %s", Motor);
+	port->ops->flush(port, 1);
+	
+	double deadline = Timer() + 10.0;
+	unsigned int scanned = rx->tail;
+	while (!found && Timer() < deadline)
+	{
+		int count = rxFill(rx, deadline - Timer());
+		libErrChk(count < 0 ? count : 0, "Unable to read from %s: %s", Motor, transportErrorText(port, count));
+		for (; !found && rx->head - scanned >= 3; scanned++)
+			found = rx->buffer[scanned & (rx->size-1)] == 'A' && rx->buffer[(scanned+1) & (rx->size-1)] == 'C' &&
+					rx->buffer[(scanned+2) & (rx->size-1)] == 'K';
+		// Only a partial ACK has to be kept, so the ring never fills
+		rx->tail = scanned;
+	}
+	port->ops->flush(port, 1);
+	
+Error:
+	if (rx && rx->pumped)
+		stopRxEngine(rx);
+	serialLockRelease(lock);
+	if (!found)
+	{
+		if (!error)
+			reportSerialError(handle, ERR_SERIAL_TIMEOUT, Motor, "No Response from Motor");
+		return -1;
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Flush the IN queue for the specified serial device COM port
+*
+* \param [in] SerialDeviceName 	Name of device
+*******************************************************************************/
+int FlushInQDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = FlushInQHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Flush the IN queue for a device handle
+*
+* \param [in] Handle 			Handle of device
+*******************************************************************************/
+int FlushInQHandle(int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	
+	openErrChk(Handle);
+	libErrChk(flushRx(&serialPort(Handle-1)->rx), "Release the frame of %s before flushing it", serialPort(Handle-1)->name);
+	libErrChk(serialPort(Handle-1)->transport.ops->flush(&serialPort(Handle-1)->transport, 1), "%s", errmsg);
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Flush the OUT queue for the specified serial device COM port
+*
+* \param [in] SerialDeviceName 	Name of device
+*******************************************************************************/
+int FlushOutQDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = FlushOutQHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Flush the OUT queue for a device handle
+*
+* \param [in] Handle 			Handle of device
+*******************************************************************************/
+int FlushOutQHandle(int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	
+	openErrChk(Handle);
+	libErrChk(serialPort(Handle-1)->transport.ops->flush(&serialPort(Handle-1)->transport, 0), "%s", errmsg);
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Receive Engine
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Start the background receive engine of an open serial device
+*
+* A reader thread drains the driver in queue of the port into a lock-free
+* single producer/single consumer ring buffer. While the engine runs, the read,
+* queue length and flush calls of the device are served from the ring, and
+* ReadSerialRx can block on data with a deadline. The reader sleeps in the wait
+* operation of the transport, which owns the port timeout while the engine runs
+* (see SERIALRXPOLLTIME).
+*
+* \param [in] Handle 				Handle of serial device
+* \param [in] BufferSize 			Ring size in bytes, rounded up to a power
+* 									of 2. Pass 0 for SERIALRXDEFAULTSIZE
+*******************************************************************************/
+int StartSerialRxEngine(int Handle, int BufferSize, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialRxEngine *rx = &serialPort(Handle-1)->rx;
+	
+	libErrChk(serialPort(Handle-1)->desc.portOpen!=1 ? -1 : 0, "Please Initalize device %s before starting the receive engine", serialPort(Handle-1)->name);
+	if (rx->running)
+		goto Error;
+	
+	unsigned int size = SERIALRXMINSIZE;
+	while (size < (unsigned int) (BufferSize > 0 ? BufferSize : SERIALRXDEFAULTSIZE))
+		size <<= 1;
+	
+	rx->buffer = malloc(size);
+	libErrChk(rx->buffer ? 0 : -1, "Unable to allocate %u byte receive buffer for %s", size, serialPort(Handle-1)->name);
+	rx->size = size;
+	rx->head = 0;
+	rx->tail = 0;
+	rx->stalls = 0;
+	rx->lastError = 0;
+	rx->index = Handle-1;
+	rxSignalInit(rx);
+	framerReset(serialPort(Handle-1));
+	
+	rx->running = 1;
+	error = CmtScheduleThreadPoolFunction(glbSerialRxThreadPool, SerialRxThread, rx, &rx->threadID);
+	if (error < 0)
+	{
+		rx->running = 0;
+		stopRxEngine(rx);
+		libErrChk(error, "Unable to start receive thread for %s", serialPort(Handle-1)->name);
+	}
+	error = 0;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Stop the background receive engine of a serial device. Data still in
+* 		 the ring buffer is discarded.
+*
+* \param [in] Handle 				Handle of serial device
+*******************************************************************************/
+int StopSerialRxEngine(int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	stopRxEngine(&serialPort(Handle-1)->rx);
+	serialPort(Handle-1)->pipeline.startedEngine = 0;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Read from the receive engine ring buffer of a serial device
+*
+* Blocks until numBytesToRead bytes are available or the deadline passes,
+* without polling the port.
+*
+* \param [in] 	Handle 						Handle of serial device to read from
+* \param [out]  ReadData 					
+* \param [in] 	numBytesToRead 				Number of bytes to read
+* \param [in] 	Deadline 					Absolute deadline in Timer() seconds
+*
+* \return The number of bytes read (less than requested if the deadline passed)
+* 		  or negative error code
+*******************************************************************************/
+int ReadSerialRx(int Handle, char *ReadData, int numByteToRead, double Deadline, char errmsg[ERRLEN])
+{
+	int bytesRead = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	libErrChk(serialPort(Handle-1)->rx.running ? 0 : -1, "Receive engine of %s is not running", serialPort(Handle-1)->name);
+	
+	bytesRead = rxRead(&serialPort(Handle-1)->rx, ReadData, numByteToRead, Deadline, -1);
+	latencyReply(Handle-1, bytesRead);
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return bytesRead;
+}
+
+/***************************************************************************//*!
+* \brief Block until at least numBytes bytes have been received by a device
+*
+* Sleeps on the receive engine signal and wakes as soon as the reader thread
+* delivers enough data, nothing is consumed. The device lock is only held to
+* look at the ring, other threads can use the device during the wait. The
+* receive engine of the device has to be running, see StartSerialRxEngine.
+*
+* \param [in] 	Handle 				Handle of serial device
+* \param [in] 	numBytes 			Number of bytes to wait for
+* \param [in] 	Deadline 			Absolute deadline in Timer() seconds
+* \param [out] 	WaitTime 			OPT Time spent waiting in seconds
+*
+* \return The number of bytes available, ERR_SERIAL_TIMEOUT if the deadline
+* 		  passed first or negative error code
+*******************************************************************************/
+int WaitForBytes(int Handle, int numBytes, double Deadline, double *WaitTime, char errmsg[ERRLEN])
+{
+	int available = 0;
+	double startTime = Timer();
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialRxEngine *rx = &serialPort(Handle-1)->rx;
+	libErrChk(rx->running ? 0 : -1, "Receive engine of %s is not running, start it with StartSerialRxEngine", serialPort(Handle-1)->name);
+	
+	while ((available = (int) (rx->head - rx->tail)) < numBytes)
+	{
+		double remaining = Deadline - Timer();
+		libErrChk(remaining <= 0 || !rx->running ? ERR_SERIAL_TIMEOUT : 0, "Timed out waiting for %d bytes from %s, %d received", numBytes, serialPort(Handle-1)->name, available);
+		libErrChk(rxWaitUnlocked(Handle, &lock, remaining), "Serial device handle %d was removed", Handle);
+	}
+	
+Error:
+	serialLockRelease(lock);
+	if (WaitTime)
+		*WaitTime = Timer() - startTime;
+	if(error)
+		return error;
+	else
+		return available;
+}
+
+/***************************************************************************//*!
+* \brief Block until a byte pattern has been received by a device
+*
+* Data already scanned is not scanned again after a wake-up, nothing is
+* consumed. As with WaitForBytes the device lock is only held to look at the
+* ring. The receive engine of the device has to be running, see
+* StartSerialRxEngine.
+*
+* \param [in] 	Handle 				Handle of serial device
+* \param [in] 	Pattern 			Bytes to wait for
+* \param [in] 	PatternLen 			Length of the pattern
+* \param [in] 	Deadline 			Absolute deadline in Timer() seconds
+* \param [out] 	WaitTime 			OPT Time spent waiting in seconds
+*
+* \return The number of bytes up to and including the pattern, so a read of
+* 		  that length returns the data ending with the pattern,
+* 		  ERR_SERIAL_TIMEOUT if the deadline passed first or negative error code
+*******************************************************************************/
+int WaitForPattern(int Handle, char *Pattern, int PatternLen, double Deadline, double *WaitTime, char errmsg[ERRLEN])
+{
+	int frameLen = 0;
+	double startTime = Timer();
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	libErrChk(PatternLen < 1 ? -1 : 0, "Pattern can not be empty");
+	SerialRxEngine *rx = &serialPort(Handle-1)->rx;
+	libErrChk(rx->running ? 0 : -1, "Receive engine of %s is not running, start it with StartSerialRxEngine", serialPort(Handle-1)->name);
+	
+	unsigned int scanned = rx->tail;	// Next position the pattern could start at
+	while (1)
+	{
+		unsigned int head = rx->head;
+		unsigned int tail = rx->tail;
+		SerialMemoryBarrier();
+		
+		// Also after the engine was restarted during the wait, the ring starts at 0 again
+		if ((int) (scanned - tail) < 0 || (int) (head - scanned) < 0)
+			scanned = tail;
+		for (; head - scanned >= (unsigned int) PatternLen; scanned++)
+		{
+			int i = 0;
+			while (i < PatternLen && rx->buffer[(scanned+i) & (rx->size-1)] == (unsigned char) Pattern[i])
+				i++;
+			if (i == PatternLen)
+			{
+				frameLen = (int) (scanned + PatternLen - tail);
+				goto Error;
+			}
+		}
+		
+		double remaining = Deadline - Timer();
+		libErrChk(remaining <= 0 || !rx->running ? ERR_SERIAL_TIMEOUT : 0, "Timed out waiting for pattern from %s, %u bytes received", serialPort(Handle-1)->name, head - tail);
+		libErrChk(rxWaitUnlocked(Handle, &lock, remaining), "Serial device handle %d was removed", Handle);
+	}
+	
+Error:
+	serialLockRelease(lock);
+	if (WaitTime)
+		*WaitTime = Timer() - startTime;
+	if(error)
+		return error;
+	else
+		return frameLen;
+}
+
+/***************************************************************************//*!
+* \brief Reader thread of the receive engine. Only this thread moves the ring
+* 		 head, only the consumer moves the tail.
+*******************************************************************************/
+static int CVICALLBACK SerialRxThread(void *functionData)
+{
+	SerialRxEngine *rx = (SerialRxEngine*) functionData;
+	
+	DisableBreakOnLibraryErrors ();
+	while (rx->running)
+	{
+		if (rx->head - rx->tail == rx->size)
+		{
+			// Consumer is behind, leave the data in the driver queue for now
+			rx->stalls++;
+			Delay(0.001);
+			continue;
+		}
+		
+		// Blocks up to SERIALRXPOLLTIME for the first byte, then takes whatever
+		// else has arrived
+		int count = rxFill(rx, SERIALRXPOLLTIME);
+		if (count < 0)
+		{
+			rx->lastError = count;
+			Delay(SERIALRXPOLLTIME);
+		}
+	}
+	EnableBreakOnLibraryErrors ();
+	
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Read what has arrived into the ring, blocking up to timeout for the
+* 		 first byte. Only one thread at a time may fill a ring, the
+* 		 reader thread or the consumer of a pumped ring.
+*
+* \return Number of bytes added, 0 if none arrived or the ring is full, or
+* 		  negative transport error
+*******************************************************************************/
+static int rxFill(SerialRxEngine *rx, double timeout)
+{
+	SerialTransport *port = &serialPort(rx->index)->transport;
+	unsigned int head = rx->head;
+	unsigned int space = rx->size - (head - rx->tail);
+	unsigned int start = head & (rx->size-1);
+	
+	if (space == 0)
+		return 0;
+	if (space > rx->size - start)
+		space = rx->size - start;
+	
+	int count = port->ops->wait(port, (char*) rx->buffer + start, (int) space, timeout);
+	if (count > 0)
+	{
+		SerialIOVec chunk = {rx->buffer + start, count};
+		captureTraffic(rx->index, SERIAL_CAPTURE_RX, &chunk, 1);
+		SerialMemoryBarrier();
+		rx->head = head + count;
+		serialSignalSet(&rx->dataReady);
+	}
+	return count;
+}
+
+/***************************************************************************//*!
+* \brief Set up a ring for one exchange on a port without receive engine. The
+* 		 framer reads from it as usual, but the consumer fills it itself with
+* 		 rxFill while it waits, so no reader thread has to be started and
+* 		 stopped. Call with the port locked, stopRxEngine releases it.
+*
+* \return 0, or -1 if out of memory
+*******************************************************************************/
+static int rxPumpStart(SerialRxEngine *rx, int index)
+{
+	rx->buffer = malloc(SERIALRXMINSIZE);
+	if (!rx->buffer)
+		return -1;
+	rx->size = SERIALRXMINSIZE;
+	rx->head = 0;
+	rx->tail = 0;
+	rx->index = index;
+	rxSignalInit(rx);
+	framerReset(serialPort(index));
+	rx->pumped = 1;
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Stop the reader thread, or end a pumped ring, and release the ring
+* 		 buffer
+*******************************************************************************/
+static void stopRxEngine(SerialRxEngine *rx)
+{
+	if (rx->running || rx->pumped)
+	{
+		if (rx->running)
+		{
+			rx->running = 0;
+			CmtWaitForThreadPoolFunctionCompletion(glbSerialRxThreadPool, rx->threadID, 0);
+			CmtReleaseThreadPoolFunctionID(glbSerialRxThreadPool, rx->threadID);
+			rx->threadID = 0;
+			if (rx->waiters)
+				serialSignalSet(&rx->dataReady);
+		}
+		rx->pumped = 0;
+		SerialTransport *port = &serialPort(rx->index)->transport;
+		port->ops->setTimeout(port, serialPort(rx->index)->desc.timeout);
+	}
+	if (rx->buffer)
+	{
+		// Sleeping waiters still hold the signal, the last one discards it
+		if (rx->signalReady && !rx->waiters)
+		{
+			serialSignalDiscard(&rx->dataReady);
+			rx->signalReady = 0;
+		}
+		free(rx->buffer);
+		rx->buffer = 0;
+		rx->head = 0;
+		rx->tail = 0;
+		framerReset(serialPort(rx->index));
+	}
+}
+
+/***************************************************************************//*!
+* \brief Create the data signal of a ring, unless waiters from an earlier
+* 		 ring still hold it. Call with the port locked.
+*******************************************************************************/
+static void rxSignalInit(SerialRxEngine *rx)
+{
+	if (rx->signalReady)
+		return;
+	serialSignalInit(&rx->dataReady);
+	rx->signalReady = 1;
+}
+
+/***************************************************************************//*!
+* \brief Sleep on the data signal of a port with its lock released, so the
+* 		 port stays usable during long waits. Call with the port locked, it is
+* 		 locked again on return.
+*
+* The signal wakes one sleeper, another consumer can take the wake, so the
+* sleep is cut to SERIALRXPOLLTIME.
+*
+* \return 0, or ERR_INVALID_SERIAL_HANDLE if the device was removed meanwhile
+*******************************************************************************/
+static int rxWaitUnlocked(int Handle, SerialPortLock **Lock, double Timeout)
+{
+	SerialRxEngine *rx = &serialPort(Handle-1)->rx;
+	
+	rx->waiters++;
+	serialLockRelease(*Lock);
+	serialSignalWait(&rx->dataReady, Timeout < SERIALRXPOLLTIME ? Timeout : SERIALRXPOLLTIME);
+	*Lock = serialLockAcquire(&serialPort(Handle-1)->lock);
+	rx->waiters--;
+	
+	// The ring was stopped meanwhile, the last sleeper discards the signal
+	if (!rx->waiters && !rx->buffer && rx->signalReady)
+	{
+		serialSignalDiscard(&rx->dataReady);
+		rx->signalReady = 0;
+	}
+	return serialPort(Handle-1)->name[0] ? 0 : ERR_INVALID_SERIAL_HANDLE;
+}
+
+/***************************************************************************//*!
+* \brief Consume bytes from the ring buffer until numBytes are read, the
+* 		 termination byte is found or the deadline passes. The termination
+* 		 byte is consumed but not stored, as with ComRdTerm.
+*
+* \param [in] terminationByte 		Pass -1 to read without termination byte
+*
+* \return Number of bytes stored in ReadData
+*******************************************************************************/
+static int rxRead(SerialRxEngine *rx, char *ReadData, int numBytes, double Deadline, int terminationByte)
+{
+	int bytesRead = 0;
+	
+	while (bytesRead < numBytes && rx->running)
+	{
+		unsigned int head = rx->head;
+		unsigned int tail = rx->tail;
+		SerialMemoryBarrier();
+		
+		if (terminationByte < 0)
+		{
+			while (tail != head && bytesRead < numBytes)
+			{
+				unsigned int start = tail & (rx->size-1);
+				unsigned int count = head - tail;
+				if (count > rx->size - start)
+					count = rx->size - start;
+				if (count > (unsigned int) (numBytes - bytesRead))
+					count = (unsigned int) (numBytes - bytesRead);
+				memcpy(ReadData + bytesRead, rx->buffer + start, count);
+				bytesRead += count;
+				tail += count;
+			}
+		}
+		else
+		{
+			while (tail != head && bytesRead < numBytes)
+			{
+				unsigned char c = rx->buffer[tail++ & (rx->size-1)];
+				if (c == (unsigned char) terminationByte)
+				{
+					SerialMemoryBarrier();
+					rx->tail = tail;
+					return bytesRead;
+				}
+				ReadData[bytesRead++] = (char) c;
+			}
+		}
+		SerialMemoryBarrier();
+		rx->tail = tail;
+		
+		double remaining = Deadline - Timer();
+		if (bytesRead >= numBytes || remaining <= 0)
+			break;
+		serialSignalWait(&rx->dataReady, remaining);
+	}
+	return bytesRead;
+}
+
+/***************************************************************************//*!
+* \brief Drop everything received so far. Called from the consumer side.
+*
+* \return 0, or -1 if a frame from GetSerialFrame is still held. Nothing is
+* 		  dropped then, the frame points into the ring.
+*******************************************************************************/
+static int flushRx(SerialRxEngine *rx)
+{
+	if (!rx->running && !rx->pumped)
+		return 0;
+	if (serialPort(rx->index)->framer.frameLen)
+		return -1;
+	rx->tail = rx->head;
+	return 0;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Pipeline
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Switch the pipelined request mode of a device on or off
+*
+* In pipelined mode writes no longer flush the in queue, so several requests
+* can be outstanding at once. Requests sent with SubmitSerialRequest are
+* tagged and CollectSerialReply hands the replies back in the order the
+* requests were sent. The receive engine is started when the mode is turned
+* on and stopped again when it is turned off, unless it was already running.
+* Switching the mode either way discards outstanding requests and everything
+* received so far.
+*
+* \param [in] Handle 				Handle of serial device
+* \param [in] Enable 				1 for pipelined mode, 0 for the default
+* 									flush on write behaviour
+*
+* \return The previous mode or negative error code
+*******************************************************************************/
+int SetSerialPipelineMode(int Handle, int Enable, char errmsg[ERRLEN])
+{
+	int previous = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialPipeline *pipe = &serialPort(Handle-1)->pipeline;
+	
+	previous = pipe->enabled;
+	if (Enable && !serialPort(Handle-1)->rx.running)
+	{
+		libErrChk(StartSerialRxEngine(Handle, 0, errmsg), "%s", errmsg);
+		pipe->startedEngine = 1;
+	}
+	
+	// Bytes from before the switch would be taken for the reply to the first request after it
+	if ((Enable ? 1 : 0) != previous && serialPort(Handle-1)->desc.portOpen==1)
+	{
+		SerialTransport *port = &serialPort(Handle-1)->transport;
+		int flushed = port->ops->flush(port, 1);
+		libErrChk(flushed < 0 ? flushed : 0, "Unable to flush %s: %s", serialPort(Handle-1)->name, transportErrorText(port, flushed));
+		libErrChk(flushRx(&serialPort(Handle-1)->rx), "Release the frame of %s before switching its pipeline mode", serialPort(Handle-1)->name);
+	}
+	if (!Enable && pipe->startedEngine)
+	{
+		stopRxEngine(&serialPort(Handle-1)->rx);
+		pipe->startedEngine = 0;
+	}
+	pipe->enabled = Enable ? 1 : 0;
+	pipe->head = 0;
+	pipe->tail = 0;
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return previous;
+}
+
+/***************************************************************************//*!
+* \brief Pipelined request mode of a device, see SetSerialPipelineMode
+*
+* \return 1 when pipelined, 0 when not or negative error code
+*******************************************************************************/
+int GetSerialPipelineMode(int Handle, char errmsg[ERRLEN])
+{
+	libInit;
+	
+	handleErrChk(Handle);
+	
+Error:
+	if(error)
+		return error;
+	else
+		return serialPort(Handle-1)->pipeline.enabled;
+}
+
+/***************************************************************************//*!
+* \brief Send a request on a pipelined device without waiting for its reply
+*
+* \param [in] 	Handle 				Handle of a device in pipelined mode
+* \param [in] 	Request 			Request to send
+* \param [in] 	RequestLen 			Length of the request
+* \param [in] 	TerminationByte 	Last byte of the reply, the reply is
+* 									expected to end with it. Pass -1 for a
+* 									command without reply, it is not queued.
+* \param [out] 	Tag 				OPT Tag identifying the request, 0 when no
+* 									reply is expected
+*
+* \return Number of bytes written or negative error code
+*******************************************************************************/
+int SubmitSerialRequest(int Handle, char *Request, int RequestLen, int TerminationByte, int *Tag, char errmsg[ERRLEN])
+{
+	int bytesWritten = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialPipeline *pipe = &serialPort(Handle-1)->pipeline;
+	
+	libErrChk(pipe->enabled ? 0 : -1, "Device %s is not in pipelined mode", serialPort(Handle-1)->name);
+	libErrChk(TerminationByte >= 0 && pipe->head - pipe->tail >= SERIALPIPELINEDEPTH ? -1 : 0,
+			  "Device %s already has %d requests outstanding", serialPort(Handle-1)->name, SERIALPIPELINEDEPTH);
+	
+	bytesWritten = WriteSerialHandleRaw(Handle, Request, RequestLen, errmsg);
+	libErrChk(bytesWritten < 0 ? bytesWritten : 0, "%s", errmsg);
+	libErrChk(bytesWritten != RequestLen ? ERR_SERIAL_TIMEOUT : 0, "Only %d of %d bytes written to %s", bytesWritten, RequestLen, serialPort(Handle-1)->name);
+	
+	if (Tag)
+		*Tag = 0;
+	if (TerminationByte >= 0)
+	{
+		SerialPendingRequest *req = &pipe->pending[pipe->head % SERIALPIPELINEDEPTH];
+		req->tag = (int) (++pipe->nextTag & 0x7FFFFFFF);
+		req->terminationByte = TerminationByte;
+		pipe->head++;
+		if (Tag)
+			*Tag = req->tag;
+	}
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return bytesWritten;
+}
+
+/***************************************************************************//*!
+* \brief Collect the reply to the oldest outstanding request of a pipelined
+* 		 device
+*
+* The reply is only consumed once it is complete, so a timeout leaves the
+* request outstanding and the call can be repeated.
+*
+* \param [in] 	Handle 				Handle of a device in pipelined mode
+* \param [out] 	Tag 				OPT Tag of the request the reply belongs to
+* \param [out] 	Reply 				Reply without its termination byte, null
+* 									terminated
+* \param [in] 	ReplyLen 			Size of the Reply buffer
+* \param [in] 	Deadline 			Absolute deadline in Timer() seconds
+*
+* \return Length of the reply, ERR_SERIAL_TIMEOUT or negative error code
+*******************************************************************************/
+int CollectSerialReply(int Handle, int *Tag, char *Reply, int ReplyLen, double Deadline, char errmsg[ERRLEN])
+{
+	int replyLen = 0;
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialPipeline *pipe = &serialPort(Handle-1)->pipeline;
+	
+	libErrChk(pipe->enabled ? 0 : -1, "Device %s is not in pipelined mode", serialPort(Handle-1)->name);
+	libErrChk(pipe->head == pipe->tail ? -1 : 0, "No request outstanding on %s", serialPort(Handle-1)->name);
+	
+	SerialPendingRequest *req = &pipe->pending[pipe->tail % SERIALPIPELINEDEPTH];
+	char terminator = (char) req->terminationByte;
+	int frameLen = WaitForPattern(Handle, &terminator, 1, Deadline, 0, errmsg);
+	libErrChk(frameLen < 0 ? frameLen : 0, "No reply to request %d from %s", req->tag, serialPort(Handle-1)->name);
+	libErrChk(frameLen > ReplyLen ? -1 : 0, "Reply of %d bytes from %s does not fit the %d byte buffer", frameLen, serialPort(Handle-1)->name, ReplyLen);
+	
+	// The frame is complete in the ring, this can not block
+	replyLen = rxRead(&serialPort(Handle-1)->rx, Reply, frameLen, Deadline, req->terminationByte);
+	Reply[replyLen] = 0;
+	
+	if (Tag)
+		*Tag = req->tag;
+	pipe->tail++;
+	
+Error:
+	serialLockRelease(lock);
+	if(error)
+		return error;
+	else
+		return replyLen;
+}
+
+/***************************************************************************//*!
+* \brief Number of pipelined requests still waiting for a reply
+*******************************************************************************/
+int GetSerialRequestsOutstanding(int Handle, char errmsg[ERRLEN])
+{
+	libInit;
+	
+	handleErrChk(Handle);
+	
+Error:
+	if(error)
+		return error;
+	else
+		return (int) (serialPort(Handle-1)->pipeline.head - serialPort(Handle-1)->pipeline.tail);
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Framing
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Set how the byte stream of a device is cut into frames
+*
+* The receive engine of the device has to be running, see StartSerialRxEngine.
+* GetSerialFrame then hands out complete frames directly from the receive ring
+* without copying:
+* - SERIAL_FRAME_TERMINATOR: up to and including a 1 to SERIALMAXTERMINATORLEN
+*   byte terminator; the search resumes where the last call stopped
+* - SERIAL_FRAME_MODBUS_RTU: length from the function code and byte count,
+*   checked by CRC. On a bad CRC one byte is dropped and the next frame is
+*   searched from there.
+* - SERIAL_FRAME_FIXED: every Rule.length bytes
+* Data that can not be the start of a frame, or a terminator frame longer than
+* Rule.maxLength, is dropped and counted.
+*
+* Do not mix the framer with ReadSerialHandle or ReadSerialRx on the same
+* device, both consume the receive ring.
+*
+* \param [in] Handle 				Handle of serial device
+* \param [in] Rule 					Framing rule, 0 to stop framing
+*******************************************************************************/
+int SetSerialFrameRule(int Handle, const SerialFrameRule *Rule, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialFramer *framer = &serialPort(Handle-1)->framer;
+	
+	if (!Rule)
+	{
+		// A frame still held goes back to the ring, the next rule starts at tail
+		if (framer->frameLen)
+		{
+			SerialMemoryBarrier();
+			serialPort(Handle-1)->rx.tail += framer->frameLen;
+			framer->frameLen = 0;
+		}
+		framer->scanned = serialPort(Handle-1)->rx.tail;
+		framer->active = 0;
+		goto Error;
+	}
+	libErrChk(Rule->type == SERIAL_FRAME_TERMINATOR && (Rule->terminatorLen < 1 || Rule->terminatorLen > SERIALMAXTERMINATORLEN) ? -1 : 0,
+			  "Terminator length must be between 1 and %d", SERIALMAXTERMINATORLEN);
+	libErrChk(Rule->type == SERIAL_FRAME_FIXED && Rule->length < 1 ? -1 : 0, "Fixed frame length must be positive");
+	libErrChk(Rule->type < SERIAL_FRAME_TERMINATOR || Rule->type > SERIAL_FRAME_FIXED ? -1 : 0, "Unknown frame type %d", Rule->type);
+	libErrChk(serialPort(Handle-1)->rx.running || serialPort(Handle-1)->rx.pumped ? 0 : -1,
+			  "Receive engine of %s is not running, start it with StartSerialRxEngine", serialPort(Handle-1)->name);
+	
+	SerialRxEngine *rx = &serialPort(Handle-1)->rx;
+	libErrChk(Rule->type == SERIAL_FRAME_FIXED && (unsigned int) Rule->length > rx->size ? -1 : 0,
+			  "Frame length %d does not fit the %u byte receive buffer of %s", Rule->length, rx->size, serialPort(Handle-1)->name);
+	
+	if (framer->frameLen)
+	{
+		SerialMemoryBarrier();
+		rx->tail += framer->frameLen;
+	}
+	framer->rule = *Rule;
+	if (framer->rule.maxLength <= 0 || (unsigned int) framer->rule.maxLength > rx->size)
+		framer->rule.maxLength = (int) rx->size;
+	framer->scanned = rx->tail;
+	framer->frameLen = 0;
+	framer->idleHead = rx->head;
+	framer->idleSince = Timer();
+	framer->dropped = 0;
+	framer->crcErrors = 0;
+	framer->active = 1;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Wait for the next complete frame of a device
+*
+* The frame points into the receive ring and stays valid until
+* ReleaseSerialFrame or the next GetSerialFrame, which releases the previous
+* frame. A frame that wraps around the end of the ring comes in two parts.
+* Writes that flush the in queue and FlushInQHandle fail while a frame is held.
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [out] Frame 				The frame
+* \param [in]  Deadline 			Absolute deadline in Timer() seconds
+*
+* \return Length of the frame or negative error code, ERR_SERIAL_TIMEOUT if no
+* 		  complete frame arrived before the deadline
+*******************************************************************************/
+int GetSerialFrame(int Handle, SerialFrame *Frame, double Deadline, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	error = framerNext(Handle-1, Frame, Deadline, 0, 0, errmsg);
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Give the space of the last frame back to the receive engine
+*
+* \param [in] Handle 				Handle of serial device
+*******************************************************************************/
+int ReleaseSerialFrame(int Handle, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialFramer *framer = &serialPort(Handle-1)->framer;
+	
+	if (framer->frameLen)
+	{
+		SerialMemoryBarrier();
+		serialPort(Handle-1)->rx.tail += framer->frameLen;
+		framer->frameLen = 0;
+	}
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Get the number of bytes the framer of a device discarded
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [out] Dropped 			Bytes that were not part of a frame, can be 0
+* \param [out] CrcErrors 			Modbus frames that failed the CRC, can be 0
+*******************************************************************************/
+int GetSerialFrameErrors(int Handle, unsigned int *Dropped, unsigned int *CrcErrors, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	if (Dropped)
+		*Dropped = serialPort(Handle-1)->framer.dropped;
+	if (CrcErrors)
+		*CrcErrors = serialPort(Handle-1)->framer.crcErrors;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Copy a frame into a buffer, for callers that keep it past the release
+*
+* \return Number of bytes copied
+*******************************************************************************/
+int CopySerialFrame(const SerialFrame *Frame, char *Buffer, int BufferLen)
+{
+	int copied = 0;
+	
+	for (int i=0; i<2 && copied<BufferLen; i++)
+	{
+		int count = Frame->part[i].len < BufferLen - copied ? Frame->part[i].len : BufferLen - copied;
+		memcpy(Buffer + copied, Frame->part[i].data, (size_t) count);
+		copied += count;
+	}
+	return copied;
+}
+
+/***************************************************************************//*!
+* \brief Release the last frame and wait for the next one, see GetSerialFrame.
+* 		 Call with the port locked.
+*
+* \param [out] FirstByte 			Timer() when the first byte of the frame was
+* 									seen, if it is 0 on entry. Can be 0.
+* \param [in]  FailOnCrc 			Return ERR_SERIAL_CRC for a Modbus frame with
+* 									a bad CRC instead of searching on
+*******************************************************************************/
+static int framerNext(int index, SerialFrame *Frame, double Deadline, double *FirstByte, int FailOnCrc, char errmsg[ERRLEN])
+{
+	int frameLen = 0;
+	fnInit;
+	
+	SerialPort *port = serialPort(index);
+	SerialRxEngine *rx = &port->rx;
+	SerialFramer *framer = &port->framer;
+	
+	libErrChk(framer->active ? 0 : -1, "No frame rule set for %s", port->name);
+	memset(Frame, 0, sizeof(SerialFrame));
+	if (framer->frameLen)
+	{
+		SerialMemoryBarrier();
+		rx->tail += framer->frameLen;
+		framer->frameLen = 0;
+	}
+	
+	while (1)
+	{
+		if (FirstByte && !*FirstByte && rx->head != rx->tail)
+			*FirstByte = Timer();
+		if ((frameLen = framerScan(port, FailOnCrc)) > 0)
+			break;
+		libErrChk(frameLen < 0 ? ERR_SERIAL_CRC : 0, "Frame from %s failed the CRC check", port->name);
+		
+		double now = Timer();
+		double remaining = Deadline - now;
+		libErrChk(remaining <= 0 || (!rx->running && !rx->pumped) ? ERR_SERIAL_TIMEOUT : 0, "Timed out waiting for a frame from %s, %u bytes received",
+				  port->name, rx->head - rx->tail);
+		
+		// A Modbus length read from noise can ask for bytes that never come,
+		// drop a byte once the line has been quiet for a frame gap
+		if (framer->rule.type == SERIAL_FRAME_MODBUS_RTU && rx->head != rx->tail)
+		{
+			if (rx->head != framer->idleHead)
+			{
+				framer->idleHead = rx->head;
+				framer->idleSince = now;
+			}
+			else if (now - framer->idleSince >= SERIALFRAMEGAP)
+			{
+				framer->dropped++;
+				SerialMemoryBarrier();
+				rx->tail++;
+				continue;
+			}
+			if (remaining > SERIALFRAMEGAP)
+				remaining = SERIALFRAMEGAP;
+		}
+		if (rx->pumped)
+		{
+			int count = rxFill(rx, remaining);
+			libErrChk(count < 0 ? count : 0, "Unable to read from %s: %s", port->name, transportErrorText(&port->transport, count));
+		}
+		else
+			serialSignalWait(&rx->dataReady, remaining);
+	}
+	
+	unsigned int start = rx->tail & (rx->size-1);
+	int first = (unsigned int) frameLen > rx->size - start ? (int) (rx->size - start) : frameLen;
+	Frame->part[0].data = rx->buffer + start;
+	Frame->part[0].len = first;
+	Frame->part[1].data = rx->buffer;
+	Frame->part[1].len = frameLen - first;
+	Frame->len = frameLen;
+	switch (framer->rule.type)
+	{
+		case SERIAL_FRAME_TERMINATOR:	Frame->dataLen = frameLen - framer->rule.terminatorLen;	break;
+		case SERIAL_FRAME_MODBUS_RTU:	Frame->dataLen = frameLen - 2;							break;
+		default:						Frame->dataLen = frameLen;								break;
+	}
+	framer->frameLen = (unsigned int) frameLen;
+	latencyReply(index, frameLen);
+	
+Error:
+	if(error)
+		return error;
+	else
+		return frameLen;
+}
+
+/***************************************************************************//*!
+* \brief Look for a complete frame at the tail of the receive ring, dropping
+* 		 bytes that can not start one. Call with the port locked.
+*
+* \param [in] failOnCrc 			Drop a whole Modbus frame with a bad CRC and
+* 									return -1, instead of dropping one byte and
+* 									searching on
+*
+* \return Length of the frame at tail, 0 if it is not complete yet or -1
+*******************************************************************************/
+static int framerScan(SerialPort *port, int failOnCrc)
+{
+	SerialRxEngine *rx = &port->rx;
+	SerialFramer *framer = &port->framer;
+	SerialFrameRule *rule = &framer->rule;
+	unsigned int mask = rx->size-1;
+	
+	while (1)
+	{
+		unsigned int head = rx->head;
+		unsigned int tail = rx->tail;
+		unsigned int available = head - tail;
+		SerialMemoryBarrier();
+		
+		switch (rule->type)
+		{
+			case SERIAL_FRAME_FIXED:
+				return available >= (unsigned int) rule->length ? rule->length : 0;
+				
+			case SERIAL_FRAME_TERMINATOR:
+			{
+				if ((int) (framer->scanned - tail) < 0)
+					framer->scanned = tail;
+				while (head - framer->scanned >= (unsigned int) rule->terminatorLen)
+				{
+					int i = 0;
+					while (i < rule->terminatorLen && rx->buffer[(framer->scanned+i) & mask] == (unsigned char) rule->terminator[i])
+						i++;
+					if (i < rule->terminatorLen)
+					{
+						framer->scanned++;
+						continue;
+					}
+					
+					unsigned int frameLen = framer->scanned + rule->terminatorLen - tail;
+					framer->scanned += rule->terminatorLen;
+					if (frameLen <= (unsigned int) rule->maxLength)
+						return (int) frameLen;
+					
+					// Too long to be a frame, drop it and look on from the byte after it
+					framer->dropped += frameLen;
+					SerialMemoryBarrier();
+					rx->tail = tail = framer->scanned;
+				}
+				if (head - tail >= (unsigned int) rule->maxLength)
+				{
+					// No terminator within the longest frame, keep only what could start one
+					unsigned int keep = (unsigned int) rule->terminatorLen - 1;
+					framer->dropped += head - tail - keep;
+					SerialMemoryBarrier();
+					rx->tail = head - keep;
+				}
+				return 0;
+			}
+				
+			case SERIAL_FRAME_MODBUS_RTU:
+			{
+				unsigned char header[3] = {0};
+				int headerLen = available < 3 ? (int) available : 3;
+				for (int i=0; i<headerLen; i++)
+					header[i] = rx->buffer[(tail+i) & mask];
+				
+				int frameLen = modbusFrameLength(header, headerLen);
+				if (frameLen == 0 || (frameLen > 0 && available < (unsigned int) frameLen))
+					return 0;
+				if (frameLen > 0)
+				{
+					// CRC over the frame, in up to two pieces of the ring
+					unsigned int start = tail & mask;
+					int first = (unsigned int) (frameLen-2) > rx->size - start ? (int) (rx->size - start) : frameLen-2;
+					uint16_t crcValue = SerialCrc16Update(SERIALCRC16INIT, rx->buffer + start, first);
+					crcValue = SerialCrc16Update(crcValue, rx->buffer, frameLen-2 - first);
+					if (rx->buffer[(tail+frameLen-2) & mask] == (crcValue & 0xFF) && rx->buffer[(tail+frameLen-1) & mask] == (crcValue >> 8))
+						return frameLen;
+					framer->crcErrors++;
+					if (failOnCrc)
+					{
+						framer->dropped += (unsigned int) frameLen;
+						SerialMemoryBarrier();
+						rx->tail = tail + (unsigned int) frameLen;
+						return -1;
+					}
+				}
+				
+				// Not the start of a frame, try from the next byte
+				framer->dropped++;
+				SerialMemoryBarrier();
+				rx->tail = tail + 1;
+				break;
+			}
+				
+			default:
+				return 0;
+		}
+	}
+}
+
+/***************************************************************************//*!
+* \brief Forget the held frame and the search position of a port. Call with
+* 		 the port locked whenever its ring is allocated or freed, the rule
+* 		 stays set and is fitted to the new ring.
+*******************************************************************************/
+static void framerReset(SerialPort *port)
+{
+	SerialRxEngine *rx = &port->rx;
+	SerialFramer *framer = &port->framer;
+	
+	framer->frameLen = 0;
+	framer->scanned = rx->tail;
+	framer->idleHead = rx->head;
+	framer->idleSince = Timer();
+	if (!rx->buffer)
+		return;
+	if (framer->rule.maxLength <= 0 || (unsigned int) framer->rule.maxLength > rx->size)
+		framer->rule.maxLength = (int) rx->size;
+	if (framer->rule.type == SERIAL_FRAME_FIXED && (unsigned int) framer->rule.length > rx->size)
+		framer->active = 0;
+}
+
+/***************************************************************************//*!
+* \brief Length of a Modbus RTU frame from its first bytes
+*
+* \return Length with CRC, 0 if more bytes are needed, -1 for an unknown
+* 		  function code
+*******************************************************************************/
+static int modbusFrameLength(const unsigned char *header, int len)
+{
+	if (len < 2)
+		return 0;
+	if (header[1] & 0x80)
+		return 5;						// Address, function, exception code, CRC
+	switch (header[1])
+	{
+		case 0x01:
+		case 0x02:
+		case 0x03:
+		case 0x04:
+			return len < 3 ? 0 : 5 + header[2];		// Address, function, byte count, data, CRC
+		case 0x05:
+		case 0x06:
+		case 0x08:
+		case 0x0F:
+		case 0x10:
+			return 8;
+	}
+	return -1;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START CRC16MODBUS
+//! \endcond
+/*
+	The lookup tables are generated by the preprocessor, nothing is computed at
+	run time. The CRC is linear, so the entry of any byte is the XOR of the
+	entries of its set bits and each table only needs 8 basis values.
+	Table t holds the CRC of a byte followed by t zero bytes.
+*/
+#define CRC16BIT(c)		(((c) >> 1) ^ (((c) & 1) ? 0xA001 : 0))
+#define CRC16BYTE(c)	CRC16BIT(CRC16BIT(CRC16BIT(CRC16BIT(CRC16BIT(CRC16BIT(CRC16BIT(CRC16BIT(c))))))))
+#define CRC16ENTRY(i,t)	((((i) & 0x01) ? CRC16B##t##_0 : 0) ^ (((i) & 0x02) ? CRC16B##t##_1 : 0) ^\
+						 (((i) & 0x04) ? CRC16B##t##_2 : 0) ^ (((i) & 0x08) ? CRC16B##t##_3 : 0) ^\
+						 (((i) & 0x10) ? CRC16B##t##_4 : 0) ^ (((i) & 0x20) ? CRC16B##t##_5 : 0) ^\
+						 (((i) & 0x40) ? CRC16B##t##_6 : 0) ^ (((i) & 0x80) ? CRC16B##t##_7 : 0))
+// One more zero byte after basis value b of table p
+#define CRC16SHIFT(p,b)	((CRC16B##p##_##b >> 8) ^ CRC16ENTRY(CRC16B##p##_##b & 0xFF, 0))
+#define CRC16BASIS(t,p)	CRC16B##t##_0 = CRC16SHIFT(p,0), CRC16B##t##_1 = CRC16SHIFT(p,1),\
+						CRC16B##t##_2 = CRC16SHIFT(p,2), CRC16B##t##_3 = CRC16SHIFT(p,3),\
+						CRC16B##t##_4 = CRC16SHIFT(p,4), CRC16B##t##_5 = CRC16SHIFT(p,5),\
+						CRC16B##t##_6 = CRC16SHIFT(p,6), CRC16B##t##_7 = CRC16SHIFT(p,7)
+#define CRC16ROW(r,t)	CRC16ENTRY(r+0x0,t), CRC16ENTRY(r+0x1,t), CRC16ENTRY(r+0x2,t), CRC16ENTRY(r+0x3,t),\
+						CRC16ENTRY(r+0x4,t), CRC16ENTRY(r+0x5,t), CRC16ENTRY(r+0x6,t), CRC16ENTRY(r+0x7,t),\
+						CRC16ENTRY(r+0x8,t), CRC16ENTRY(r+0x9,t), CRC16ENTRY(r+0xA,t), CRC16ENTRY(r+0xB,t),\
+						CRC16ENTRY(r+0xC,t), CRC16ENTRY(r+0xD,t), CRC16ENTRY(r+0xE,t), CRC16ENTRY(r+0xF,t)
+#define CRC16TABLE(t)	{CRC16ROW(0x00,t), CRC16ROW(0x10,t), CRC16ROW(0x20,t), CRC16ROW(0x30,t),\
+						 CRC16ROW(0x40,t), CRC16ROW(0x50,t), CRC16ROW(0x60,t), CRC16ROW(0x70,t),\
+						 CRC16ROW(0x80,t), CRC16ROW(0x90,t), CRC16ROW(0xA0,t), CRC16ROW(0xB0,t),\
+						 CRC16ROW(0xC0,t), CRC16ROW(0xD0,t), CRC16ROW(0xE0,t), CRC16ROW(0xF0,t)}
+
+enum
+{
+	CRC16B0_0 = CRC16BYTE(0x01), CRC16B0_1 = CRC16BYTE(0x02), CRC16B0_2 = CRC16BYTE(0x04), CRC16B0_3 = CRC16BYTE(0x08),
+	CRC16B0_4 = CRC16BYTE(0x10), CRC16B0_5 = CRC16BYTE(0x20), CRC16B0_6 = CRC16BYTE(0x40), CRC16B0_7 = CRC16BYTE(0x80)
+};
+enum {CRC16BASIS(1,0)};
+enum {CRC16BASIS(2,1)};
+enum {CRC16BASIS(3,2)};
+enum {CRC16BASIS(4,3)};
+enum {CRC16BASIS(5,4)};
+enum {CRC16BASIS(6,5)};
+enum {CRC16BASIS(7,6)};
+
+static const uint16_t crc16Tables[CRC16SLICES][256] = {
+	CRC16TABLE(0), CRC16TABLE(1), CRC16TABLE(2), CRC16TABLE(3),
+	CRC16TABLE(4), CRC16TABLE(5), CRC16TABLE(6), CRC16TABLE(7)
+};
+
+/***************************************************************************//*!
+* \brief Continues a CRC16MODBUS over more data
+* 
+* Start with SERIALCRC16INIT and feed the message in pieces of any size, for
+* example as the bytes come in. The result is sent lower byte first. Eight
+* bytes at a time go through the slice-by-8 tables, which matters for long
+* frames such as the SMC data blocks. The framer, the capture decoder, the
+* scanner and SMC_Actuators all use this one implementation.
+* 
+* \param [in] Crc 					CRC of the data so far
+* \param [in] Data 				Next bytes of the message
+* \param [in] Len 					Number of bytes
+*******************************************************************************/
+uint16_t SerialCrc16Update(uint16_t Crc, const uint8_t *Data, int Len)
+{
+	return Len<CRC16SLICES ? crc16ModbusTable(Crc, Data, Len) : crc16ModbusSlice(Crc, Data, Len);
+}
+
+/***************************************************************************//*!
+* \brief Times the CRC16MODBUS variants over a pseudo random frame
+* 
+* Each variant is run Iterations times over the same frame and must give the
+* same CRC. The bit by bit variant is only kept as the reference here.
+* 
+* \param [in]  FrameLen 			Bytes per frame, 1-65536
+* \param [in]  Iterations 			Frames per variant
+* \param [out] NsPerFrame 			Bit by bit (the CRC_LIB algorithm), byte table
+* 									and slice-by-8, in nanoseconds per frame
+*******************************************************************************/
+int SerialCrc16Benchmark(int FrameLen, int Iterations, double NsPerFrame[3], char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	static uint16_t (*const variants[3])(uint16_t, const uint8_t*, int) = {crc16ModbusBitwise, crc16ModbusTable, crc16ModbusSlice};
+	uint8_t *frame = 0;
+	uint16_t crc[3] = {0};
+	
+	libErrChk(FrameLen < 1 || FrameLen > 65536 || Iterations < 1 ? -1 : 0, "Frame length must be 1-65536 and iterations positive, got %d and %d", FrameLen, Iterations);
+	frame = malloc((size_t) FrameLen);
+	libErrChk(frame ? 0 : -1, "Unable to allocate a %d byte frame", FrameLen);
+	
+	uint32_t seed = 0x12345678;
+	for (int i=0; i<FrameLen; ++i)
+	{
+		seed = seed*1664525 + 1013904223;
+		frame[i] = (uint8_t) (seed >> 24);
+	}
+	uint8_t first = frame[0];
+	
+	for (int v=0; v<3; ++v)
+	{
+		// Each frame starts with the last CRC so no iteration can be dropped
+		// by the compiler
+		double start = Timer();
+		frame[0] = first;
+		for (int i=0; i<Iterations; ++i)
+		{
+			crc[v] = variants[v](SERIALCRC16INIT, frame, FrameLen);
+			frame[0] = (uint8_t) crc[v];
+		}
+		NsPerFrame[v] = (Timer()-start)*1e9/Iterations;
+	}
+	libErrChk(crc[1] != crc[0] || crc[2] != crc[0] ? -1 : 0, "CRC variants disagree: %04X %04X %04X", crc[0], crc[1], crc[2]);
+	
+	error = 0;
+	
+Error:
+	free(frame);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Shifts one bit at a time, the way CRC_LIB computed CRC16MODBUS
+*******************************************************************************/
+static uint16_t crc16ModbusBitwise(uint16_t crc, const uint8_t *data, int len)
+{
+	for (int i=0; i<len; ++i)
+	{
+		crc ^= data[i];
+		for (int bit=0; bit<8; ++bit)
+			crc = (uint16_t) CRC16BIT(crc);
+	}
+	return crc;
+}
+
+/***************************************************************************//*!
+* \brief One table lookup per byte
+*******************************************************************************/
+static uint16_t crc16ModbusTable(uint16_t crc, const uint8_t *data, int len)
+{
+	for (int i=0; i<len; ++i)
+		crc = (uint16_t) ((crc >> 8) ^ crc16Tables[0][(crc ^ data[i]) & 0xFF]);
+	return crc;
+}
+
+/***************************************************************************//*!
+* \brief Eight bytes per step, one lookup per byte in independent tables
+*******************************************************************************/
+static uint16_t crc16ModbusSlice(uint16_t crc, const uint8_t *data, int len)
+{
+	for (; len>=CRC16SLICES; len-=CRC16SLICES, data+=CRC16SLICES)
+	{
+		// The first two bytes fold into the CRC, the rest only need their table
+		crc ^= (uint16_t) (data[0] | (data[1] << 8));
+		crc = (uint16_t) (crc16Tables[7][crc & 0xFF] ^ crc16Tables[6][crc >> 8] ^
+						  crc16Tables[5][data[2]] ^ crc16Tables[4][data[3]] ^
+						  crc16Tables[3][data[4]] ^ crc16Tables[2][data[5]] ^
+						  crc16Tables[1][data[6]] ^ crc16Tables[0][data[7]]);
+	}
+	return crc16ModbusTable(crc, data, len);
+}
+//! \cond
+/// REGION END
+
+/// REGION START Command Templates
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Compile a command template into a byte program
+*
+* Literal text is decoded once: \\r, \\n, \\t, \\\\, \\{, \\} and \\xNN or
+* \\0xNN for any byte. Other backslashes are sent as they are. Parameter
+* slots take their value from the arguments of RenderSerialTemplate or
+* WriteSerialTemplate, in order:
+* - {d} int, {dN} with at least N digits
+* - {f} double with 6 decimals, {fN} with N decimals
+* - {x} unsigned int in upper case hex, {xN} with at least N digits
+* - {s} null terminated string
+* - {c} int sent as one byte
+*
+* For example "SOUR:VOLT {f2}\\r" rendered with 12.5 sends "SOUR:VOLT 12.50\r".
+* Compile a template once and keep it, rendering does no parsing.
+*
+* \param [in]  Template 			Template text
+* \param [out] Compiled 			Compiled template, free with FreeSerialTemplate
+*******************************************************************************/
+int CompileSerialTemplate(const char *Template, SerialTemplate **Compiled, char errmsg[ERRLEN])
+{
+	SerialTemplate *compiled = 0;
+	fnInit;
+	
+	*Compiled = 0;
+	libErrChk(Template ? 0 : -1, "No template given");
+	
+	// Every character is at most one op and one literal byte
+	size_t len = strlen(Template);
+	compiled = malloc(sizeof(SerialTemplate) + (len+1) * sizeof(SerialTemplateOp) + len + 1);
+	libErrChk(compiled ? 0 : -1, "Unable to allocate command template");
+	memset(compiled, 0, sizeof(SerialTemplate));
+	compiled->ops = (SerialTemplateOp *) (compiled + 1);
+	compiled->literals = (unsigned char *) (compiled->ops + len + 1);
+	
+	SerialTemplateOp *literal = 0;
+	for (const char *c = Template; *c; )
+	{
+		int byte = -1;
+		
+		if (*c == '{')
+		{
+			SerialTemplateOp *op = &compiled->ops[compiled->numOps];
+			const char *type = c + 1;
+			char *end = 0;
+			
+			switch (*type)
+			{
+				case 'd':	op->type = SERIAL_TEMPLATE_INT;		break;
+				case 'f':	op->type = SERIAL_TEMPLATE_DOUBLE;	break;
+				case 'x':	op->type = SERIAL_TEMPLATE_HEX;		break;
+				case 's':	op->type = SERIAL_TEMPLATE_STRING;	break;
+				case 'c':	op->type = SERIAL_TEMPLATE_BYTE;	break;
+				default:
+					libErrChk(-1, "Unknown parameter slot at position %d of template: %s", (int) (c - Template), Template);
+			}
+			long digits = strtol(type + 1, &end, 10);
+			if (end == type + 1)
+				digits = op->type == SERIAL_TEMPLATE_DOUBLE ? 6 : 0;
+			libErrChk(*end != '}' ? -1 : 0, "Unterminated parameter slot at position %d of template: %s", (int) (c - Template), Template);
+			libErrChk(digits < 0 || digits > 32 || (digits && (op->type == SERIAL_TEMPLATE_STRING || op->type == SERIAL_TEMPLATE_BYTE)) ? -1 : 0,
+					  "Invalid width in parameter slot at position %d of template: %s", (int) (c - Template), Template);
+			
+			op->digits = (unsigned char) digits;
+			compiled->numOps++;
+			compiled->numSlots++;
+			literal = 0;
+			c = end + 1;
+			continue;
+		}
+		
+		if (*c == '\\')
+		{
+			switch (c[1])
+			{
+				case 'r':	byte = '\r';	c += 2;		break;
+				case 'n':	byte = '\n';	c += 2;		break;
+				case 't':	byte = '\t';	c += 2;		break;
+				case '\\':
+				case '{':
+				case '}':	byte = c[1];	c += 2;		break;
+				case '0':
+				case 'x':
+				{
+					// \xNN, and \0xNN as the debug panel always accepted
+					const char *hex = c[1] == '0' ? c + 3 : c + 2;
+					if ((c[1] == 'x' || c[2] == 'x') && isxdigit((unsigned char) hex[0]) && isxdigit((unsigned char) hex[1]))
+					{
+						char digits[3] = {hex[0], hex[1], 0};
+						byte = (int) strtol(digits, 0, 16);
+						c = hex + 2;
+					}
+					break;
+				}
+			}
+		}
+		if (byte < 0)
+			byte = (unsigned char) *c++;
+		
+		// Consecutive literal bytes are one op
+		if (!literal || literal->len == USHRT_MAX)
+		{
+			literal = &compiled->ops[compiled->numOps++];
+			literal->type = SERIAL_TEMPLATE_LITERAL;
+			literal->offset = (unsigned int) compiled->literalLen;
+		}
+		compiled->literals[compiled->literalLen++] = (unsigned char) byte;
+		literal->len++;
+	}
+	
+	*Compiled = compiled;
+	compiled = 0;
+	
+Error:
+	free(compiled);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Free a template from CompileSerialTemplate, 0 is ignored
+*******************************************************************************/
+void FreeSerialTemplate(SerialTemplate *Template)
+{
+	free(Template);
+}
+
+/***************************************************************************//*!
+* \brief Number of parameter slots, the arguments a render call takes
+*******************************************************************************/
+int GetSerialTemplateSlots(const SerialTemplate *Template)
+{
+	return Template ? Template->numSlots : 0;
+}
+
+/***************************************************************************//*!
+* \brief Render a command template into a buffer
+*
+* One argument follows for every parameter slot, of the slot's type. The
+* result is not null terminated, it can contain 0 bytes.
+*
+* \param [in]  Template 			Compiled template
+* \param [out] Buffer 				Rendered command
+* \param [in]  BufferLen 			Size of Buffer
+*
+* \return Length of the command or negative error code
+*******************************************************************************/
+int RenderSerialTemplate(const SerialTemplate *Template, char *Buffer, int BufferLen, char errmsg[ERRLEN], ...)
+{
+	int len = 0;
+	va_list args;
+	fnInit;
+	
+	libErrChk(Template ? 0 : -1, "No template given");
+	va_start(args, errmsg);
+	len = renderTemplate(Template, Buffer, BufferLen, args);
+	va_end(args);
+	libErrChk(len < 0 ? -1 : 0, "Rendered command does not fit %d bytes", BufferLen);
+	
+Error:
+	if(error)
+		return error;
+	else
+		return len;
+}
+
+/***************************************************************************//*!
+* \brief Render a command template and write it to a serial device by handle
+*
+* One argument follows for every parameter slot, of the slot's type. The
+* command is rendered straight into the buffer handed to the transport.
+*
+* \param [in] Handle 				Handle of serial device to write to
+* \param [in] Template 			Compiled template
+*
+* \return The number of bytes written or negative error code
+*******************************************************************************/
+int WriteSerialTemplate(int Handle, const SerialTemplate *Template, char errmsg[ERRLEN], ...)
+{
+	char command[SERIALTEMPLATEMAXLEN];
+	int len = 0;
+	va_list args;
+	libInit;
+	
+	handleErrChk(Handle);
+	libErrChk(Template ? 0 : -1, "No template given");
+	va_start(args, errmsg);
+	len = renderTemplate(Template, command, sizeof(command), args);
+	va_end(args);
+	libErrChk(len < 0 ? -1 : 0, "Rendered command for %s is longer than %d bytes", serialPort(Handle-1)->name, SERIALTEMPLATEMAXLEN);
+	error = WriteSerialHandleRaw(Handle, command, len, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Run the ops of a template, -1 if the buffer is too small
+*******************************************************************************/
+static int renderTemplate(const SerialTemplate *Template, char *Buffer, int BufferLen, va_list Args)
+{
+	int len = 0;
+	
+	for (int i=0; i<Template->numOps; i++)
+	{
+		const SerialTemplateOp *op = &Template->ops[i];
+		int written = 0;
+		
+		switch (op->type)
+		{
+			case SERIAL_TEMPLATE_LITERAL:
+				written = op->len <= BufferLen - len ? op->len : -1;
+				if (written > 0)
+					memcpy(Buffer + len, Template->literals + op->offset, op->len);
+				break;
+				
+			case SERIAL_TEMPLATE_INT:
+			{
+				int value = va_arg(Args, int);
+				unsigned int magnitude = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+				written = renderUnsigned(Buffer + len, BufferLen - len, magnitude, 10, op->digits, value < 0);
+				break;
+			}
+				
+			case SERIAL_TEMPLATE_HEX:
+				written = renderUnsigned(Buffer + len, BufferLen - len, va_arg(Args, unsigned int), 16, op->digits, 0);
+				break;
+				
+			case SERIAL_TEMPLATE_DOUBLE:
+			{
+				// snprintf writes the terminator too, so it needs one byte more than the number
+				double value = va_arg(Args, double);
+				written = snprintf(Buffer + len, (size_t) (BufferLen - len), "%.*f", op->digits, value);
+				if (written >= BufferLen - len)
+					written = -1;
+				break;
+			}
+				
+			case SERIAL_TEMPLATE_STRING:
+			{
+				const char *value = va_arg(Args, const char *);
+				size_t valueLen = value ? strlen(value) : 0;
+				written = valueLen <= (size_t) (BufferLen - len) ? (int) valueLen : -1;
+				if (written > 0)
+					memcpy(Buffer + len, value, valueLen);
+				break;
+			}
+				
+			case SERIAL_TEMPLATE_BYTE:
+			{
+				int value = va_arg(Args, int);
+				written = len < BufferLen ? 1 : -1;
+				if (written > 0)
+					Buffer[len] = (char) value;
+				break;
+			}
+		}
+		if (written < 0)
+			return -1;
+		len += written;
+	}
+	return len;
+}
+
+/***************************************************************************//*!
+* \brief Write an unsigned number with at least Digits digits, -1 if it does
+* 		 not fit
+*******************************************************************************/
+static int renderUnsigned(char *Buffer, int BufferLen, unsigned int Value, unsigned int Base, int Digits, int Negative)
+{
+	static const char digitChars[] = "0123456789ABCDEF";
+	char reversed[32];
+	int count = 0;
+	
+	do
+	{
+		reversed[count++] = digitChars[Value % Base];
+		Value /= Base;
+	} while (Value);
+	while (count < Digits)
+		reversed[count++] = '0';
+	
+	if (count + Negative > BufferLen)
+		return -1;
+	if (Negative)
+		*Buffer++ = '-';
+	for (int i=0; i<count; i++)
+		Buffer[i] = reversed[count-1-i];
+	return count + Negative;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Broadcast
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Send one request to several devices at once and gather their replies
+*
+* Every device gets its own thread from the receive engine pool that runs
+* SerialTransact with the deadline of that device. The call returns when all of them are done, so it
+* takes as long as the slowest device instead of the sum of all of them.
+* A device that fails does not stop the others, its error is in its result.
+*
+* The reply is the frame without terminator or CRC, null terminated when it
+* fits.
+*
+* \param [in]  Handles 				Handles of the devices
+* \param [in]  NumHandles 			Number of handles
+* \param [in]  Request 				Request sent to every device
+* \param [in]  RequestLen 			Length of request
+* \param [in]  Rule 				Framing of the replies, 0 to only write
+* \param [in]  Timeout 				Time each device has to reply, from the
+* 									start of the call. 0 uses the timeout of each
+* 									device (see SetSerialAdaptiveTimeout).
+* \param [out] Results 				One result per handle, in the order of Handles
+*
+* \return Number of devices that replied (or were written without a rule), or
+* 		  negative error code
+*******************************************************************************/
+int BroadcastSerialRequest(const int *Handles, int NumHandles, const char *Request, int RequestLen, const SerialFrameRule *Rule,
+						   double Timeout, SerialBroadcastResult *Results, char errmsg[ERRLEN])
+{
+	SerialBroadcastJob *jobs = 0;
+	int succeeded = 0;
+	libInit;
+	
+	libErrChk(NumHandles < 1 || !Handles || !Results || !Request || RequestLen < 0 ? -1 : 0, "Invalid broadcast arguments");
+	jobs = calloc((size_t) NumHandles, sizeof(SerialBroadcastJob));
+	libErrChk(jobs ? 0 : -1, "Out of memory");
+	
+	double start = Timer();
+	for (int i=0; i<NumHandles; i++)
+	{
+		memset(&Results[i], 0, sizeof(SerialBroadcastResult));
+		Results[i].handle = Handles[i];
+		jobs[i].request = Request;
+		jobs[i].requestLen = RequestLen;
+		jobs[i].rule = Rule;
+		jobs[i].timeout = Timeout;
+		jobs[i].start = start;
+		jobs[i].result = &Results[i];
+		if (CmtScheduleThreadPoolFunction(glbSerialRxThreadPool, SerialBroadcastThread, &jobs[i], &jobs[i].threadID) < 0)
+		{
+			// No thread, serve this device on the calling thread
+			jobs[i].threadID = 0;
+			SerialBroadcastThread(&jobs[i]);
+		}
+	}
+	for (int i=0; i<NumHandles; i++)
+	{
+		if (jobs[i].threadID)
+		{
+			CmtWaitForThreadPoolFunctionCompletion(glbSerialRxThreadPool, jobs[i].threadID, 0);
+			CmtReleaseThreadPoolFunctionID(glbSerialRxThreadPool, jobs[i].threadID);
+		}
+		if (Results[i].status >= 0)
+			succeeded++;
+	}
+	
+Error:
+	free(jobs);
+	if (error)
+		return error;
+	else
+		return succeeded;
+}
+
+/***************************************************************************//*!
+* \brief Write the broadcast request to one device and wait for its reply
+*******************************************************************************/
+static int CVICALLBACK SerialBroadcastThread(void *functionData)
+{
+	SerialBroadcastJob *job = functionData;
+	SerialBroadcastResult *result = job->result;
+	int handle = result->handle;
+	char errmsg[ERRLEN] = {0};
+	int status = 0;
+	
+	if (job->rule)
+	{
+		SerialTransactStats stats = {0};
+		double timeout = job->timeout;
+		if (timeout <= 0)
+			timeout = handle >= 1 && handle <= glbNumOfComPorts ? serialTimeout(handle-1) : 0;
+		
+		status = SerialTransact(handle, job->request, job->requestLen, job->rule, job->start + timeout,
+								result->reply, (int) sizeof(result->reply), &stats, errmsg);
+		result->elapsed = stats.lastByte;
+		result->replyLen = status > 0 ? status : 0;
+	}
+	else
+		status = WriteSerialHandleRaw(handle, (char *) job->request, job->requestLen, errmsg);
+	
+	if (status < 0)
+		snprintf(result->errmsg, sizeof(result->errmsg), "%s", errmsg);
+	result->status = status;
+	return 0;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Transactions
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Write a request and read its reply as one exchange
+*
+* The device lock is held from before the write until the reply is complete,
+* so no other thread can use the device in between. The time spent in every
+* phase goes to Stats and to the totals of the device, see
+* GetSerialTransactSummary and DumpSerialTransactStats.
+*
+* Rule is used for this reply only, the rule set with SetSerialFrameRule is
+* restored afterwards. With Rule 0 the rule set on the device is used. A
+* Modbus reply with a bad CRC returns ERR_SERIAL_CRC as soon as it is
+* complete, without waiting for the deadline.
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [in]  Request 				Request to write
+* \param [in]  RequestLen 			Length of request
+* \param [in]  Rule 				Framing of the reply, 0 for the rule of the device
+* \param [in]  Deadline 			Absolute deadline for the reply in Timer() seconds
+* \param [out] Reply 				Reply without terminator or CRC, null
+* 									terminated when it fits
+* \param [in]  ReplyLen 			Size of Reply
+* \param [out] Stats 				Timing of this exchange, can be 0
+*
+* \return Length of the reply copied to Reply or negative error code
+*******************************************************************************/
+int SerialTransact(int Handle, const char *Request, int RequestLen, const SerialFrameRule *Rule, double Deadline,
+				   char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN])
+{
+	SerialIOVec segment = {Request, RequestLen};
+	
+	return SerialTransactV(Handle, &segment, 1, Rule, Deadline, Reply, ReplyLen, Stats, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief SerialTransact with the request given as buffers, see
+* 		 WriteSerialHandleV
+*
+* \param [in]  Segments 			Buffers of the request, in order
+* \param [in]  NumSegments 			Number of segments (1-MAXSERIALIOVEC)
+*
+* \return Length of the reply copied to Reply or negative error code
+*******************************************************************************/
+int SerialTransactV(int Handle, const SerialIOVec *Segments, int NumSegments, const SerialFrameRule *Rule, double Deadline,
+					char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN])
+{
+	return serialTransact(Handle, Segments, NumSegments, Rule, Deadline, 0, Reply, ReplyLen, Stats, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief SerialTransact with a timeout instead of a deadline. The timeout
+* 		 starts once the device lock is held, so time spent waiting behind
+* 		 other threads does not count against the reply.
+*
+* \param [in]  Timeout 			Time for the write and the reply in seconds
+*
+* \return Length of the reply copied to Reply or negative error code
+*******************************************************************************/
+int SerialTransactTimeout(int Handle, const char *Request, int RequestLen, const SerialFrameRule *Rule, double Timeout,
+						  char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN])
+{
+	SerialIOVec segment = {Request, RequestLen};
+	
+	return serialTransact(Handle, &segment, 1, Rule, 0, Timeout > 0 ? Timeout : 0.001, Reply, ReplyLen, Stats, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Body of the SerialTransact calls. Timeout, if positive, replaces
+* 		 Deadline and counts from when the device lock is held.
+*
+* A device without receive engine gets a pumped ring for the exchange (see
+* rxPumpStart) that is released again at the end, the engine is not started.
+*******************************************************************************/
+static int serialTransact(int Handle, const SerialIOVec *Segments, int NumSegments, const SerialFrameRule *Rule, double Deadline,
+						  double Timeout, char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN])
+{
+	SerialTransactStats stats = {0};
+	SerialPortLock *lock = 0;
+	SerialPort *port = 0;
+	SerialFramer previous = {0};
+	int ruleReplaced = 0;
+	int replyLen = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	port = serialPort(Handle-1);
+	
+	double start = Timer();
+	lock = serialLockAcquire(&port->lock);
+	double locked = Timer();
+	stats.queueWait = locked - start;
+	if (Timeout > 0)
+		Deadline = locked + Timeout;
+	
+	if (Rule)
+	{
+		// The framer reads from a ring, this thread fills it if no engine does
+		if (!port->rx.running)
+		{
+			libErrChk(port->desc.portOpen!=1 ? -1 : 0, "Please Initalize device %s before trying to write", port->name);
+			libErrChk(rxPumpStart(&port->rx, Handle-1), "Unable to allocate the receive buffer of %s", port->name);
+		}
+		previous = port->framer;
+		ruleReplaced = 1;
+		libErrChk(SetSerialFrameRule(Handle, Rule, errmsg), "%s", errmsg);
+	}
+	else
+		libErrChk(port->framer.active ? 0 : -1, "No frame rule given or set for %s", port->name);
+	
+	int written = WriteSerialHandleV(Handle, Segments, NumSegments, errmsg);
+	libErrChk(written < 0 ? written : 0, "%s", errmsg);
+	double writeDone = Timer();
+	stats.write = writeDone - locked;
+	stats.bytesWritten = written;
+	
+	SerialFrame frame;
+	double firstByte = 0;
+	// A reply with a bad CRC fails as soon as it is in, the caller can ask again
+	int frameLen = framerNext(Handle-1, &frame, Deadline, &firstByte, 1, errmsg);
+	libErrChk(frameLen < 0 ? frameLen : 0, "%s", errmsg);
+	stats.lastByte = Timer() - writeDone;
+	stats.firstByte = firstByte - writeDone;
+	stats.bytesRead = frame.len;
+	
+	// Only the data part, the terminator or CRC has been checked already
+	if (frame.part[0].len > frame.dataLen)
+		frame.part[0].len = frame.dataLen;
+	frame.part[1].len = frame.dataLen - frame.part[0].len;
+	replyLen = CopySerialFrame(&frame, Reply, ReplyLen);
+	if (replyLen < ReplyLen)
+		Reply[replyLen] = 0;
+	
+Error:
+	if (port)
+	{
+		if (ruleReplaced)
+			restoreFrameRule(Handle, &previous);
+		else if (lock)
+		{
+			char releaseErr[ERRLEN] = {0};
+			ReleaseSerialFrame(Handle, releaseErr);
+		}
+		if (port->rx.pumped)
+			stopRxEngine(&port->rx);
+		if (lock)
+			transactRecord(&port->transact, &stats, error);
+	}
+	serialLockRelease(lock);
+	if (Stats)
+		*Stats = stats;
+	if(error)
+		return error;
+	else
+		return replyLen;
+}
+
+/***************************************************************************//*!
+* \brief Get the totals of the SerialTransact calls of a device
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [out] Summary 				Mean and max of every phase
+*******************************************************************************/
+int GetSerialTransactSummary(int Handle, SerialTransactSummary *Summary, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialTransactTotals *totals = &serialPort(Handle-1)->transact;
+	
+	memset(Summary, 0, sizeof(SerialTransactSummary));
+	Summary->transactions = totals->count;
+	Summary->failed = totals->failed;
+	Summary->timeouts = totals->timeouts;
+	
+	// Failed exchanges have no reply, the means are over the good ones
+	int good = totals->count - totals->failed;
+	if (good > 0)
+	{
+		Summary->mean.queueWait = totals->sum[0] / good;
+		Summary->mean.write = totals->sum[1] / good;
+		Summary->mean.firstByte = totals->sum[2] / good;
+		Summary->mean.lastByte = totals->sum[3] / good;
+		Summary->mean.bytesWritten = (int) (totals->bytesWritten / good);
+		Summary->mean.bytesRead = (int) (totals->bytesRead / good);
+	}
+	Summary->max.queueWait = totals->max[0];
+	Summary->max.write = totals->max[1];
+	Summary->max.firstByte = totals->max[2];
+	Summary->max.lastByte = totals->max[3];
+	Summary->max.bytesWritten = totals->maxWritten;
+	Summary->max.bytesRead = totals->maxRead;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Clear the SerialTransact totals of a device, 0 for all devices
+*
+* \param [in] Handle 				Handle of serial device or 0
+*******************************************************************************/
+int ResetSerialTransactStats(int Handle, char errmsg[ERRLEN])
+{
+	libInit;
+	
+	if (Handle)
+		handleErrChk(Handle);
+	for (int i = Handle ? Handle-1 : 0; i < (Handle ? Handle : glbNumOfComPorts); i++)
+	{
+		SerialPortLock *lock = serialLockAcquire(&serialPort(i)->lock);
+		memset(&serialPort(i)->transact, 0, sizeof(SerialTransactTotals));
+		serialLockRelease(lock);
+	}
+	error = 0;
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Write the SerialTransact totals of every device that had one as a
+* 		 table, times in milliseconds
+*
+* \param [in] FilePath 				Output file, 0 or empty for stdout
+*******************************************************************************/
+int DumpSerialTransactStats(char *FilePath, char errmsg[ERRLEN])
+{
+	FILE *file = 0;
+	libInit;
+	
+	file = FilePath && FilePath[0] ? fopen(FilePath, "w") : stdout;
+	libErrChk(file ? 0 : -1, "Unable to open %s", FilePath);
+	
+	fprintf(file, "%-24s %8s %6s %6s %9s %9s %9s %9s %9s %9s %9s %9s %8s %8s\n", "Device", "Count", "Fail", "T/O",
+			"Queue", "QueueMax", "Write", "WriteMax", "First", "FirstMax", "Last", "LastMax", "TxBytes", "RxBytes");
+	for (int i=0; i<glbNumOfComPorts; i++)
+	{
+		SerialTransactSummary summary;
+		if (!serialPort(i)->name[0] || GetSerialTransactSummary(i+1, &summary, errmsg) < 0 || !summary.transactions)
+			continue;
+		fprintf(file, "%-24s %8d %6d %6d %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %8d %8d\n", serialPort(i)->name,
+				summary.transactions, summary.failed, summary.timeouts,
+				summary.mean.queueWait * 1000, summary.max.queueWait * 1000, summary.mean.write * 1000, summary.max.write * 1000,
+				summary.mean.firstByte * 1000, summary.max.firstByte * 1000, summary.mean.lastByte * 1000, summary.max.lastByte * 1000,
+				summary.mean.bytesWritten, summary.mean.bytesRead);
+	}
+	error = 0;
+	
+Error:
+	if (file && file != stdout)
+		fclose(file);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Add one exchange to the totals of a port. Call with the port locked.
+*******************************************************************************/
+static void transactRecord(SerialTransactTotals *Totals, const SerialTransactStats *Stats, int Error)
+{
+	Totals->count++;
+	if (Error)
+	{
+		Totals->failed++;
+		if (Error == ERR_SERIAL_TIMEOUT)
+			Totals->timeouts++;
+		return;
+	}
+	
+	double phases[4] = {Stats->queueWait, Stats->write, Stats->firstByte, Stats->lastByte};
+	for (int i=0; i<4; i++)
+	{
+		Totals->sum[i] += phases[i];
+		if (phases[i] > Totals->max[i])
+			Totals->max[i] = phases[i];
+	}
+	Totals->bytesWritten += Stats->bytesWritten;
+	Totals->bytesRead += Stats->bytesRead;
+	if (Stats->bytesWritten > Totals->maxWritten)
+		Totals->maxWritten = Stats->bytesWritten;
+	if (Stats->bytesRead > Totals->maxRead)
+		Totals->maxRead = Stats->bytesRead;
+}
+
+/***************************************************************************//*!
+* \brief Put back the frame rule a transaction replaced, keeping the drop
+* 		 counts of both. Call with the port locked.
+*******************************************************************************/
+static void restoreFrameRule(int Handle, const SerialFramer *Previous)
+{
+	char errmsg[ERRLEN] = {0};
+	SerialFramer *framer = &serialPort(Handle-1)->framer;
+	unsigned int dropped = framer->dropped + Previous->dropped;
+	unsigned int crcErrors = framer->crcErrors + Previous->crcErrors;
+	
+	SetSerialFrameRule(Handle, Previous->active ? &Previous->rule : 0, errmsg);
+	framer->dropped = dropped;
+	framer->crcErrors = crcErrors;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Adaptive Timeouts
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Derive the I/O timeout of a device from its observed response latency
+*
+* The library measures the time from every write to the first data read after
+* it. In adaptive mode the read timeout of the device becomes the 99th
+* percentile of that latency times SafetyFactor, kept between Floor and
+* Ceiling. Until SERIALLATENCYMINSAMPLES replies have been seen the configured
+* timeout is used. Reads that take an explicit deadline are not changed, use
+* GetSerialTimeout to build one.
+*
+* \param [in] Handle 				Handle of serial device
+* \param [in] Enable 				1 for adaptive, 0 for the configured timeout
+* \param [in] SafetyFactor 			Multiplier of the p99 latency, 0 for SERIALADAPTIVEFACTOR
+* \param [in] Floor 				Shortest timeout in seconds, 0 for SERIALADAPTIVEFLOOR
+* \param [in] Ceiling 				Longest timeout in seconds, 0 for the configured timeout
+*******************************************************************************/
+int SetSerialAdaptiveTimeout(int Handle, int Enable, double SafetyFactor, double Floor, double Ceiling, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialLatency *latency = &serialPort(Handle-1)->latency;
+	
+	latency->safetyFactor = SafetyFactor > 0 ? SafetyFactor : SERIALADAPTIVEFACTOR;
+	latency->floor = Floor > 0 ? Floor : SERIALADAPTIVEFLOOR;
+	latency->ceiling = Ceiling > 0 ? Ceiling : serialPort(Handle-1)->desc.timeout;
+	libErrChk(latency->ceiling < latency->floor ? -1 : 0, "Ceiling %g s is below the floor %g s", latency->ceiling, latency->floor);
+	latency->adaptive = Enable ? 1 : 0;
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Get the timeout a read of the device uses now, the adaptive one if
+* 		 enabled. Drivers add it to Timer() for their deadlines.
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [out] Timeout 			Timeout in seconds
+*******************************************************************************/
+int GetSerialTimeout(int Handle, double *Timeout, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	*Timeout = serialTimeout(Handle-1);
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Get the response latency percentiles of a device
+*
+* \param [in]  Handle 				Handle of serial device
+* \param [out] Stats 				Latencies in seconds
+*******************************************************************************/
+int GetSerialLatencyStats(int Handle, SerialLatencyStats *Stats, char errmsg[ERRLEN])
+{
+	SerialPortLock *lock = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	handleLock(Handle, lock);
+	SerialLatency *latency = &serialPort(Handle-1)->latency;
+	
+	memset(Stats, 0, sizeof(SerialLatencyStats));
+	Stats->samples = (int) latency->count;
+	Stats->timeouts = (int) latency->timeouts;
+	Stats->p50 = latencyPercentile(latency, 0.50);
+	Stats->p90 = latencyPercentile(latency, 0.90);
+	Stats->p99 = latencyPercentile(latency, 0.99);
+	Stats->max = (double) latency->maxNs * 1e-9;
+	Stats->timeout = serialTimeout(Handle-1);
+	
+Error:
+	serialLockRelease(lock);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Timeout of the next read of a port, call with the port locked
+*******************************************************************************/
+static double serialTimeout(int index)
+{
+	SerialLatency *latency = &serialPort(index)->latency;
+	
+	if (!latency->adaptive || latency->count < SERIALLATENCYMINSAMPLES)
+		return serialPort(index)->desc.timeout;
+	
+	double timeout = latencyPercentile(latency, 0.99) * latency->safetyFactor;
+	if (timeout < latency->floor)
+		timeout = latency->floor;
+	if (timeout > latency->ceiling)
+		timeout = latency->ceiling;
+	return timeout;
+}
+
+/***************************************************************************//*!
+* \brief A request went out, the next read with data completes the exchange
+*******************************************************************************/
+static void latencyStart(int index)
+{
+	serialPort(index)->latency.lastWriteNs = serialMonotonicNs();
+}
+
+/***************************************************************************//*!
+* \brief Record the latency of the exchange a read completed, if any
+*******************************************************************************/
+static void latencyReply(int index, int bytesRead)
+{
+	SerialLatency *latency = &serialPort(index)->latency;
+	
+	if (!latency->lastWriteNs)
+		return;
+	if (bytesRead <= 0)
+	{
+		// The reply may still come with the next read, the exchange stays open
+		latency->timeouts++;
+		return;
+	}
+	
+	uint64_t ns = serialMonotonicNs() - latency->lastWriteNs;
+	latency->lastWriteNs = 0;
+	if (ns > latency->maxNs)
+		latency->maxNs = ns;
+	latency->buckets[latencyBucket(ns)]++;
+	
+	if (++latency->count >= SERIALLATENCYWINDOW)
+	{
+		latency->count = 0;
+		for (int i=0; i<SERIALLATENCYBUCKETS; i++)
+		{
+			latency->buckets[i] /= 2;
+			latency->count += latency->buckets[i];
+		}
+	}
+}
+
+/***************************************************************************//*!
+* \brief Bucket of a latency: one per microsecond below 8 us, then 8 per power
+* 		 of 2
+*******************************************************************************/
+static int latencyBucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int octave = 3;
+	
+	if (us < 8)
+		return (int) us;
+	while ((us >> (octave+1)) && octave < SERIALLATENCYBUCKETS/8 + 1)
+		octave++;
+	
+	int bucket = (octave-2)*8 + (int) ((us >> (octave-3)) & 7);
+	return bucket < SERIALLATENCYBUCKETS ? bucket : SERIALLATENCYBUCKETS-1;
+}
+
+/***************************************************************************//*!
+* \brief Upper limit of a bucket in seconds
+*******************************************************************************/
+static double latencyBucketLimit(int bucket)
+{
+	if (bucket < 8)
+		return (bucket + 1) * 1e-6;
+	
+	int octave = bucket/8 + 2;
+	return (double) ((uint64_t) (9 + bucket%8) << (octave-3)) * 1e-6;
+}
+
+/***************************************************************************//*!
+* \brief Latency below which the given fraction of the replies came, rounded
+* 		 up to the bucket limit
+*******************************************************************************/
+static double latencyPercentile(const SerialLatency *latency, double percentile)
+{
+	uint32_t rank = (uint32_t) ceil(latency->count * percentile);
+	uint32_t seen = 0;
+	
+	if (!latency->count)
+		return 0.0;
+	for (int i=0; i<SERIALLATENCYBUCKETS; i++)
+	{
+		seen += latency->buckets[i];
+		if (seen >= rank && seen)
+			return latencyBucketLimit(i);
+	}
+	return latencyBucketLimit(SERIALLATENCYBUCKETS-1);
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Locking
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Take the transaction lock of a device, for example to keep a write
+* 		 and the read of its reply together when several test sockets share
+* 		 the device. Waiters are served in arrival order. The lock is
+* 		 recursive, the library calls made by the holder do not block.
+*
+* \param [in] Handle 				Handle of serial device
+*******************************************************************************/
+int LockSerialHandle(int Handle, char errmsg[ERRLEN])
+{
+	libInit;
+	
+	handleErrChk(Handle);
+	serialLockAcquire(&serialPort(Handle-1)->lock);
+	if (!serialPort(Handle-1)->name[0])
+	{
+		serialLockRelease(&serialPort(Handle-1)->lock);
+		libErrChk(ERR_INVALID_SERIAL_HANDLE, "Serial device handle %d was removed", Handle);
+	}
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Release the transaction lock of a device taken with LockSerialHandle
+*
+* \param [in] Handle 				Handle of serial device
+*******************************************************************************/
+int UnlockSerialHandle(int Handle, char errmsg[ERRLEN])
+{
+	libInit;
+	
+	handleErrChk(Handle);
+	libErrChk(serialLockRelease(&serialPort(Handle-1)->lock), "Device %s is not locked by this thread", serialPort(Handle-1)->name);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Take the transaction lock of a device by name, see LockSerialHandle
+*
+* \param [in] SerialDeviceName 		Name of serial device
+*******************************************************************************/
+int LockSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = LockSerialHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Release the transaction lock of a device by name
+*
+* \param [in] SerialDeviceName 		Name of serial device
+*******************************************************************************/
+int UnlockSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+{
+	int handle = 0;
+	libInit;
+	
+	nameToHandle(SerialDeviceName, handle);
+	error = UnlockSerialHandle(handle, errmsg);
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Create the error queue and the receive engine thread pool. Runs once,
+* 		 before the library is marked initialized.
+*******************************************************************************/
+static int initSerialShared(void)
+{
+	static int initialized = 0;
+	
+	if (initialized)
+		return 0;
+	
+	for (int i=0; i<SERIALERRORQUEUELEN; i++)
+		glbSerialErrorQueue[i].sequence = i;
+	
+	// One reader per port and the capture writer, the number of ports is open
+	int error = CmtNewThreadPool(UNLIMITED_THREAD_POOL_THREADS, &glbSerialRxThreadPool);
+	if (error < 0)
+		return error;
+	
+	initialized = 1;
+	return 0;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Error Reporting
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Turn the UI debug mode on or off. Only in this mode do I/O errors
+* 		 also show a modal popup, otherwise they are only queued (see
+* 		 PopSerialErrorEvent) so an unattended station never waits for an
+* 		 operator. Off by default.
+*
+* \param [in] Enable 				1 to show popups
+* 
+* \return The previous mode
+*******************************************************************************/
+int SetSerialUIDebugMode(int Enable)
+{
+	int previous = glbSerialUIDebugMode;
+	glbSerialUIDebugMode = Enable ? 1 : 0;
+	return previous;
+}
+
+/***************************************************************************//*!
+* \brief Set a function called for every error reported, in addition to the
+* 		 queue. Set it before starting I/O threads, 0 removes it.
+*
+* \param [in] Callback 				Function to call, on the thread that hit the error
+* \param [in] CallbackData 			Passed back to Callback
+*******************************************************************************/
+void SetSerialErrorCallback(SerialErrorCallback Callback, void *CallbackData)
+{
+	glbSerialErrorCallbackData = CallbackData;
+	glbSerialErrorCallback = Callback;
+}
+
+/***************************************************************************//*!
+* \brief Take the oldest error event from the queue. Never blocks, safe to call
+* 		 from any thread.
+*
+* \param [out] Event 				Oldest event
+* 
+* \return 1 if an event was returned, 0 if the queue is empty
+*******************************************************************************/
+int PopSerialErrorEvent(SerialErrorEvent *Event)
+{
+	SerialErrorSlot *slot = 0;
+	long pos = glbSerialErrorReadPos;
+	
+	for (;;)
+	{
+		slot = &glbSerialErrorQueue[pos & (SERIALERRORQUEUELEN-1)];
+		long diff = slot->sequence - (pos + 1);
+		if (diff == 0)
+		{
+			if (SerialCompareExchange(&glbSerialErrorReadPos, pos, pos + 1))
+				break;
+		}
+		else if (diff < 0)
+			return 0;
+		pos = glbSerialErrorReadPos;
+	}
+	
+	*Event = slot->event;
+	SerialMemoryBarrier();
+	slot->sequence = pos + SERIALERRORQUEUELEN;
+	return 1;
+}
+
+/***************************************************************************//*!
+* \brief Number of events lost because the queue was full
+*******************************************************************************/
+unsigned int GetSerialErrorsDropped(void)
+{
+	return (unsigned int) glbSerialErrorsDropped;
+}
+
+/***************************************************************************//*!
+* \brief Queue an error event, call the error callback and, in UI debug mode
+* 		 only, show a popup. A full queue drops the new event and counts it.
+*
+* \param [in] Handle 				Device handle, 0 if none
+* \param [in] Code 					Error code
+* \param [in] Title 				Popup title
+* \param [in] Message 				Error text
+*******************************************************************************/
+static void reportSerialError(int Handle, int Code, const char *Title, const char *Message)
+{
+	SerialErrorSlot *slot = 0;
+	SerialErrorEvent *event = 0;
+	SerialErrorEvent local = {0};
+	long pos = glbSerialErrorWritePos;
+	
+	for (;;)
+	{
+		slot = &glbSerialErrorQueue[pos & (SERIALERRORQUEUELEN-1)];
+		long diff = slot->sequence - pos;
+		if (diff == 0)
+		{
+			if (SerialCompareExchange(&glbSerialErrorWritePos, pos, pos + 1))
+			{
+				event = &slot->event;
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			SerialAtomicIncrement(&glbSerialErrorsDropped);
+			event = &local;
+			slot = 0;
+			break;
+		}
+		pos = glbSerialErrorWritePos;
+	}
+	
+	event->timestamp = Timer();
+	event->handle = Handle;
+	event->code = Code;
+	snprintf(event->device, sizeof(event->device), "%s", Handle > 0 ? serialPort(Handle-1)->name : "");
+	snprintf(event->message, sizeof(event->message), "%s", Message);
+	
+	// Publish before the callback so a callback that drains the queue sees it
+	if (slot)
+	{
+		local = *event;
+		SerialMemoryBarrier();
+		slot->sequence = pos + 1;
+	}
+	
+	if (glbSerialErrorCallback)
+		glbSerialErrorCallback(&local, glbSerialErrorCallbackData);
+	if (glbSerialUIDebugMode)
+		MessagePopup(Title, Message);
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Wire Capture
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Start recording every chunk sent and received on any port to a binary
+* 		 capture file. Each port gets its own ring, the I/O path only copies
+* 		 the bytes into it and a background thread appends the rings to the
+* 		 file. Records that do not fit in a full ring are dropped and counted
+* 		 (see GetSerialCaptureDropped). Decode the file with
+* 		 DecodeSerialCapture.
+*
+* \param [in] FilePath 				Capture file, overwritten
+* \param [in] RingSize 				Bytes per port ring, 0 for the default,
+* 									rounded up to a power of 2
+*******************************************************************************/
+int StartSerialCapture(char *FilePath, int RingSize, char errmsg[ERRLEN])
+{
+	unsigned int size = SERIALCAPTUREMINSIZE;
+	libInit;
+	
+	libErrChk(glbSerialCaptureFile ? -1 : 0, "Capture already running to %s", glbSerialCapturePath);
+	if (RingSize <= 0)
+		RingSize = SERIALCAPTUREDEFAULTSIZE;
+	while (size < (unsigned int) RingSize)
+		size <<= 1;
+	
+	glbSerialCaptureFile = fopen(FilePath, "wb");
+	libErrChk(glbSerialCaptureFile ? 0 : -1, "Unable to create capture file %s", FilePath);
+	snprintf(glbSerialCapturePath, sizeof(glbSerialCapturePath), "%s", FilePath);
+	
+	SerialCaptureFileHeader fileHeader = {SERIALCAPTUREMAGIC, SERIALCAPTUREVERSION, serialMonotonicNs(), (uint64_t) time(NULL)};
+	fwrite(&fileHeader, sizeof(fileHeader), 1, glbSerialCaptureFile);
+	
+	// Device names go first so the decoder can label the records
+	for (int i=0; i<glbNumOfComPorts; i++)
+	{
+		SerialCaptureRecord record = {fileHeader.startNs, (uint16_t) (i+1), SERIAL_CAPTURE_NAME, 0, (uint32_t) strlen(serialPort(i)->name)};
+		fwrite(&record, sizeof(record), 1, glbSerialCaptureFile);
+		fwrite(serialPort(i)->name, 1, record.length, glbSerialCaptureFile);
+		
+		SerialCaptureRing *ring = &serialPort(i)->capture;
+		ring->buffer = malloc(size);
+		libErrChk(ring->buffer ? 0 : -1, "Unable to allocate %u byte capture ring", size);
+		ring->size = size;
+		ring->head = 0;
+		ring->tail = 0;
+	}
+	glbSerialCaptureDropped = 0;
+	
+	glbSerialCaptureRunning = 1;
+	libErrChk(CmtScheduleThreadPoolFunction(glbSerialRxThreadPool, SerialCaptureThread, 0, &glbSerialCaptureThreadID) < 0 ? -1 : 0,
+			  "Unable to start capture writer thread");
+	SerialMemoryBarrier();
+	glbSerialCaptureActive = 1;
+	
+Error:
+	if (error && glbSerialCaptureFile)
+		stopCapture();
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Stop recording, write what is left in the rings and close the file
+*******************************************************************************/
+int StopSerialCapture(char errmsg[ERRLEN])
+{
+	libInit;
+	
+	libErrChk(glbSerialCaptureFile ? 0 : -1, "Capture is not running");
+	stopCapture();
+	
+Error:
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Number of records dropped since the capture started because a ring
+* 		 was full
+*******************************************************************************/
+unsigned int GetSerialCaptureDropped(void)
+{
+	return (unsigned int) glbSerialCaptureDropped;
+}
+
+/***************************************************************************//*!
+* \brief Decode a capture file offline. Records of all ports are listed in
+* 		 time order, times are in seconds since the capture started.
+* 		 SERIAL_DECODE_SMC reassembles received Modbus RTU frames and checks
+* 		 their CRC, SERIAL_DECODE_SCPI splits the traffic into CR/LF
+* 		 terminated lines.
+*
+* \param [in] CaptureFile 			File written by StartSerialCapture
+* \param [in] OutputFile 			Text file to write, 0 or "" for stdout
+* \param [in] Format 				#SerialDecodeFormat
+* 
+* \return Number of records decoded or negative error code
+*******************************************************************************/
+int DecodeSerialCapture(char *CaptureFile, char *OutputFile, int Format, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	FILE *in = 0, *out = stdout;
+	SerialCaptureEntry *entries = 0;
+	int numEntries = 0, maxEntries = 0;
+	SerialCaptureStream *streams = 0;
+	SerialCaptureFileHeader fileHeader = {0};
+	char (*names)[MAXDEVICENAMELEN] = 0;		// Per handle, numNames entries
+	int numNames = 0;
+	
+	tsErrChk(Format < SERIAL_DECODE_TEXT || Format > SERIAL_DECODE_SCPI ? -1 : 0, "Unknown capture decode format %d", Format);
+	in = fopen(CaptureFile, "rb");
+	tsErrChk(in ? 0 : -1, "Unable to open capture file %s", CaptureFile);
+	tsErrChk(fread(&fileHeader, sizeof(fileHeader), 1, in) != 1 || memcmp(fileHeader.magic, SERIALCAPTUREMAGIC, 4) ? -1 : 0,
+			 "%s is not a serial capture file", CaptureFile);
+	tsErrChk(fileHeader.version != SERIALCAPTUREVERSION ? -1 : 0, "Unsupported capture file version %u", fileHeader.version);
+	
+	// Load everything, the writer appends the rings port by port so records
+	// are only in order within a port
+	SerialCaptureRecord record;
+	while (fread(&record, sizeof(record), 1, in) == 1)
+	{
+		unsigned char *data = malloc(record.length ? record.length : 1);
+		tsErrChk(data ? 0 : -1, "Out of memory reading %s", CaptureFile);
+		if (fread(data, 1, record.length, in) != record.length)
+		{
+			free(data);
+			break;			// Truncated last record
+		}
+		
+		if (record.direction == SERIAL_CAPTURE_NAME)
+		{
+			if (record.handle >= numNames)
+			{
+				char (*grown)[MAXDEVICENAMELEN] = realloc(names, (record.handle + 1) * sizeof(*names));
+				if (!grown)
+					free(data);
+				tsErrChk(grown ? 0 : -1, "Out of memory reading %s", CaptureFile);
+				memset(grown + numNames, 0, (record.handle + 1 - numNames) * sizeof(*names));
+				names = grown;
+				numNames = record.handle + 1;
+			}
+			snprintf(names[record.handle], MAXDEVICENAMELEN, "%.*s", (int) record.length, (char*) data);
+			free(data);
+			continue;
+		}
+		if (numEntries == maxEntries)
+		{
+			maxEntries = maxEntries ? maxEntries*2 : 1024;
+			SerialCaptureEntry *grown = realloc(entries, maxEntries * sizeof(SerialCaptureEntry));
+			if (!grown)
+				free(data);
+			tsErrChk(grown ? 0 : -1, "Out of memory reading %s", CaptureFile);
+			entries = grown;
+		}
+		entries[numEntries].record = record;
+		entries[numEntries].data = data;
+		entries[numEntries].order = numEntries;
+		numEntries++;
+	}
+	qsort(entries, (size_t) numEntries, sizeof(SerialCaptureEntry), compareCaptureEntries);
+	
+	if (OutputFile && OutputFile[0])
+	{
+		out = fopen(OutputFile, "w");
+		tsErrChk(out ? 0 : -1, "Unable to create %s", OutputFile);
+	}
+	// Handles are 16 bit, streams are only kept for named devices
+	streams = calloc((size_t) (numNames ? numNames : 1)*2, sizeof(SerialCaptureStream));
+	tsErrChk(streams ? 0 : -1, "Out of memory decoding %s", CaptureFile);
+	
+	for (int i=0; i<numEntries; i++)
+	{
+		SerialCaptureRecord *rec = &entries[i].record;
+		double seconds = (double) (int64_t) (rec->timestamp - fileHeader.startNs) / 1e9;
+		const char *name = rec->handle < numNames && names[rec->handle][0] ? names[rec->handle] : "?";
+		const char *dir = rec->direction == SERIAL_CAPTURE_TX ? "TX" : "RX";
+		
+		if (Format == SERIAL_DECODE_TEXT || rec->handle >= numNames)
+		{
+			fprintf(out, "%12.6f  %-16s %s %5u  ", seconds, name, dir, rec->length);
+			printCaptureBytes(out, entries[i].data, (int) rec->length, 0);
+			fputc('\n', out);
+			continue;
+		}
+		
+		// Frames can span records, reassemble per port and direction
+		SerialCaptureStream *stream = &streams[rec->handle*2 + (rec->direction == SERIAL_CAPTURE_RX)];
+		if (stream->len + (int) rec->length > (int) sizeof(stream->data))
+		{
+			fprintf(out, "%12.6f  %-16s %s discarding %d unframed bytes\n", seconds, name, dir, stream->len);
+			stream->len = 0;
+		}
+		int copy = (int) rec->length < (int) sizeof(stream->data) ? (int) rec->length : (int) sizeof(stream->data);
+		memcpy(stream->data + stream->len, entries[i].data, (size_t) copy);
+		stream->len += copy;
+		
+		int frameLen = 0;
+		while (stream->len > 0)
+		{
+			if (Format == SERIAL_DECODE_SMC)
+			{
+				// Requests are written in one call, so a TX record is one frame
+				// A reply is cut like the framer does, unknown function codes take what arrived
+				frameLen = rec->direction == SERIAL_CAPTURE_TX ? stream->len : modbusFrameLength(stream->data, stream->len);
+				if (frameLen < 0)
+					frameLen = stream->len;
+				else if (frameLen > stream->len)
+					frameLen = 0;
+				if (!frameLen)
+					break;
+				uint16_t crcValue = SerialCrc16Update(SERIALCRC16INIT, stream->data, frameLen-2);
+				int crcOk = frameLen >= 4 && stream->data[frameLen-2] == (crcValue & 0xFF) && stream->data[frameLen-1] == (crcValue >> 8);
+				fprintf(out, "%12.6f  %-16s %s addr %3u fn 0x%02X%s  ", seconds, name, dir, stream->data[0],
+						frameLen > 1 ? stream->data[1] : 0, frameLen > 1 && (stream->data[1] & 0x80) ? " exception" : "");
+				printCaptureBytes(out, stream->data + 2, frameLen - 4, 1);
+				fprintf(out, "  crc %s\n", crcOk ? "ok" : "BAD");
+			}
+			else
+			{
+				unsigned char *end = 0;
+				for (int j=0; j<stream->len && !end; j++)
+					if (stream->data[j] == '\r' || stream->data[j] == '\n')
+						end = stream->data + j;
+				if (!end)
+					break;
+				frameLen = (int) (end - stream->data) + 1;
+				if (frameLen > 1)
+				{
+					fprintf(out, "%12.6f  %-16s %s  ", seconds, name, rec->direction == SERIAL_CAPTURE_TX ? ">>" : "<<");
+					printCaptureBytes(out, stream->data, frameLen-1, 0);
+					fputc('\n', out);
+				}
+			}
+			stream->len -= frameLen;
+			memmove(stream->data, stream->data + frameLen, (size_t) stream->len);
+		}
+	}
+	
+	// Whatever never completed a frame
+	for (int i=0; streams && i<numNames*2; i++)
+	{
+		if (streams[i].len)
+		{
+			fprintf(out, "%12s  %-16s %s incomplete  ", "", names[i/2][0] ? names[i/2] : "?", i%2 ? "RX" : "TX");
+			printCaptureBytes(out, streams[i].data, streams[i].len, Format == SERIAL_DECODE_SMC);
+			fputc('\n', out);
+		}
+	}
+	error = numEntries;
+	
+Error:
+	for (int i=0; i<numEntries; i++)
+		free(entries[i].data);
+	free(entries);
+	free(streams);
+	free(names);
+	if (in)
+		fclose(in);
+	if (out && out != stdout)
+		fclose(out);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Copy one chunk into the capture ring of a port. Only copies, the
+* 		 writer thread does the file I/O. Called by the transport call sites
+* 		 with the bytes that actually went over the line.
+*
+* \param [in] index 				Port index
+* \param [in] direction 				#SerialCaptureDirection
+* \param [in] segments 				Chunk, possibly in several buffers
+* \param [in] numSegments 			Number of buffers
+*******************************************************************************/
+static void captureTraffic(int index, int direction, const SerialIOVec *segments, int numSegments)
+{
+	if (!glbSerialCaptureActive)
+		return;
+	
+	SerialCaptureRing *ring = &serialPort(index)->capture;
+	SerialCaptureRecord record = {serialMonotonicNs(), (uint16_t) (index+1), (uint8_t) direction, 0, 0};
+	for (int i=0; i<numSegments; i++)
+		record.length += (uint32_t) segments[i].len;
+	
+	// The engine thread and the callers holding the port lock can both produce,
+	// the section below is only a few copies
+	while (!SerialCompareExchange(&ring->busy, 0, 1))
+		;
+	if (glbSerialCaptureActive && ring->buffer)
+	{
+		unsigned int need = (unsigned int) sizeof(record) + record.length;
+		if (ring->size - (ring->head - ring->tail) < need)
+			SerialAtomicIncrement(&glbSerialCaptureDropped);
+		else
+		{
+			unsigned int head = ring->head;
+			head = captureRingPut(ring, head, &record, sizeof(record));
+			for (int i=0; i<numSegments; i++)
+				head = captureRingPut(ring, head, segments[i].data, (unsigned int) segments[i].len);
+			SerialMemoryBarrier();
+			ring->head = head;
+		}
+	}
+	SerialMemoryBarrier();
+	ring->busy = 0;
+}
+
+static unsigned int captureRingPut(SerialCaptureRing *ring, unsigned int head, const void *data, unsigned int len)
+{
+	unsigned int start = head & (ring->size-1);
+	unsigned int first = len < ring->size - start ? len : ring->size - start;
+	
+	memcpy(ring->buffer + start, data, first);
+	memcpy(ring->buffer, (const unsigned char*) data + first, len - first);
+	return head + len;
+}
+
+/***************************************************************************//*!
+* \brief Background writer, appends the filled part of every ring to the file
+*******************************************************************************/
+static int CVICALLBACK SerialCaptureThread(void *functionData)
+{
+	while (glbSerialCaptureRunning)
+	{
+		Delay(SERIALCAPTUREFLUSHTIME);
+		drainCapture();
+	}
+	drainCapture();
+	fflush(glbSerialCaptureFile);
+	return 0;
+}
+
+static void drainCapture(void)
+{
+	for (int i=0; i<glbSerialPortsAllocated; i++)
+	{
+		SerialCaptureRing *ring = &serialPort(i)->capture;
+		if (!ring->buffer)
+			continue;
+		
+		// Records are only published whole, so head always ends a record
+		unsigned int head = ring->head;
+		SerialMemoryBarrier();
+		unsigned int avail = head - ring->tail;
+		unsigned int start = ring->tail & (ring->size-1);
+		unsigned int first = avail < ring->size - start ? avail : ring->size - start;
+		
+		fwrite(ring->buffer + start, 1, first, glbSerialCaptureFile);
+		fwrite(ring->buffer, 1, avail - first, glbSerialCaptureFile);
+		SerialMemoryBarrier();
+		ring->tail = head;
+	}
+}
+
+static void stopCapture(void)
+{
+	glbSerialCaptureActive = 0;
+	SerialMemoryBarrier();
+	
+	// Wait out producers already copying, later ones see the capture inactive
+	for (int i=0; i<glbSerialPortsAllocated; i++)
+	{
+		while (!SerialCompareExchange(&serialPort(i)->capture.busy, 0, 1))
+			;
+		serialPort(i)->capture.busy = 0;
+	}
+	
+	if (glbSerialCaptureRunning)
+	{
+		glbSerialCaptureRunning = 0;
+		CmtWaitForThreadPoolFunctionCompletion(glbSerialRxThreadPool, glbSerialCaptureThreadID, 0);
+		CmtReleaseThreadPoolFunctionID(glbSerialRxThreadPool, glbSerialCaptureThreadID);
+		glbSerialCaptureThreadID = 0;
+	}
+	
+	for (int i=0; i<glbSerialPortsAllocated; i++)
+	{
+		free(serialPort(i)->capture.buffer);
+		serialPort(i)->capture.buffer = 0;
+	}
+	fclose(glbSerialCaptureFile);
+	glbSerialCaptureFile = 0;
+}
+
+/***************************************************************************//*!
+* \brief Print bytes as escaped text, or as hex pairs
+*******************************************************************************/
+static void printCaptureBytes(FILE *out, const unsigned char *data, int len, int hex)
+{
+	for (int i=0; i<len; i++)
+	{
+		if (hex)
+			fprintf(out, i ? " %02X" : "%02X", data[i]);
+		else if (data[i] == '\r')
+			fputs("\\r", out);
+		else if (data[i] == '\n')
+			fputs("\\n", out);
+		else if (data[i] == '\\')
+			fputs("\\\\", out);
+		else if (isprint(data[i]))
+			fputc(data[i], out);
+		else
+			fprintf(out, "\\x%02X", data[i]);
+	}
+}
+
+static int compareCaptureEntries(const void *a, const void *b)
+{
+	const SerialCaptureEntry *entryA = a, *entryB = b;
+	
+	if (entryA->record.timestamp != entryB->record.timestamp)
+		return entryA->record.timestamp < entryB->record.timestamp ? -1 : 1;
+	return entryA->order - entryB->order;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Port Scanner
+//! \endcond
+
+/***************************************************************************//*!
+* \brief Find the instruments connected to the serial ports of the station
+*
+* Every port is probed on its own thread, so the scan takes about as long as
+* the slowest port. Each port is opened at the SERIALSCANBAUDRATES in turn
+* (8N1, no handshaking) and asked to identify itself:
+* - SMC controller: Modbus echo (function 0x08) to address 1
+* - SCPI instrument: *IDN?
+* - Zebra printer: ~HQES
+* The first answer wins. The identified devices are written as a
+* configuration file that can be passed to InitializeSerialPortLib as is.
+* The library does not have to be initialized. See ScanSerialPortsEx to look
+* for SMC controllers at other addresses.
+*
+* \param [in]  OutputFile 			Configuration file to write, 0 to skip
+* \param [in]  Ports 				Comma separated ports to scan (COM3,/dev/ttyUSB0),
+* 									0 or "" for every port found on the system
+* \param [in]  ProbeTimeout 		Time to wait for an answer to one probe in
+* 									seconds, 0 for 0.2
+* \param [out] Results 				Identified devices, can be 0
+* \param [in]  MaxResults 			Size of Results
+*
+* \return Number of identified devices or negative error code
+*******************************************************************************/
+int ScanSerialPorts(char *OutputFile, char *Ports, double ProbeTimeout, SerialScanResult *Results, int MaxResults, char errmsg[ERRLEN])
+{
+	return ScanSerialPortsEx(OutputFile, Ports, ProbeTimeout, 1, 1, Results, MaxResults, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Find the instruments connected to the serial ports of the station,
+* 		 probing a range of SMC controller addresses
+*
+* Same as ScanSerialPorts, the Modbus echo is sent to every address from
+* SMCFirstAddress to SMCLastAddress. An address that does not answer costs
+* one ProbeTimeout per baud rate, so keep the range to the addresses in use.
+* The ident of an SMC port lists every address that answered.
+*
+* \param [in]  SMCFirstAddress 		First SMC controller address, 1-247
+* \param [in]  SMCLastAddress 		Last SMC controller address, 1-247
+*******************************************************************************/
+int ScanSerialPortsEx(char *OutputFile, char *Ports, double ProbeTimeout, int SMCFirstAddress, int SMCLastAddress,
+					  SerialScanResult *Results, int MaxResults, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	char (*ports)[MAXDEVICENAMELEN] = 0;
+	SerialScanJob *jobs = 0;
+	SerialScanResult *found = 0;
+	int numPorts = 0;
+	int numFound = 0;
+	
+	tsErrChk(SMCFirstAddress < 1 || SMCLastAddress > 247 || SMCFirstAddress > SMCLastAddress ? -1 : 0,
+			 "Invalid SMC address range %d to %d, addresses are 1 to 247", SMCFirstAddress, SMCLastAddress);
+	tsErrChk(initSerialShared(), "Unable to create the scanner thread pool");
+	ports = calloc(SERIALSCANMAXPORTS, MAXDEVICENAMELEN);
+	tsErrChk(ports ? 0 : -1, "Out of memory");
+	
+	if (Ports && Ports[0])
+	{
+		for (char *start = Ports; *start && numPorts < SERIALSCANMAXPORTS; )
+		{
+			size_t len = strcspn(start, ",");
+			while (len && isspace((unsigned char) *start))
+				start++, len--;
+			if (len && len < MAXDEVICENAMELEN)
+			{
+				memcpy(ports[numPorts], start, len);
+				while (len && isspace((unsigned char) ports[numPorts][len-1]))
+					len--;
+				ports[numPorts++][len] = 0;
+			}
+			start += len;
+			start += strspn(start, ", \t");
+		}
+	}
+	else
+		numPorts = enumerateSerialPorts(ports, SERIALSCANMAXPORTS);
+	
+	jobs = calloc((size_t) (numPorts ? numPorts : 1), sizeof(SerialScanJob));
+	found = calloc((size_t) (numPorts ? numPorts : 1), sizeof(SerialScanResult));
+	tsErrChk(jobs && found ? 0 : -1, "Out of memory");
+	
+	for (int i=0; i<numPorts; i++)
+	{
+		strcpy(jobs[i].port, ports[i]);
+		jobs[i].probeTimeout = ProbeTimeout > 0 ? ProbeTimeout : 0.2;
+		jobs[i].smcFirstAddress = SMCFirstAddress;
+		jobs[i].smcLastAddress = SMCLastAddress;
+		if (CmtScheduleThreadPoolFunction(glbSerialRxThreadPool, SerialScanThread, &jobs[i], &jobs[i].threadID) < 0)
+			jobs[i].threadID = 0;
+	}
+	for (int i=0; i<numPorts; i++)
+	{
+		if (!jobs[i].threadID)
+			continue;
+		CmtWaitForThreadPoolFunctionCompletion(glbSerialRxThreadPool, jobs[i].threadID, 0);
+		CmtReleaseThreadPoolFunctionID(glbSerialRxThreadPool, jobs[i].threadID);
+		if (jobs[i].result.type != SERIAL_SCAN_NONE)
+		{
+			found[numFound] = jobs[i].result;
+			scanDeviceName(&found[numFound], numFound, found[numFound].deviceName);
+			numFound++;
+		}
+	}
+	
+	for (int i=0; Results && i<numFound && i<MaxResults; i++)
+		Results[i] = found[i];
+	if (OutputFile && OutputFile[0])
+		tsErrChk(writeScanConfig(OutputFile, found, numFound), "Unable to write %s", OutputFile);
+	
+Error:
+	free(ports);
+	free(jobs);
+	free(found);
+	if (error)
+		return error;
+	else
+		return numFound;
+}
+
+/***************************************************************************//*!
+* \brief List the serial ports of the system
+*
+* \return Number of ports stored
+*******************************************************************************/
+static int enumerateSerialPorts(char (*ports)[MAXDEVICENAMELEN], int maxPorts)
+{
+	int count = 0;
+	
+#ifdef _WIN32
+	char name[16] = {0};
+	char target[256] = {0};
+	
+	// Every existing COM port has a DOS device name, whether in use or not
+	for (int i=1; i<=SERIALSCANMAXCOM && count<maxPorts; i++)
+	{
+		sprintf(name, "COM%d", i);
+		if (QueryDosDeviceA(name, target, sizeof(target)))
+			strcpy(ports[count++], name);
+	}
+#else
+	static const char *prefixes[] = {"ttyS", "ttyUSB", "ttyACM", "ttyAMA", "cu."};
+	DIR *dir = opendir("/dev");
+	struct dirent *entry = 0;
+	
+	while (dir && (entry = readdir(dir)) && count<maxPorts)
+	{
+		for (int i=0; i<(int) (sizeof(prefixes)/sizeof(prefixes[0])); i++)
+		{
+			if (strncmp(entry->d_name, prefixes[i], strlen(prefixes[i])) || strlen(entry->d_name) + 6 > MAXDEVICENAMELEN)
+				continue;
+			
+			// Legacy ttyS nodes exist without hardware, those fail to open or to report their settings
+			char path[MAXDEVICENAMELEN] = {0};
+			struct termios tio;
+			sprintf(path, "/dev/%s", entry->d_name);
+			int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+			if (fd >= 0 && tcgetattr(fd, &tio) == 0)
+				strcpy(ports[count++], path);
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+	}
+	if (dir)
+		closedir(dir);
+#endif
+	return count;
+}
+
+/***************************************************************************//*!
+* \brief Probe one port at every baud rate until a device answers
+*******************************************************************************/
+static int CVICALLBACK SerialScanThread(void *functionData)
+{
+	static const int baudRates[] = SERIALSCANBAUDRATES;
+	static const int types[] = {SERIAL_SCAN_SMC, SERIAL_SCAN_SCPI, SERIAL_SCAN_ZEBRA};
+	SerialScanJob *job = (SerialScanJob*) functionData;
+	SerialConfigEntry entry;
+	SerialTransport port;
+	
+	defaultSerialConfigEntry(&entry);
+	if (decodeSerialParam(&entry.desc, entry.name, entry.path, 1, job->port))
+		return 0;
+	
+	const SerialTransportOps *ops = getTransportOps(entry.desc.transport);
+	if (!ops)
+		return 0;
+	
+	DisableBreakOnLibraryErrors ();
+	for (int i=0; i<(int) (sizeof(baudRates)/sizeof(baudRates[0])) && job->result.type==SERIAL_SCAN_NONE; i++)
+	{
+		memset(&port, 0, sizeof(port));
+		port.ops = ops;
+		entry.desc.baudRate = baudRates[i];
+		entry.desc.timeout = job->probeTimeout;
+		if (ops->open(&port, &entry.desc, entry.path))
+			break;					// Missing or in use, other rates will not help
+		
+		for (int j=0; j<(int) (sizeof(types)/sizeof(types[0])) && job->result.type==SERIAL_SCAN_NONE; j++)
+		{
+			// Only SMC controllers have an address, the other probes run once
+			int first = types[j] == SERIAL_SCAN_SMC ? job->smcFirstAddress : 0;
+			int last = types[j] == SERIAL_SCAN_SMC ? job->smcLastAddress : 0;
+			char addresses[MAXCHARARRAYLENGTH] = {0};
+			int numFound = 0;
+			
+			for (int address=first; address<=last; address++)
+			{
+				if (!probeSerialPort(&port, types[j], address, job->result.ident, sizeof(job->result.ident), job->probeTimeout))
+					continue;
+				if (types[j] == SERIAL_SCAN_SMC && strlen(addresses) + 5 < sizeof(addresses))
+					sprintf(addresses + strlen(addresses), "%s%d", numFound ? "," : "", address);
+				numFound++;
+			}
+			if (!numFound)
+				continue;
+			
+			if (types[j] == SERIAL_SCAN_SMC)
+				snprintf(job->result.ident, sizeof(job->result.ident), "SMC controller, address%s %s", numFound > 1 ? "es" : "", addresses);
+			job->result.type = types[j];
+			job->result.baudRate = baudRates[i];
+			strcpy(job->result.port, job->port);
+		}
+		ops->close(&port);
+	}
+	EnableBreakOnLibraryErrors ();
+	
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Send the identification request of a device type and check the answer
+*
+* \param [in]  address 			Controller address, SMC only
+* \param [out] ident 				Text identifying the device
+*
+* \return 1 if a device of the type answered, 0 otherwise
+*******************************************************************************/
+static int probeSerialPort(SerialTransport *port, int type, int address, char *ident, int identLen, double timeout)
+{
+	unsigned char request[16] = {0};
+	unsigned char reply[MAXCHARARRAYLENGTH] = {0};
+	int requestLen = 0;
+	int replyLen = 0;
+	
+	switch (type)
+	{
+		case SERIAL_SCAN_SMC:
+		{
+			static const unsigned char echo[6] = {0x01, 0x08, 0x00, 0x00, 0xA5, 0x5A};
+			memcpy(request, echo, sizeof(echo));
+			request[0] = (unsigned char) address;
+			uint16_t crc = SerialCrc16Update(SERIALCRC16INIT, request, 6);
+			request[6] = (unsigned char) (crc & 0xFF);
+			request[7] = (unsigned char) (crc >> 8);
+			requestLen = 8;
+			break;
+		}
+		case SERIAL_SCAN_SCPI:
+			requestLen = sprintf((char*) request, "*IDN?\r\n");
+			break;
+		case SERIAL_SCAN_ZEBRA:
+			requestLen = sprintf((char*) request, "~HQES");
+			break;
+	}
+	
+	SerialIOVec segment = {request, requestLen};
+	port->ops->flush(port, 1);
+	if (port->ops->write(port, &segment, 1) != requestLen)
+		return 0;
+	
+	double deadline = Timer() + timeout;
+	for (double now = Timer(); now < deadline && replyLen < (int) sizeof(reply)-1; now = Timer())
+	{
+		int count = port->ops->wait(port, (char*) reply + replyLen, (int) sizeof(reply)-1 - replyLen, deadline - now);
+		if (count < 0)
+			return 0;
+		replyLen += count;
+		
+		switch (type)
+		{
+			case SERIAL_SCAN_SMC:
+				if (replyLen >= requestLen)
+				{
+					if (memcmp(reply, request, requestLen))
+						return 0;
+					snprintf(ident, identLen, "SMC controller, address %d", address);
+					return 1;
+				}
+				break;
+			case SERIAL_SCAN_SCPI:
+			{
+				// manufacturer,model,serial,firmware
+				char *end = memchr(reply, '\n', replyLen);
+				if (!end)
+					end = memchr(reply, '\r', replyLen);
+				if (end)
+				{
+					*end = 0;
+					if (end > (char*) reply && end[-1] == '\r')
+						end[-1] = 0;
+					if (!strchr((char*) reply, ','))
+						return 0;
+					snprintf(ident, identLen, "%s", (char*) reply);
+					return 1;
+				}
+				break;
+			}
+			case SERIAL_SCAN_ZEBRA:
+			{
+				// STX PRINTER STATUS ... ETX
+				reply[replyLen] = 0;
+				unsigned char *stx = memchr(reply, 0x02, replyLen);
+				if (stx && memchr(stx, 0x03, replyLen - (stx - reply)))
+				{
+					snprintf(ident, identLen, "Zebra printer");
+					return 1;
+				}
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Device name for the configuration file: manufacturer and model for
+* 		 SCPI instruments, the type and port otherwise
+*******************************************************************************/
+static void scanDeviceName(const SerialScanResult *result, int index, char *deviceName)
+{
+	const char *port = strrchr(result->port, '/') ? strrchr(result->port, '/')+1 : result->port;
+	
+	switch (result->type)
+	{
+		case SERIAL_SCAN_SCPI:
+		{
+			size_t len = strcspn(result->ident, ",");
+			len += result->ident[len] ? 1 + strcspn(result->ident+len+1, ",") : 0;
+			snprintf(deviceName, MAXDEVICENAMELEN, "%.*s_%s", (int) len, result->ident, port);
+			break;
+		}
+		case SERIAL_SCAN_SMC:
+			snprintf(deviceName, MAXDEVICENAMELEN, "SMC_%s", port);
+			break;
+		default:
+			snprintf(deviceName, MAXDEVICENAMELEN, "Zebra_%s", port);
+			break;
+	}
+	
+	// Only characters that are safe in XML and as a device name
+	for (char *c = deviceName; *c; c++)
+	{
+		if (!isalnum((unsigned char) *c) && *c != '_' && *c != '-')
+			*c = '_';
+	}
+}
+
+/***************************************************************************//*!
+* \brief Write the identified devices in the configuration file format
+*******************************************************************************/
+static int writeScanConfig(const char *filePath, const SerialScanResult *results, int count)
+{
+	FILE *file = fopen(filePath, "w");
+	
+	if (!file)
+		return -1;
+	
+	fprintf(file, "<?xml version=\"1.0\"?>\n<SerialHW>\n");
+	for (int i=0; i<count; i++)
+	{
+		// The ident is whatever the device sent, "--" would end the comment early
+		char comment[MAXCHARARRAYLENGTH] = {0};
+		snprintf(comment, sizeof(comment), "%s", results[i].ident[0] ? results[i].ident : "Unknown");
+		for (char *c = comment; *c; c++)
+		{
+			if ((*c == '-' && c > comment && c[-1] == '-') || *c == '>' || (unsigned char) *c < 0x20)
+				*c = ' ';
+		}
+		fprintf(file, "<!-- %s -->\n", comment);
+		fprintf(file, "<Serial>\n<DeviceName>%s</DeviceName>\n<Comport>%s</Comport>\n<BaudRate>%d</BaudRate>\n", results[i].deviceName, results[i].port, results[i].baudRate);
+		fprintf(file, "<Parity>None</Parity>\n<DataBits>8</DataBits>\n<StopBits>1</StopBits>\n<CTSMode>Off</CTSMode>\n<XonXoff>Off</XonXoff>\n<Timeout>5</Timeout>\n</Serial>\n");
+	}
+	fprintf(file, "</SerialHW>\n");
+	return fclose(file) ? -1 : 0;
+}
+
+//! \cond
+/// REGION END
+
+/// REGION START Transport
+//! \endcond
+
+static const SerialTransportOps glbRS232Transport = {"RS232", rs232Open, rs232Close, rs232Write, rs232Read, rs232InQLen, rs232Flush, rs232Wait, rs232SetTimeout, rs232Reconfigure};
+#ifndef _WIN32
+static const SerialTransportOps glbTermiosTransport = {"termios", termiosOpen, termiosClose, termiosWrite, termiosRead, termiosInQLen, termiosFlush, termiosWait, termiosSetTimeout, termiosReconfigure};
+static const SerialTransportOps glbPtyTransport = {"PTY", ptyOpen, termiosClose, termiosWrite, termiosRead, termiosInQLen, termiosFlush, termiosWait, termiosSetTimeout, termiosReconfigure};
+#endif
+
+/***************************************************************************//*!
+* \brief Get the other end of the pseudo-terminal pair of a device configured
+* 		 with Comport "PTY". A simulated instrument reads the commands sent to
+* 		 the device from it and writes its replies to it.
+*
+* \param [in] Handle 				Handle of an open PTY device
+*
+* \return File descriptor of the peer or negative error code
+*******************************************************************************/
+int GetSerialLoopbackPeer(int Handle, char errmsg[ERRLEN])
+{
+	int peer = 0;
+	libInit;
+	
+	handleErrChk(Handle);
+	libErrChk(serialPort(Handle-1)->desc.portOpen!=1 || serialPort(Handle-1)->desc.transport!=SERIAL_TRANSPORT_PTY ? ERR_SERIAL_TRANSPORT : 0,
+			  "Device %s is not an open PTY device", serialPort(Handle-1)->name);
+	peer = serialPort(Handle-1)->transport.peerFd;
+	
+Error:
+	if(error)
+		return error;
+	else
+		return peer;
+}
+
+/***************************************************************************//*!
+* \brief Get the backend implementing a transport type
+*
+* \return The operations table or 0 if the transport is not available on this
+* 		  platform
+*******************************************************************************/
+static const SerialTransportOps *getTransportOps(int transport)
+{
+	switch (transport)
+	{
+		case SERIAL_TRANSPORT_RS232:
+			return &glbRS232Transport;
+#ifndef _WIN32
+		case SERIAL_TRANSPORT_TERMIOS:
+			return &glbTermiosTransport;
+		case SERIAL_TRANSPORT_PTY:
+			return &glbPtyTransport;
+#endif
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Describe an error returned by a transport operation
+*******************************************************************************/
+static const char *transportErrorText(SerialTransport *port, int error)
+{
+#ifndef _WIN32
+	if (error == ERR_SERIAL_TRANSPORT)
+		return strerror(port->lastErrno);
+#endif
+	return GetRS232ErrorString(error);
+}
+
+//==============================================================================
+// RS-232 backend, the CVI RS-232 library
+
+static int rs232Open(SerialTransport *port, const SerialPortDesc *desc, const char *path)
+{
+	int error = 0;
+	
+	port->comport = desc->comport;
+	DisableBreakOnLibraryErrors ();
+	error = OpenComConfig(desc->comport, "", desc->baudRate, desc->parity, desc->dataBits, desc->stopBits, 512, 512);
+	EnableBreakOnLibraryErrors ();
+	if (error < 0)
+		return error;
+	
+	SetXMode (desc->comport, (desc->flowControl & SERIAL_FLOW_XONXOFF) ? 1 : 0);
+	SetCTSMode (desc->comport, (desc->flowControl & SERIAL_FLOW_CTS) ? 1 : 0);
+	return rs232SetTimeout(port, desc->timeout);
+}
+
+static int rs232Close(SerialTransport *port)
+{
+	return CloseCom(port->comport);
+}
+
+/***************************************************************************//*!
+* \brief ComWrt only queues the data in the driver, so each segment is handed
+* 		 over as is
+*******************************************************************************/
+static int rs232Write(SerialTransport *port, const SerialIOVec *segments, int numSegments)
+{
+	int written = 0;
+	
+	for (int i=0; i<numSegments; i++)
+	{
+		int count = ComWrt(port->comport, segments[i].data, segments[i].len);
+		if (count < 0)
+			return count;
+		written += count;
+		if (count < segments[i].len)
+			break;
+	}
+	return written;
+}
+
+static int rs232Read(SerialTransport *port, char *data, int len, int terminationByte)
+{
+	if (terminationByte < 0)
+		return ComRd(port->comport, data, len);
+	return ComRdTerm(port->comport, data, len, terminationByte);
+}
+
+static int rs232InQLen(SerialTransport *port)
+{
+	if (GetComStat(port->comport))
+		return 0;
+	return GetInQLen(port->comport);
+}
+
+static int rs232Flush(SerialTransport *port, int inQueue)
+{
+	return inQueue ? FlushInQ(port->comport) : FlushOutQ(port->comport);
+}
+
+/***************************************************************************//*!
+* \brief Not a readiness wait, the RS-232 library has none that works off the
+* 		 UI thread. Reads with ComRd instead: blocks up to timeout for the
+* 		 first byte and returns it with whatever else is already queued, so
+* 		 nothing is lost.
+*******************************************************************************/
+static int rs232Wait(SerialTransport *port, char *data, int len, double timeout)
+{
+	if (timeout != port->timeout)
+		rs232SetTimeout(port, timeout);
+	
+	int count = GetInQLen(port->comport);
+	if (count <= 0)
+		count = 1;
+	if (count > len)
+		count = len;
+	
+	count = ComRd(port->comport, data, count);
+	if (count < 0 && ReturnRS232Err() == -99)
+		return 0;
+	return count;
+}
+
+static int rs232SetTimeout(SerialTransport *port, double timeout)
+{
+	port->timeout = timeout;
+	return SetComTime(port->comport, timeout);
+}
+
+/***************************************************************************//*!
+* \brief Handshaking can be switched on an open port, the line settings are
+* 		 only taken by OpenComConfig
+*******************************************************************************/
+static int rs232Reconfigure(SerialTransport *port, const SerialPortDesc *from, const SerialPortDesc *to)
+{
+	if (from->baudRate != to->baudRate || from->parity != to->parity || from->dataBits != to->dataBits || from->stopBits != to->stopBits)
+		return SERIALREOPEN;
+	
+	SetXMode (port->comport, (to->flowControl & SERIAL_FLOW_XONXOFF) ? 1 : 0);
+	SetCTSMode (port->comport, (to->flowControl & SERIAL_FLOW_CTS) ? 1 : 0);
+	return 0;
+}
+
+#ifndef _WIN32
+//==============================================================================
+// termios backend, native serial devices on POSIX systems
+
+static int transportFail(SerialTransport *port)
+{
+	port->lastErrno = errno;
+	return ERR_SERIAL_TRANSPORT;
+}
+
+static speed_t termiosSpeed(int baudRate)
+{
+	switch (baudRate)
+	{
+		case 110:		return B110;
+		case 300:		return B300;
+		case 600:		return B600;
+		case 1200:		return B1200;
+		case 2400:		return B2400;
+		case 4800:		return B4800;
+		case 9600:		return B9600;
+		case 19200:		return B19200;
+		case 38400:		return B38400;
+		case 57600:		return B57600;
+		case 115200:	return B115200;
+		case 230400:	return B230400;
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Put the line in raw mode with the settings of the port descriptor
 *******************************************************************************/
-int ReadSerialDeviceUntilTermChar(char *SerialDeviceName, char *ReadData, int numByteToRead, int terminationByte, char errmsg[ERRLEN])
+static int termiosConfigure(SerialTransport *port, const SerialPortDesc *desc)
 {
-	int bytesRead = 0;
-	libInit;
-	
-	int index = 0;
-	int comport = 0;
+	struct termios tio;
+	speed_t speed = termiosSpeed(desc->baudRate);
 	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
+	if (tcgetattr(port->fd, &tio) < 0)
+		return transportFail(port);
 	
-	if(glbSerialFileInfo[index].PortOpen!=1)
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB);
+	switch (desc->dataBits)
 	{
-		sprintf(errmsg,"Please Initalize device %s before trying to read",SerialDeviceName);
-		MessagePopup ("ReadSerialDevice Error", errmsg);
-		libErrChk(-1, errmsg);
+		case 5:		tio.c_cflag |= CS5;	break;
+		case 6:		tio.c_cflag |= CS6;	break;
+		case 7:		tio.c_cflag |= CS7;	break;
+		default:	tio.c_cflag |= CS8;	break;
 	}
+	if (desc->parity == SERIAL_PARITY_ODD)
+		tio.c_cflag |= PARENB | PARODD;
+	else if (desc->parity == SERIAL_PARITY_EVEN)
+		tio.c_cflag |= PARENB;
+#ifdef CMSPAR
+	tio.c_cflag &= ~CMSPAR;
+	if (desc->parity == SERIAL_PARITY_MARK)
+		tio.c_cflag |= PARENB | PARODD | CMSPAR;
+	else if (desc->parity == SERIAL_PARITY_SPACE)
+		tio.c_cflag |= PARENB | CMSPAR;
+#endif
+	if (desc->stopBits == 2)
+		tio.c_cflag |= CSTOPB;
+#ifdef CRTSCTS
+	if (desc->flowControl & SERIAL_FLOW_CTS)
+		tio.c_cflag |= CRTSCTS;
+	else
+		tio.c_cflag &= ~CRTSCTS;
+#endif
+	if (desc->flowControl & SERIAL_FLOW_XONXOFF)
+		tio.c_iflag |= IXON | IXOFF;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
 	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-	bytesRead = ComRdTerm(comport, ReadData, numByteToRead, terminationByte);
+	if (speed)
+	{
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+	}
+	if (tcsetattr(port->fd, TCSANOW, &tio) < 0)
+		return transportFail(port);
 	
-Error:
-	if(error)
-		return error;
-	else
-		return bytesRead;
+	port->timeout = desc->timeout;
+	return 0;
 }
 
 /***************************************************************************//*!
-* \brief returns the index in the glbSerialFileInfo array for the deviceName
-*
-* \param [in] DeviceName 		Name of device to find
+* \return > 0 if the line is ready, 0 on timeout, negative error code
 *******************************************************************************/
-int getFileInfoIndexFromName(char *DeviceName)
+static int termiosPoll(SerialTransport *port, short events, double timeout)
 {
-	for(int i=0; i< glbNumOfComPorts; i++)
-	{
-		if(stricmp(glbSerialFileInfo[i].DeviceName,DeviceName)==0)
-			return i;
-	}
-	return -1;
+	struct pollfd pfd = {port->fd, events, 0};
+	int ready = 0;
+	
+	do
+		ready = poll(&pfd, 1, (int) ceil(timeout*1000.0));
+	while (ready < 0 && errno == EINTR);
+	
+	return ready < 0 ? transportFail(port) : ready;
 }
 
-/***************************************************************************//*!
-* \brief This function takes the data previously loaded into Serial struct
-* 		 and populats the test configuration table for each com port opened
-*
-*******************************************************************************/
-void LoadSerialConfigFile(void)
+static int termiosOpen(SerialTransport *port, const SerialPortDesc *desc, const char *path)
 {
-	for(int i=0; i<glbNumOfComPorts; i++)
+	int error = 0;
+	
+	port->peerFd = -1;
+	port->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (port->fd < 0)
+		return transportFail(port);
+	
+	error = termiosConfigure(port, desc);
+	if (error)
+		termiosClose(port);
+	return error;
+}
+
+static int termiosClose(SerialTransport *port)
+{
+	if (port->fd >= 0)
+		close(port->fd);
+	if (port->peerFd >= 0)
+		close(port->peerFd);
+	port->fd = -1;
+	port->peerFd = -1;
+	return 0;
+}
+
+static int termiosWrite(SerialTransport *port, const SerialIOVec *segments, int numSegments)
+{
+	struct iovec iov[MAXSERIALIOVEC];
+	int written = 0;
+	int total = 0;
+	int first = 0;
+	double deadline = Timer() + port->timeout;
+	
+	for (int i=0; i<numSegments; i++)
+	{
+		iov[i].iov_base = (void*) segments[i].data;
+		iov[i].iov_len = (size_t) segments[i].len;
+		total += segments[i].len;
+	}
+	
+	while (written < total)
 	{
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (1, i+1), glbSerialFileInfo[i].DeviceName);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (2, i+1), glbSerialFileInfo[i].Comport);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (3, i+1), glbSerialFileInfo[i].BaudRate);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (4, i+1), glbSerialFileInfo[i].Parity);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (5, i+1), glbSerialFileInfo[i].DataBits);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (6, i+1), glbSerialFileInfo[i].StopBits);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (7, i+1), glbSerialFileInfo[i].CTSMode);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (8, i+1), glbSerialFileInfo[i].XonXoff);
-		SetTableCellVal (glbSerialConfigurationPanelHandle, glbSerialConfigTableHandle, MakePoint (9, i+1), atoi(glbSerialFileInfo[i].Timeout));
+		ssize_t count = writev(port->fd, iov + first, numSegments - first);
+		if (count > 0)
+		{
+			// Drop the segments that went out completely and trim a partial one
+			written += (int) count;
+			while (first < numSegments && (size_t) count >= iov[first].iov_len)
+				count -= (ssize_t) iov[first++].iov_len;
+			if (first < numSegments)
+			{
+				iov[first].iov_base = (char*) iov[first].iov_base + count;
+				iov[first].iov_len -= (size_t) count;
+			}
+			continue;
+		}
+		if (count < 0 && errno != EAGAIN && errno != EINTR)
+			return transportFail(port);
+		
+		double remaining = deadline - Timer();
+		if (remaining <= 0 || termiosPoll(port, POLLOUT, remaining) < 0)
+			break;
 	}
+	return written;
 }
 
 /***************************************************************************//*!
-* \brief Check if string is a valid XML tag
-*
-* \param [in] string
+* \brief Same contract as ComRd/ComRdTerm: returns what arrived before the port
+* 		 timeout, the termination byte is consumed but not stored
 *******************************************************************************/
-int ISValidXMLSerial (char * string)
+static int termiosRead(SerialTransport *port, char *data, int len, int terminationByte)
 {
-	int 	i = 0;
-	size_t	len = 0;
-	int 	allNums = 0;
-
-	if (string[0] == '\0')
-		return 0;
-
-	len = strlen(string);
-	for (i = 0; i < len; i++)
+	int bytesRead = 0;
+	double deadline = Timer() + port->timeout;
+	
+	while (bytesRead < len)
 	{
-		if (isdigit (string[i]))
-		{
-			if (i == 0)
-				allNums = 1;
-		}
-		else
+		// One byte at a time when looking for a terminator so nothing past it is consumed
+		ssize_t count = read(port->fd, data + bytesRead, terminationByte < 0 ? (size_t) (len - bytesRead) : 1);
+		if (count > 0)
 		{
-			allNums = 0;
+			if (terminationByte >= 0 && (unsigned char) data[bytesRead] == (unsigned char) terminationByte)
+				break;
+			bytesRead += (int) count;
+			continue;
 		}
-
-		if (!isalnum (string[i]) || isspace (string[i]))
-			return 0;
+		if (count < 0 && errno != EAGAIN && errno != EINTR)
+			return transportFail(port);
+		
+		double remaining = deadline - Timer();
+		if (remaining <= 0 || termiosPoll(port, POLLIN, remaining) < 0)
+			break;
 	}
+	return bytesRead;
+}
 
-	if (allNums)
-		return 0;
+static int termiosInQLen(SerialTransport *port)
+{
+	int queueLength = 0;
+	
+	if (ioctl(port->fd, FIONREAD, &queueLength) < 0)
+		return transportFail(port);
+	return queueLength;
+}
 
-	return 1;
-} 
+static int termiosFlush(SerialTransport *port, int inQueue)
+{
+	if (tcflush(port->fd, inQueue ? TCIFLUSH : TCOFLUSH) < 0)
+		return transportFail(port);
+	return 0;
+}
+
+static int termiosWait(SerialTransport *port, char *data, int len, double timeout)
+{
+	int ready = termiosPoll(port, POLLIN, timeout);
+	if (ready <= 0)
+		return ready;
+	
+	ssize_t count = read(port->fd, data, (size_t) len);
+	if (count < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : transportFail(port);
+	return (int) count;
+}
+
+static int termiosSetTimeout(SerialTransport *port, double timeout)
+{
+	port->timeout = timeout;
+	return 0;
+}
 
 /***************************************************************************//*!
-* \brief Display help information to the user based on RS232Error code
-*
-* \param [in] RS232Error 	Error code
+* \brief tcsetattr takes every setting on an open line
 *******************************************************************************/
-void DisplayRS232Error (int RS232Error)
+static int termiosReconfigure(SerialTransport *port, const SerialPortDesc *from, const SerialPortDesc *to)
 {
-	char ErrorMessage[200];
-	switch (RS232Error)
+	double timeout = port->timeout;
+	int error = termiosConfigure(port, to);
+	
+	// The timeout is set by the caller, it belongs to the receive engine while that runs
+	port->timeout = timeout;
+	return error;
+}
+
+//==============================================================================
+// PTY backend, an in-process pseudo-terminal pair. The device side is a normal
+// termios line, the master side is handed out by GetSerialLoopbackPeer.
+
+static int ptyOpen(SerialTransport *port, const SerialPortDesc *desc, const char *path)
+{
+	int error = 0;
+	char *slaveName = 0;
+	
+	port->fd = -1;
+	port->peerFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (port->peerFd < 0)
+		return transportFail(port);
+	
+	if (grantpt(port->peerFd) < 0 || unlockpt(port->peerFd) < 0 || !(slaveName = ptsname(port->peerFd)))
 	{
-		default :
-			if (RS232Error < 0)
-			{
-				Fmt (ErrorMessage, "%s<RS232 error number %i", RS232Error);
-				MessagePopup ("RS232 Message", ErrorMessage);
-			}
-			break;
-		case 0  :
-			MessagePopup ("RS232 Message", "No errors.");
-			break;
-		case -2 :
-			Fmt (ErrorMessage, "%s", "Invalid port number (must be in the "
-				 "range 1 to 8).");
-			MessagePopup ("RS232 Message", ErrorMessage);
-			break;
-		case -3 :
-			Fmt (ErrorMessage, "%s", "No port is open.\n"
-				 "Check COM Port setting in Configure.");
-			MessagePopup ("RS232 Message", ErrorMessage);
-			break;
-		case -99 :
-			Fmt (ErrorMessage, "%s", "Timeout error.\n\n"
-				 "Either increase timeout value,\n"
-				 "       check COM Port setting, or\n"
-				 "       check device.");
-			MessagePopup ("RS232 Message", ErrorMessage);
-			break;
+		error = transportFail(port);
+		termiosClose(port);
+		return error;
+	}
+	
+	port->fd = open(slaveName, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (port->fd < 0)
+	{
+		error = transportFail(port);
+		termiosClose(port);
+		return error;
 	}
+	
+	error = termiosConfigure(port, desc);
+	if (error)
+		termiosClose(port);
+	return error;
 }
+#endif
+
+//! \cond
+/// REGION END
+
+/// REGION START Platform
+//! \endcond
 
 /***************************************************************************//*!
-* \brief Get the in queue length for a specified device
-*
-* \param [in] SerialDeviceName 	Name of device  
-* 
-* \return the in queue length or error code
-* 		  - 0 -> COM Port status error
+* \brief Monotonic clock in nanoseconds, for capture timestamps
 *******************************************************************************/
-int GetInQLenForDeviceName(char *SerialDeviceName, char errmsg[ERRLEN])
+static uint64_t serialMonotonicNs(void)
 {
-	int queueLength = 0;
-	libInit;
-	
-	int comport = 0;
-	int index = 0;
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = {0};
+	LARGE_INTEGER counter;
 	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000ull
+		   + (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000ull / (uint64_t) frequency.QuadPart;
+#else
+	struct timespec ts;
 	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);  // comport number, i.e. skip COM prefix in the name
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
 
-	if (GetComStat(comport))
-		return 0;
+/***************************************************************************//*!
+* \brief Auto-reset signal used to wake a waiting consumer. A set signal stays
+* 		 set until one wait consumes it, so a wake-up can not be lost between
+* 		 checking for data and waiting.
+*******************************************************************************/
+static void serialSignalInit(SerialSignal *signal)
+{
+#ifdef _WIN32
+	signal->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+	pthread_mutex_init(&signal->mutex, NULL);
+	pthread_cond_init(&signal->cond, NULL);
+	signal->signaled = 0;
+#endif
+}
+
+static void serialSignalSet(SerialSignal *signal)
+{
+#ifdef _WIN32
+	SetEvent(signal->event);
+#else
+	pthread_mutex_lock(&signal->mutex);
+	signal->signaled = 1;
+	pthread_cond_signal(&signal->cond);
+	pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+/***************************************************************************//*!
+* \return 1 if the signal was set, 0 on timeout
+*******************************************************************************/
+static int serialSignalWait(SerialSignal *signal, double timeout)
+{
+#ifdef _WIN32
+	return WaitForSingleObject(signal->event, (DWORD) ceil(timeout*1000.0)) == WAIT_OBJECT_0;
+#else
+	struct timespec ts;
+	int signaled = 0;
 	
-	queueLength = GetInQLen(comport);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += (time_t) timeout;
+	ts.tv_nsec += (long) ((timeout - floor(timeout)) * 1e9);
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
 	
-Error:
-	if(error)
-		return error;
-	else
-		return queueLength;
+	pthread_mutex_lock(&signal->mutex);
+	while (!signal->signaled)
+	{
+		if (pthread_cond_timedwait(&signal->cond, &signal->mutex, &ts) == ETIMEDOUT)
+			break;
+	}
+	signaled = signal->signaled;
+	signal->signaled = 0;
+	pthread_mutex_unlock(&signal->mutex);
+	return signaled;
+#endif
 }
 
-int HexToCharInString(char *string)
+static void serialSignalDiscard(SerialSignal *signal)
 {
-	while(strstr(string,"\\0x"))
-	{
-		char temp[512]= {0};
-		strcpy(temp,string);
-		char *tempA = strstr(temp,"\\0x");
-		char newstring[512]= {0};
-		strncpy(newstring,string,strlen(string)-strlen(tempA));
-		char tempB[512]= {0};
-		strncpy(tempB,tempA+3,2);
-		//strcat(string,atoi(tempB));
-		int val = strtol(tempB,NULL,16);
-		sprintf(newstring,"%s%c",newstring,val);
-		strcat(newstring, tempA+5);
-		strcpy(string,newstring);
-	}
-	return 0;
+#ifdef _WIN32
+	CloseHandle(signal->event);
+#else
+	pthread_cond_destroy(&signal->cond);
+	pthread_mutex_destroy(&signal->mutex);
+#endif
 }
 
 /***************************************************************************//*!
-* \brief get library revision
-*
+* \brief Check a handle against the published port table without a lock. The
+* 		 count is read once, the ports below it are complete once it is seen.
+* 		 A device removed after the check is caught by handleLock.
 *******************************************************************************/
-char *getSerialLibRevision (void)
+static int serialHandleValid(int Handle)
 {
-	return SERIALLIBREV;
+	int numPorts = glbNumOfComPorts;
+	
+	SerialMemoryBarrier();
+	return Handle >= 1 && Handle <= numPorts && serialPort(Handle-1)->name[0];
 }
 
-int ReadMotor(char *Motor)
+/***************************************************************************//*!
+* \brief Lock of the port table, taken before any port lock. Created on first
+* 		 use since the configuration can be read before the library is
+* 		 initialized.
+*******************************************************************************/
+static SerialPortLock *serialConfigLock(void)
 {
-	char errmsg[ERRLEN] = {0};
-	libInit;
-	
-	char SmallBuff[256]= {0};
-	char BigBuff[512]= {0};
-	int inqlen=0;
-	int timeout=0;
-	FlushInQ(1);
-	while(1)
+	if (glbSerialConfigLockState != 2)
 	{
-		inqlen = GetInQLenForDeviceName(Motor, errmsg);
-		if(inqlen>0)
-		{
-			memset(SmallBuff,0,sizeof(SmallBuff));
-			ReadSerialDevice(Motor, SmallBuff, inqlen, errmsg);
-			strcat(BigBuff,SmallBuff);
-		}
-		if(strstr(BigBuff,"ACK"))
+		if (SerialCompareExchange(&glbSerialConfigLockState, 0, 1))
 		{
-			break;
+			serialLockInit(&glbSerialConfigLock);
+			SerialMemoryBarrier();
+			glbSerialConfigLockState = 2;
 		}
-		timeout++;
-		if(timeout>100)
+		else
 		{
-			MessagePopup(Motor,"No Response from Motor");
-			return -1;
+			while (glbSerialConfigLockState != 2)
+				SerialMemoryBarrier();
 		}
-		DelayWithEventProcessing(0.1);
 	}
-
-	FlushInQ(1);
-	
-Error:
-	return 0;
+	return &glbSerialConfigLock;
 }
 
 /***************************************************************************//*!
-* \brief Flush the IN queue for the specified serial device COM port
-*
-* \param [in] SerialDeviceName 	Name of device
+* \brief Ticket lock: every caller draws a ticket and waits until it is being
+* 		 served, so waiting threads get the port in arrival order. Recursive
+* 		 for the thread holding it.
 *******************************************************************************/
-int FlushInQDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+static void serialLockInit(SerialPortLock *lock)
 {
-	libInit;
-	
-	int index = 0;
-	int comport = 0;
-	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
-	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
-	
-	libErrChk(FlushInQ(comport), errmsg);
+#ifdef _WIN32
+	InitializeCriticalSection(&lock->cs);
+	InitializeConditionVariable(&lock->cond);
+#else
+	pthread_mutex_init(&lock->mutex, NULL);
+	pthread_cond_init(&lock->cond, NULL);
+#endif
+	lock->nextTicket = 0;
+	lock->nowServing = 0;
+	lock->owner = 0;
+	lock->depth = 0;
+}
+
+static SerialPortLock *serialLockAcquire(SerialPortLock *lock)
+{
+	int self = CmtGetCurrentThreadID();
 	
-Error:
-	return error;
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+	if (lock->depth && lock->owner == self)
+		lock->depth++;
+	else
+	{
+		unsigned int ticket = lock->nextTicket++;
+		while (lock->nowServing != ticket)
+		{
+#ifdef _WIN32
+			SleepConditionVariableCS(&lock->cond, &lock->cs, INFINITE);
+#else
+			pthread_cond_wait(&lock->cond, &lock->mutex);
+#endif
+		}
+		lock->owner = self;
+		lock->depth = 1;
+	}
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
+	return lock;
 }
 
 /***************************************************************************//*!
-* \brief Flush the OUT queue for the specified serial device COM port
-*
-* \param [in] SerialDeviceName 	Name of device
+* \return 0, or -1 if the calling thread does not hold the lock. A null lock
+* 		  is ignored so error paths can release unconditionally.
 *******************************************************************************/
-int FlushOutQDevice(char *SerialDeviceName, char errmsg[ERRLEN])
+static int serialLockRelease(SerialPortLock *lock)
 {
-	libInit;
-	
-	int index = 0;
-	int comport = 0;
-	
-	index = getFileInfoIndexFromName(SerialDeviceName);
-	libErrChk(index < 0 ? -1 : 0, "Serial information for device: %s not available. Ensure config file contains information", SerialDeviceName);
-	
-	comport = atoi(glbSerialFileInfo[index].Comport + 3);
+	int error = 0;
 	
-	libErrChk(FlushOutQ(comport), errmsg);
+	if (!lock)
+		return 0;
 	
-Error:
+#ifdef _WIN32
+	EnterCriticalSection(&lock->cs);
+#else
+	pthread_mutex_lock(&lock->mutex);
+#endif
+	if (!lock->depth || lock->owner != CmtGetCurrentThreadID())
+		error = -1;
+	else if (--lock->depth == 0)
+	{
+		lock->owner = 0;
+		lock->nowServing++;
+#ifdef _WIN32
+		WakeAllConditionVariable(&lock->cond);
+#else
+		pthread_cond_broadcast(&lock->cond);
+#endif
+	}
+#ifdef _WIN32
+	LeaveCriticalSection(&lock->cs);
+#else
+	pthread_mutex_unlock(&lock->mutex);
+#endif
 	return error;
 }
 
+//! \cond
+/// REGION END
+
 /// REGION START CVI Callbacks
 //! \endcond
 
@@ -1121,7 +6647,11 @@ int CVICALLBACK  SaveSerialConfigTableCB (int panel, int control, int event, voi
 		{
 			CVIXMLDiscardDocument(doc);
 		}
-		ReadSerialConfigurationFile(glbPathToSerialConfigFile);
+		// Only ports whose settings changed are touched, added devices are opened
+		// by their drivers as at startup
+		char errmsg[ERRLEN] = {0};
+		if (ReloadSerialConfigurationFile(glbPathToSerialConfigFile, 0, 0, errmsg) < 0)
+			MessagePopup("Error",errmsg);
 		//CreateSerialDebugPanel(MainPanelHandlebk);
 	}
 
@@ -1183,12 +6713,22 @@ int CVICALLBACK  WriteSerialDebugCB (int panel, int control, int event, void *ca
 		GetCtrlVal(glbSerialDebugPanelHandle,glbSerialRingDebugMenuHandle,&index);
 		GetLabelFromIndex (glbSerialDebugPanelHandle, glbSerialRingDebugMenuHandle,index, deviceName);
 		GetCtrlVal (glbSerialDebugPanelHandle, glbWriteBoxHandle, data);
-		HexToCharInString(data);
-		int i = getFileInfoIndexFromName(deviceName);
-		if(glbSerialFileInfo[i].PortOpen==1)
+		
+		// Escapes such as \r or \0x02 are decoded by the template compiler, the box has no arguments to fill slots
+		SerialTemplate *command = 0;
+		if (CompileSerialTemplate(data, &command, errmsg) < 0)
+			reportSerialError(0, -1, "WriteSerialDebug Error", errmsg);
+		else if (GetSerialTemplateSlots(command))
+			reportSerialError(0, -1, "WriteSerialDebug Error", "Write box text can not contain parameter slots, use \\{ for a brace");
+		else
 		{
-			WriteSerialDevice(deviceName, data, errmsg);
+			int i = getFileInfoIndexFromName(deviceName);
+			if(i>=0 && serialPort(i)->desc.portOpen==1)
+			{
+				WriteSerialTemplate(i+1, command, errmsg);
+			}
 		}
+		FreeSerialTemplate(command);
 		ReadSerialDebugCB (0, 0, EVENT_COMMIT, 0, 0, 0);
 	}
 	return 0;
@@ -15,19 +15,251 @@
 //==============================================================================
 // Include files
 
+#include <stdint.h>
 #include "cvidef.h"
 #include "ArxtronToolslib.h"
 
 //==============================================================================
 // Constants
 
-#define MAXNUMOFSERIALPORTS 50
 #define MAXCHARARRAYLENGTH 400
-#define SERIALLIBREV "1.0.1"
+#define MAXDEVICENAMELEN 120
+#define MAXSERIALIOVEC 16
+#define SERIALMAXTERMINATORLEN 8
+#define SERIALERRORMSGLEN 256
+
+#define SERIAL_INIT_HEADLESS	0x01	//! Create the configuration and debug panels on first use
+#define SERIALCRC16INIT			0xFFFF	//! Start value of SerialCrc16Update
+#define SERIALLIBREV "1.8.4"
+
+// Lib specific error codes (-20000 ~ -99998)
+#define ERR_INVALID_SERIAL_HANDLE	-20001
+#define ERR_SERIAL_TIMEOUT			-20002
+#define ERR_SERIAL_TRANSPORT		-20003
+#define ERR_SERIAL_CRC				-20004
 		
 //==============================================================================
 // Types
 
+/***************************************************************************//*!
+* \brief Parity setting, values match the OpenComConfig parity argument
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_PARITY_NONE	= 0,
+	SERIAL_PARITY_ODD	= 1,
+	SERIAL_PARITY_EVEN	= 2,
+	SERIAL_PARITY_MARK	= 3,
+	SERIAL_PARITY_SPACE	= 4
+} SerialParity;
+
+/***************************************************************************//*!
+* \brief Transport used to reach a port, selected by the Comport setting:
+* 		 "COMn" uses the CVI RS-232 library, a device path such as
+* 		 "/dev/ttyUSB0" uses termios and "PTY" creates a pseudo-terminal pair
+* 		 (see GetSerialLoopbackPeer). termios and PTY are POSIX only.
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_TRANSPORT_RS232		= 0,
+	SERIAL_TRANSPORT_TERMIOS	= 1,
+	SERIAL_TRANSPORT_PTY		= 2
+} SerialTransportType;
+
+#define SERIAL_FLOW_CTS			0x01	//! Hardware handshaking (CTSMode On)
+#define SERIAL_FLOW_XONXOFF		0x02	//! Software handshaking (XonXoff On)
+
+/***************************************************************************//*!
+* \brief Port settings decoded once from the configuration file. This is the
+* 		 only form of the settings the I/O functions use.
+*******************************************************************************/
+typedef struct
+{
+	int				comport;		//! COM port number, RS-232 transport only
+	int				baudRate;
+	double			timeout;		//! I/O timeout in seconds
+	unsigned char	parity;			//! #SerialParity
+	unsigned char	dataBits;
+	unsigned char	stopBits;
+	unsigned char	flowControl;	//! SERIAL_FLOW_ flags
+	unsigned char	transport;		//! #SerialTransportType
+	int				portOpen;
+} SerialPortDesc;
+
+/***************************************************************************//*!
+* \brief One buffer of a vectored write
+*******************************************************************************/
+typedef struct
+{
+	const void		*data;
+	int				len;
+} SerialIOVec;
+
+/***************************************************************************//*!
+* \brief How SetSerialFrameRule cuts the byte stream into frames
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_FRAME_TERMINATOR		= 0,	//! Ends with a terminator sequence
+	SERIAL_FRAME_MODBUS_RTU		= 1,	//! Length from function code and byte count, CRC16 trailer
+	SERIAL_FRAME_FIXED			= 2		//! Always the same length
+} SerialFrameType;
+
+typedef struct
+{
+	int				type;										//! #SerialFrameType
+	char			terminator[SERIALMAXTERMINATORLEN];			//! SERIAL_FRAME_TERMINATOR
+	int				terminatorLen;
+	int				length;										//! SERIAL_FRAME_FIXED
+	int				maxLength;									//! Longest terminator frame, 0 for the receive buffer size
+} SerialFrameRule;
+
+/***************************************************************************//*!
+* \brief Complete frame in the receive buffer, valid until released. part[1]
+* 		 is only used when the frame wraps around the end of the buffer.
+*******************************************************************************/
+typedef struct
+{
+	SerialIOVec		part[2];
+	int				len;			//! Whole frame
+	int				dataLen;		//! Without terminator or CRC
+} SerialFrame;
+
+/***************************************************************************//*!
+* \brief Where the time of one SerialTransact call went, in seconds
+*******************************************************************************/
+typedef struct
+{
+	double			queueWait;		//! Waiting for the device lock
+	double			write;			//! Writing the request
+	double			firstByte;		//! From the end of the write to the first reply byte
+	double			lastByte;		//! From the end of the write to the complete reply
+	int				bytesWritten;
+	int				bytesRead;		//! Whole frame, with terminator or CRC
+} SerialTransactStats;
+
+/***************************************************************************//*!
+* \brief SerialTransact totals of a device. Means are over the exchanges
+* 		 that got a reply.
+*******************************************************************************/
+typedef struct
+{
+	int					transactions;
+	int					failed;
+	int					timeouts;
+	SerialTransactStats	mean;
+	SerialTransactStats	max;
+} SerialTransactSummary;
+
+/***************************************************************************//*!
+* \brief Outcome of BroadcastSerialRequest for one device
+*******************************************************************************/
+typedef struct
+{
+	int				handle;
+	int				status;							//! Reply length or negative error code
+	double			elapsed;						//! From the write to the complete reply, seconds
+	int				replyLen;
+	char			reply[MAXCHARARRAYLENGTH];		//! Frame without terminator or CRC
+	char			errmsg[SERIALERRORMSGLEN];
+} SerialBroadcastResult;
+
+/***************************************************************************//*!
+* \brief Command template compiled by CompileSerialTemplate
+*******************************************************************************/
+typedef struct SerialTemplate SerialTemplate;
+
+/***************************************************************************//*!
+* \brief Direction of a captured chunk
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_CAPTURE_TX		= 0,
+	SERIAL_CAPTURE_RX		= 1,
+	SERIAL_CAPTURE_NAME		= 2		//! Device name of a handle, written when the capture starts
+} SerialCaptureDirection;
+
+/***************************************************************************//*!
+* \brief Output of DecodeSerialCapture
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_DECODE_TEXT		= 0,	//! Every chunk as escaped text
+	SERIAL_DECODE_SMC		= 1,	//! Modbus RTU frames with CRC check
+	SERIAL_DECODE_SCPI		= 2		//! CR/LF terminated command and reply lines
+} SerialDecodeFormat;
+
+/***************************************************************************//*!
+* \brief Error reported by an I/O call, see PopSerialErrorEvent
+*******************************************************************************/
+typedef struct
+{
+	double			timestamp;		//! Timer() value when the error was reported
+	int				handle;			//! Device handle, 0 if not tied to a device
+	char			device[MAXDEVICENAMELEN];
+	int				code;
+	char			message[SERIALERRORMSGLEN];
+} SerialErrorEvent;
+
+/***************************************************************************//*!
+* \brief Called on the thread that hit the error, must not block
+*******************************************************************************/
+typedef void (CVICALLBACK *SerialErrorCallback)(const SerialErrorEvent *Event, void *CallbackData);
+
+/***************************************************************************//*!
+* \brief Result of ReloadSerialConfigurationFile, number of devices per outcome
+*******************************************************************************/
+typedef struct
+{
+	int				unchanged;
+	int				reconfigured;	//! Changed without closing the port
+	int				reopened;		//! Open port closed and opened with the new settings
+	int				added;
+	int				removed;
+} SerialReloadSummary;
+
+/***************************************************************************//*!
+* \brief Response latency of a device, see GetSerialLatencyStats. Times in
+* 		 seconds.
+*******************************************************************************/
+typedef struct
+{
+	int				samples;		//! Replies in the histogram, older ones are weighted down
+	int				timeouts;		//! Reads after a write that returned no data
+	double			p50;
+	double			p90;
+	double			p99;
+	double			max;
+	double			timeout;		//! Timeout the next read uses
+} SerialLatencyStats;
+
+/***************************************************************************//*!
+* \brief Kind of device found by ScanSerialPorts
+*******************************************************************************/
+typedef enum
+{
+	SERIAL_SCAN_NONE		= 0,
+	SERIAL_SCAN_SCPI		= 1,	//! Answered *IDN?
+	SERIAL_SCAN_SMC			= 2,	//! Answered the Modbus echo of an SMC controller
+	SERIAL_SCAN_ZEBRA		= 3		//! Answered ~HQES
+} SerialScanDeviceType;
+
+/***************************************************************************//*!
+* \brief Device identified on a port
+*******************************************************************************/
+typedef struct
+{
+	char			port[MAXDEVICENAMELEN];			//! Comport setting, COMn or device path
+	int				baudRate;
+	int				type;							//! #SerialScanDeviceType
+	char			ident[MAXCHARARRAYLENGTH];		//! *IDN? reply or description
+	char			deviceName[MAXDEVICENAMELEN];	//! Name used in the generated configuration
+} SerialScanResult;
+
+/***************************************************************************//*!
+* \brief String form of the port settings, only used to fill the configuration
+* 		 table
+*******************************************************************************/
 typedef struct
 {
 	char   		DeviceName[MAXCHARARRAYLENGTH];
@@ -39,7 +271,6 @@ typedef struct
 	char		CTSMode[MAXCHARARRAYLENGTH];
 	char		XonXoff[MAXCHARARRAYLENGTH];
 	char		Timeout[MAXCHARARRAYLENGTH];
-	int			PortOpen;
 } SerialFileInfoStruct;
 		
 //==============================================================================
@@ -57,7 +288,9 @@ int CVICALLBACK FunctionSelect(int panel, int control, int event, void *callback
 int CVICALLBACK RunFunction(int panel, int control, int event, void *callbackData, int eventData1, int eventData2);
 		
 int InitializeSerialPortLib(char *SerialConfigurationFile, int MainPanelHandle, char errmsg[ERRLEN]);
+int InitializeSerialPortLibEx(char *SerialConfigurationFile, int MainPanelHandle, int Flags, char errmsg[ERRLEN]);
 int ReadSerialConfigurationFile(char *filePath);
+int ReloadSerialConfigurationFile(char *filePath, int OpenAdded, SerialReloadSummary *Summary, char errmsg[ERRLEN]);
 int GetSerialConfigurationPanelHandle(void);
 int GetSerialDebugPanelHandle(void) ;
 
@@ -66,6 +299,7 @@ int CloseSerialDevice (char *SerialDeviceName, char errmsg[ERRLEN]);
 
 int WriteSerialDevice(char *SerialDeviceName, char *data, char errmsg[ERRLEN]);
 int WriteSerialDeviceRaw(char *SerialDeviceName, char *data, int dataLen, char errmsg[ERRLEN]);
+int WriteSerialDeviceV(char *SerialDeviceName, const SerialIOVec *Segments, int NumSegments, char errmsg[ERRLEN]);
 int ReadSerialDevice(char *SerialDeviceName, char *ReadData, int numByteToRead, char errmsg[ERRLEN]);
 int ReadSerialDeviceUntilTermChar(char *SerialDeviceName, char *ReadData, int numByteToRead, int terminationByte, char errmsg[ERRLEN]);
 
@@ -78,6 +312,89 @@ int GetTotalSerialDevices(void);
 int GetDeviceName(int index, char *devName, char errmsg[ERRLEN]);
 int GetInQLenForDeviceName(char *SerialDeviceName, char errmsg[ERRLEN]);
 
+int GetSerialDeviceHandle(char *SerialDeviceName, char errmsg[ERRLEN]);
+int GetSerialHandleSettings(int Handle, SerialPortDesc *Settings, char errmsg[ERRLEN]);
+int OpenSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN]);
+
+int InitSerialHandle(int Handle, char errmsg[ERRLEN]);
+int CloseSerialHandle(int Handle, char errmsg[ERRLEN]);
+
+int WriteSerialHandle(int Handle, char *data, char errmsg[ERRLEN]);
+int WriteSerialHandleRaw(int Handle, char *data, int dataLen, char errmsg[ERRLEN]);
+int WriteSerialHandleV(int Handle, const SerialIOVec *Segments, int NumSegments, char errmsg[ERRLEN]);
+int ReadSerialHandle(int Handle, char *ReadData, int numByteToRead, char errmsg[ERRLEN]);
+int ReadSerialHandleUntilTermChar(int Handle, char *ReadData, int numByteToRead, int terminationByte, char errmsg[ERRLEN]);
+
+int FlushInQHandle(int Handle, char errmsg[ERRLEN]);
+int FlushOutQHandle(int Handle, char errmsg[ERRLEN]);
+int GetInQLenForHandle(int Handle, char errmsg[ERRLEN]);
+
+int StartSerialRxEngine(int Handle, int BufferSize, char errmsg[ERRLEN]);
+int StopSerialRxEngine(int Handle, char errmsg[ERRLEN]);
+int ReadSerialRx(int Handle, char *ReadData, int numByteToRead, double Deadline, char errmsg[ERRLEN]);
+
+int WaitForBytes(int Handle, int numBytes, double Deadline, double *WaitTime, char errmsg[ERRLEN]);
+int WaitForPattern(int Handle, char *Pattern, int PatternLen, double Deadline, double *WaitTime, char errmsg[ERRLEN]);
+
+int SetSerialFrameRule(int Handle, const SerialFrameRule *Rule, char errmsg[ERRLEN]);
+int GetSerialFrame(int Handle, SerialFrame *Frame, double Deadline, char errmsg[ERRLEN]);
+int ReleaseSerialFrame(int Handle, char errmsg[ERRLEN]);
+int GetSerialFrameErrors(int Handle, unsigned int *Dropped, unsigned int *CrcErrors, char errmsg[ERRLEN]);
+int CopySerialFrame(const SerialFrame *Frame, char *Buffer, int BufferLen);
+
+int CompileSerialTemplate(const char *Template, SerialTemplate **Compiled, char errmsg[ERRLEN]);
+void FreeSerialTemplate(SerialTemplate *Template);
+int GetSerialTemplateSlots(const SerialTemplate *Template);
+int RenderSerialTemplate(const SerialTemplate *Template, char *Buffer, int BufferLen, char errmsg[ERRLEN], ...);
+int WriteSerialTemplate(int Handle, const SerialTemplate *Template, char errmsg[ERRLEN], ...);
+
+int SerialTransact(int Handle, const char *Request, int RequestLen, const SerialFrameRule *Rule, double Deadline,
+				   char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN]);
+int SerialTransactV(int Handle, const SerialIOVec *Segments, int NumSegments, const SerialFrameRule *Rule, double Deadline,
+					char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN]);
+int SerialTransactTimeout(int Handle, const char *Request, int RequestLen, const SerialFrameRule *Rule, double Timeout,
+						  char *Reply, int ReplyLen, SerialTransactStats *Stats, char errmsg[ERRLEN]);
+int GetSerialTransactSummary(int Handle, SerialTransactSummary *Summary, char errmsg[ERRLEN]);
+int ResetSerialTransactStats(int Handle, char errmsg[ERRLEN]);
+int DumpSerialTransactStats(char *FilePath, char errmsg[ERRLEN]);
+
+int BroadcastSerialRequest(const int *Handles, int NumHandles, const char *Request, int RequestLen, const SerialFrameRule *Rule,
+						   double Timeout, SerialBroadcastResult *Results, char errmsg[ERRLEN]);
+
+int SetSerialPipelineMode(int Handle, int Enable, char errmsg[ERRLEN]);
+int GetSerialPipelineMode(int Handle, char errmsg[ERRLEN]);
+int SubmitSerialRequest(int Handle, char *Request, int RequestLen, int TerminationByte, int *Tag, char errmsg[ERRLEN]);
+int CollectSerialReply(int Handle, int *Tag, char *Reply, int ReplyLen, double Deadline, char errmsg[ERRLEN]);
+int GetSerialRequestsOutstanding(int Handle, char errmsg[ERRLEN]);
+
+int SetSerialAdaptiveTimeout(int Handle, int Enable, double SafetyFactor, double Floor, double Ceiling, char errmsg[ERRLEN]);
+int GetSerialTimeout(int Handle, double *Timeout, char errmsg[ERRLEN]);
+int GetSerialLatencyStats(int Handle, SerialLatencyStats *Stats, char errmsg[ERRLEN]);
+
+int LockSerialHandle(int Handle, char errmsg[ERRLEN]);
+int UnlockSerialHandle(int Handle, char errmsg[ERRLEN]);
+int LockSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN]);
+int UnlockSerialDevice(char *SerialDeviceName, char errmsg[ERRLEN]);
+
+int GetSerialLoopbackPeer(int Handle, char errmsg[ERRLEN]);
+
+int ScanSerialPorts(char *OutputFile, char *Ports, double ProbeTimeout, SerialScanResult *Results, int MaxResults, char errmsg[ERRLEN]);
+int ScanSerialPortsEx(char *OutputFile, char *Ports, double ProbeTimeout, int SMCFirstAddress, int SMCLastAddress,
+					  SerialScanResult *Results, int MaxResults, char errmsg[ERRLEN]);
+
+int SetSerialUIDebugMode(int Enable);
+void SetSerialErrorCallback(SerialErrorCallback Callback, void *CallbackData);
+int PopSerialErrorEvent(SerialErrorEvent *Event);
+unsigned int GetSerialErrorsDropped(void);
+
+int StartSerialCapture(char *FilePath, int RingSize, char errmsg[ERRLEN]);
+int StopSerialCapture(char errmsg[ERRLEN]);
+unsigned int GetSerialCaptureDropped(void);
+int DecodeSerialCapture(char *CaptureFile, char *OutputFile, int Format, char errmsg[ERRLEN]);
+
+uint16_t SerialCrc16Update(uint16_t Crc, const uint8_t *Data, int Len);
+int SerialCrc16Benchmark(int FrameLen, int Iterations, double NsPerFrame[3], char errmsg[ERRLEN]);
+
 #ifdef __cplusplus
 	}
 #endif
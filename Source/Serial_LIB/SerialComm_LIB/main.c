@@ -25,6 +25,13 @@
 //==============================================================================
 // Include files
 
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <unistd.h>
+	#include <poll.h>
+	#include <sys/resource.h>
+#endif
 #include "SerialComm_LIB.h"
 #include <formatio.h>
 #include <ansi_c.h>
@@ -34,6 +41,7 @@
 #include "GUIToolsLib.h"
 #include "DebugToolsLib.h"
 #include <string.h>
+#include <utility.h>
 
 //==============================================================================
 // Constants
@@ -51,9 +59,30 @@
 #define MAX_FUNCTIONS 100
 #define MAX_PARAMETERS 16
 
+#define STRESSMAXNESTS 8
+
+#define BENCHMAXDEVICES 8
+#define BENCHMAXSAMPLES 100000
+
+#define SELFTESTCONFIG "SerialSelfTest.xml"
+
 //==============================================================================
 // Types
 
+typedef struct
+{
+	int		nest;
+	int		handle;
+	int		count;		// Transactions completed
+	int		errors;		// Replies that did not match the request
+} StressNest;
+
+typedef struct
+{
+	int		peer;		// Simulated device end of a PTY pair
+	double	charTime;	// Seconds per character at the device baud rate, 0 to answer at once
+} EchoDevice;
+
 //==============================================================================
 // Static global variables
 
@@ -74,6 +103,14 @@ static char glbLogParamFormat[1024] = {0};
 static char glbLogParam[1024] = {0};
 static char *glbTok = 0;
 
+// Stress benchmark
+static volatile int glbStressRunning = 0;
+static volatile int glbEchoRunning = 0;
+
+// Self test
+static int glbChecksRun = 0;
+static int glbChecksFailed = 0;
+
 // Vars for Storing Function Parameters
 static __int64  glbFunctionDebugParamTypes[MAX_FUNCTIONS][2];
 static char glbFunctionParameters[MAX_FUNCTIONS][100];
@@ -89,6 +126,11 @@ static void usage (char *name)
 	fprintf (stderr, "Order of operation: Change based on library\n");
 	fprintf (stderr, "flag: function 1\n");
 	fprintf (stderr, "flag: function 2\n");
+	fprintf (stderr, "-stress <config> <seconds>: transaction throughput for 1-%d nests on independent and shared ports\n", STRESSMAXNESTS);
+	fprintf (stderr, "-bench <config> <output.json> [transactions]: PTY round trip latency, throughput and CPU per baud rate, frame size and read strategy\n");
+	fprintf (stderr, "-decode <capture> <text|smc|scpi> [output]: decode a wire capture file from StartSerialCapture\n");
+	fprintf (stderr, "-scan <output.xml> [port,port,...]: identify the instruments on all (or the listed) ports and write a configuration file\n");
+	fprintf (stderr, "-test: automated checks of templates, CRC, configuration cache, framing and transactions on PTY devices\n");
 	exit (1);
 }
 
@@ -121,6 +163,585 @@ int CVICALLBACK QuitUICB(int panel, int event, void *callbackData, int eventData
 //! \cond
 /// REGION END
 
+/// REGION START Stress Benchmark
+//! \endcond
+/***************************************************************************//*!
+* \brief Echoes everything a simulated device receives back to the library,
+* 		 one thread per PTY device. With a charTime the echo is held back as
+* 		 long as the request and the reply would take on a real line.
+*******************************************************************************/
+static int CVICALLBACK EchoThread (void *functionData)
+{
+#ifndef _WIN32
+	EchoDevice *echo = (EchoDevice*) functionData;
+	char buffer[1024];
+	
+	while (glbEchoRunning)
+	{
+		struct pollfd pfd = {echo->peer, POLLIN, 0};
+		if (poll(&pfd, 1, 50) <= 0)
+			continue;
+		ssize_t count = read(echo->peer, buffer, sizeof(buffer));
+		if (count <= 0)
+			continue;
+		if (echo->charTime > 0)
+			usleep((useconds_t) (2.0 * (double) count * echo->charTime * 1e6));
+		write(echo->peer, buffer, (size_t) count);
+	}
+#endif
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief One test nest: locked write-then-read transactions until stopped
+*******************************************************************************/
+static int CVICALLBACK StressNestThread (void *functionData)
+{
+	StressNest *nest = (StressNest*) functionData;
+	char errmsg[ERRLEN] = {0};
+	char request[32] = {0};
+	char reply[32] = {0};
+	
+	while (glbStressRunning)
+	{
+		int len = sprintf(request, "N%dT%d\r", nest->nest, nest->count);
+		
+		// The transaction lock keeps the reply with its request when nests share a port
+		LockSerialHandle(nest->handle, errmsg);
+		WriteSerialHandleRaw(nest->handle, request, len, errmsg);
+		int replyLen = ReadSerialHandleUntilTermChar(nest->handle, reply, sizeof(reply), 13, errmsg);
+		UnlockSerialHandle(nest->handle, errmsg);
+		
+		if (replyLen == len-1 && !strncmp(reply, request, (size_t) replyLen))
+			nest->count++;
+		else
+			nest->errors++;
+	}
+	return 0;
+}
+
+/***************************************************************************//*!
+* \brief Run the nests for a while, either each on its own device or all on
+* 		 the first device, and print throughput and fairness
+*******************************************************************************/
+static void RunStressPass (int NumNests, int Shared, double Seconds)
+{
+	StressNest nests[STRESSMAXNESTS] = {0};
+	int threadIDs[STRESSMAXNESTS] = {0};
+	int total = 0, minCount = 0, maxCount = 0, errors = 0;
+	
+	glbStressRunning = 1;
+	for (int i=0; i<NumNests; i++)
+	{
+		nests[i].nest = i+1;
+		nests[i].handle = Shared ? 1 : i+1;
+		CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, StressNestThread, &nests[i], &threadIDs[i]);
+	}
+	Delay(Seconds);
+	glbStressRunning = 0;
+	
+	for (int i=0; i<NumNests; i++)
+	{
+		CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, threadIDs[i], 0);
+		CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, threadIDs[i]);
+		total += nests[i].count;
+		errors += nests[i].errors;
+		if (!i || nests[i].count < minCount)
+			minCount = nests[i].count;
+		if (nests[i].count > maxCount)
+			maxCount = nests[i].count;
+	}
+	
+	printf("%-11s %5d %12.0f %10d %10d %8d\n", Shared ? "shared" : "independent", NumNests, total/Seconds, minCount, maxCount, errors);
+}
+
+/***************************************************************************//*!
+* \brief Stress benchmark: throughput of locked transactions for 1, 2, 4...
+* 		 nests, on independent ports and on one shared port
+* 
+* Devices in the configuration file need to echo what they receive, PTY
+* devices get an echo thread, physical ports need a loopback plug.
+* 
+* \param [in] ConfigFile 			Configuration file with the test devices
+* \param [in] Seconds 				Duration of each pass
+*******************************************************************************/
+static int RunStressBenchmark (char *ConfigFile, double Seconds, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	int echoIDs[STRESSMAXNESTS] = {0};
+	EchoDevice echoes[STRESSMAXNESTS] = {0};
+	int numDevices = ReadSerialConfigurationFile(ConfigFile);
+	tsErrChk(numDevices < 1 ? -1 : 0, "No devices found in %s", ConfigFile);
+	if (numDevices > STRESSMAXNESTS)
+		numDevices = STRESSMAXNESTS;
+	
+	glbEchoRunning = 1;
+	for (int i=0; i<numDevices; i++)
+	{
+		tsErrChk(InitSerialHandle(i+1, errmsg), errmsg);
+		echoes[i].peer = GetSerialLoopbackPeer(i+1, errmsg);
+		if (echoes[i].peer >= 0)
+			CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, EchoThread, &echoes[i], &echoIDs[i]);
+	}
+	
+	printf("%-11s %5s %12s %10s %10s %8s\n", "mode", "nests", "trans/s", "min/nest", "max/nest", "errors");
+	for (int nests=1; nests<=numDevices; nests*=2)
+		RunStressPass(nests, 0, Seconds);
+	for (int nests=1; nests<=numDevices; nests*=2)
+		RunStressPass(nests, 1, Seconds);
+	error = 0;
+	
+Error:
+	glbEchoRunning = 0;
+	for (int i=0; i<numDevices; i++)
+	{
+		if (echoIDs[i])
+		{
+			CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, echoIDs[i], 0);
+			CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, echoIDs[i]);
+		}
+		CloseSerialHandle(i+1, errmsg);
+	}
+	return error;
+}
+//! \cond
+/// REGION END
+
+/// REGION START Benchmark
+//! \endcond
+/***************************************************************************//*!
+* \brief CPU time used by the process so far, in seconds
+*******************************************************************************/
+static double ProcessCPUTime (void)
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+	return ((double) kernel.dwLowDateTime + (double) kernel.dwHighDateTime * 4294967296.0
+			+ (double) user.dwLowDateTime + (double) user.dwHighDateTime * 4294967296.0) * 1e-7;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec * 1e-6
+		   + (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+static int CompareDoubles (const void *a, const void *b)
+{
+	double diff = *(const double*) a - *(const double*) b;
+	return diff < 0 ? -1 : diff > 0;
+}
+
+/***************************************************************************//*!
+* \brief Round trips of one frame size and read strategy on one device
+* 
+* Runs Transactions round trips or until Budget seconds are spent, whichever
+* comes first, and appends the result to the JSON file.
+*******************************************************************************/
+static int BenchCell (FILE *Json, int First, char *DeviceName, int BaudRate, int FrameSize, const char *Strategy,
+					  int Transactions, double Budget, double *Samples, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	char request[1024] = {0};
+	char reply[1024] = {0};
+	int count = 0;
+	int handle = GetSerialDeviceHandle(DeviceName, errmsg);
+	tsErrChk(handle < 0 ? handle : 0, errmsg);
+	
+	// Printable payload ending in the terminator
+	for (int i=0; i<FrameSize-1; i++)
+		request[i] = (char) ('A' + i%26);
+	request[FrameSize-1] = '\r';
+	
+	if (!strcmp(Strategy, "ring"))
+		tsErrChk(StartSerialRxEngine(handle, 0, errmsg), errmsg);
+	
+	double cpuStart = ProcessCPUTime();
+	double start = Timer();
+	while (count < Transactions && Timer() - start < Budget)
+	{
+		double sent = Timer();
+		tsErrChk(WriteSerialDeviceRaw(DeviceName, request, FrameSize, errmsg) != FrameSize ? -1 : 0, "Write failed on %s: %s", DeviceName, errmsg);
+		
+		int replyLen = 0;
+		if (!strcmp(Strategy, "polling"))
+		{
+			// Spin on the queue length, then read what is known to be there
+			while (GetInQLenForDeviceName(DeviceName, errmsg) < FrameSize)
+				tsErrChk(Timer() - sent > 5.0 ? -1 : 0, "Polling timed out on %s", DeviceName);
+			replyLen = ReadSerialDevice(DeviceName, reply, FrameSize, errmsg);
+		}
+		else
+			replyLen = ReadSerialDeviceUntilTermChar(DeviceName, reply, FrameSize, 13, errmsg) + 1;
+		
+		tsErrChk(replyLen != FrameSize || memcmp(reply, request, (size_t) FrameSize-1) ? -1 : 0,
+				 "%s reply on %s: %d of %d bytes", Strategy, DeviceName, replyLen, FrameSize);
+		Samples[count++] = Timer() - sent;
+	}
+	double elapsed = Timer() - start;
+	double cpu = ProcessCPUTime() - cpuStart;
+	
+	qsort(Samples, (size_t) count, sizeof(double), CompareDoubles);
+	#define percentile(p) (Samples[(int) ceil((p) * count) - 1] * 1e6)
+	fprintf(Json, "%s\n    {\"device\": \"%s\", \"baud\": %d, \"frame\": %d, \"strategy\": \"%s\", \"transactions\": %d, "
+			"\"bytes_per_s\": %.0f, \"rtt_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, \"cpu_us_per_transaction\": %.1f}",
+			First ? "" : ",", DeviceName, BaudRate, FrameSize, Strategy, count,
+			FrameSize * count / elapsed, percentile(0.5), percentile(0.99), percentile(0.999), cpu / count * 1e6);
+	#undef percentile
+	
+Error:
+	if (handle > 0)
+		StopSerialRxEngine(handle, errmsg);
+	return error;
+}
+
+/***************************************************************************//*!
+* \brief Latency and throughput benchmark over PTY devices
+* 
+* Every PTY device of the configuration file is one baud rate of the matrix,
+* its simulated device echoes each frame after the time the request and the
+* reply would take on the wire at that rate. Each device is measured for
+* frames of 8, 64 and 512 bytes with three read strategies: polling the queue
+* length, blocking ReadSerialDeviceUntilTermChar, and the same call served by
+* the receive engine ring. CPU time is for the whole process, so it includes
+* the simulated devices.
+* 
+* \param [in] ConfigFile 			Configuration file with PTY devices
+* \param [in] JsonFile 				Result file
+* \param [in] Transactions 			Round trips per cell, each cell also stops after 2 s
+*******************************************************************************/
+static int RunBenchmark (char *ConfigFile, char *JsonFile, int Transactions, char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	const int frameSizes[] = {8, 64, 512};
+	const char *strategies[] = {"polling", "blocking", "ring"};
+	int echoIDs[BENCHMAXDEVICES] = {0};
+	EchoDevice echoes[BENCHMAXDEVICES] = {0};
+	double *samples = 0;
+	FILE *json = 0;
+	int first = 1;
+	
+	if (Transactions < 1 || Transactions > BENCHMAXSAMPLES)
+		Transactions = 1000;
+	int numDevices = ReadSerialConfigurationFile(ConfigFile);
+	tsErrChk(numDevices < 1 ? -1 : 0, "No devices found in %s", ConfigFile);
+	if (numDevices > BENCHMAXDEVICES)
+		numDevices = BENCHMAXDEVICES;
+	samples = malloc(sizeof(double) * (size_t) Transactions);
+	json = fopen(JsonFile, "w");
+	tsErrChk(samples && json ? 0 : -1, "Unable to create %s", JsonFile);
+	fprintf(json, "{\n  \"library\": \"%s\",\n  \"results\": [", getSerialLibRevision());
+	
+	glbEchoRunning = 1;
+	for (int i=0; i<numDevices; i++)
+	{
+		SerialPortDesc settings = {0};
+		tsErrChk(InitSerialHandle(i+1, errmsg), errmsg);
+		GetSerialHandleSettings(i+1, &settings, errmsg);
+		echoes[i].peer = GetSerialLoopbackPeer(i+1, errmsg);
+		tsErrChk(echoes[i].peer < 0 ? -1 : 0, "Benchmark devices must use Comport PTY: %s", errmsg);
+		echoes[i].charTime = (1 + settings.dataBits + settings.stopBits + (settings.parity ? 1 : 0)) / (double) settings.baudRate;
+		CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, EchoThread, &echoes[i], &echoIDs[i]);
+	}
+	
+	for (int i=0; i<numDevices; i++)
+	{
+		char deviceName[MAXDEVICENAMELEN] = {0};
+		SerialPortDesc settings = {0};
+		GetDeviceName(i+1, deviceName, errmsg);
+		GetSerialHandleSettings(i+1, &settings, errmsg);
+		for (int f=0; f<3; f++)
+			for (int s=0; s<3; s++)
+			{
+				tsErrChk(BenchCell(json, first, deviceName, settings.baudRate, frameSizes[f], strategies[s], Transactions, 2.0, samples, errmsg), errmsg);
+				first = 0;
+				fprintf(stderr, "%s %d bytes %s done\n", deviceName, frameSizes[f], strategies[s]);
+			}
+	}
+	fprintf(json, "\n  ]\n}\n");
+	
+Error:
+	glbEchoRunning = 0;
+	for (int i=0; i<numDevices; i++)
+	{
+		if (echoIDs[i])
+		{
+			CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, echoIDs[i], 0);
+			CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, echoIDs[i]);
+		}
+		CloseSerialHandle(i+1, errmsg);
+	}
+	if (json)
+		fclose(json);
+	free(samples);
+	return error;
+}
+//! \cond
+/// REGION END
+
+/// REGION START Self Test
+//! \endcond
+/***************************************************************************//*!
+* \brief Count and print the result of one check
+*******************************************************************************/
+static void Check (int Passed, const char *Name)
+{
+	glbChecksRun++;
+	if (!Passed)
+		glbChecksFailed++;
+	printf("%s %s\n", Passed ? "PASS" : "FAIL", Name);
+}
+
+/***************************************************************************//*!
+* \brief Write the self test configuration, a frame device and an echo device
+*******************************************************************************/
+static int WriteSelfTestConfig (const char *EchoName)
+{
+	const char *names[2] = {"SelfTestFrames", EchoName};
+	FILE *file = fopen(SELFTESTCONFIG, "w");
+	
+	if (!file)
+		return -1;
+	fprintf(file, "<?xml version=\"1.0\"?>\n<SerialHW>\n");
+	for (int i=0; i<2; i++)
+		fprintf(file, "<Serial>\n<DeviceName>%s</DeviceName>\n<Comport>PTY</Comport>\n<BaudRate>115200</BaudRate>\n"
+				"<Parity>None</Parity>\n<DataBits>8</DataBits>\n<StopBits>1</StopBits>\n<CTSMode>Off</CTSMode>\n"
+				"<XonXoff>Off</XonXoff>\n<Timeout>2</Timeout>\n</Serial>\n", names[i]);
+	fprintf(file, "</SerialHW>\n");
+	return fclose(file) ? -1 : 0;
+}
+
+/***************************************************************************//*!
+* \brief Replace the first occurence of a string in a file by one of the same
+* 		 length
+*
+* \return 1 if it was replaced, 0 if not found or negative error code
+*******************************************************************************/
+static int PatchFile (const char *FilePath, const char *Find, const char *Replace)
+{
+	char buffer[65536];
+	size_t len = strlen(Find);
+	int found = 0;
+	FILE *file = fopen(FilePath, "r+b");
+	
+	if (!file)
+		return -1;
+	size_t size = fread(buffer, 1, sizeof(buffer), file);
+	for (size_t i=0; i+len<=size && !found; i++)
+		if (!memcmp(buffer+i, Find, len))
+		{
+			fseek(file, (long) i, SEEK_SET);
+			fwrite(Replace, 1, len, file);
+			found = 1;
+		}
+	fclose(file);
+	return found;
+}
+
+/***************************************************************************//*!
+* \brief Checks that need no device
+*******************************************************************************/
+static void CheckPureFunctions (void)
+{
+	char errmsg[ERRLEN] = {0};
+	char rendered[64] = {0};
+	SerialTemplate *compiled = 0;
+	
+	Check(SerialCrc16Update(SERIALCRC16INIT, (const uint8_t*) "123456789", 9) == 0x4B37, "CRC16 Modbus check value of \"123456789\" is 0x4B37");
+	
+	int status = CompileSerialTemplate("V{d3},{f2}\\0x00X\\r", &compiled, errmsg);
+	int len = status ? status : RenderSerialTemplate(compiled, rendered, sizeof(rendered), errmsg, 7, 2.5);
+	Check(len == 12 && !memcmp(rendered, "V007,2.50\0X\r", 12), "Template {d3}, {f2} and \\0x00 render \"V007,2.50\\0X\\r\"");
+	FreeSerialTemplate(compiled);
+}
+
+/***************************************************************************//*!
+* \brief The configuration cache is used while the XML is unchanged and
+* 		 rebuilt once it is edited. The echo device is named SelfTestEcho
+* 		 afterwards.
+*******************************************************************************/
+static void CheckConfigCache (void)
+{
+	char cachePath[MAX_PATHNAME_LEN] = {0};
+	char errmsg[ERRLEN] = {0};
+	char name[MAXDEVICENAMELEN] = {0};
+	
+	sprintf(cachePath, "%s.cache", SELFTESTCONFIG);
+	remove(cachePath);
+	
+	// A different name first, so the edit below changes the file
+	WriteSelfTestConfig("SelfTestEchx");
+	Check(ReadSerialConfigurationFile(SELFTESTCONFIG) == 2 && FileExists(cachePath, 0), "Configuration read and cache written");
+	
+	// A name only in the cache shows the cache was loaded instead of the XML
+	Check(PatchFile(cachePath, "SelfTestEchx", "SelfTestEchy") == 1, "Cache holds the device names");
+	ReadSerialConfigurationFile(SELFTESTCONFIG);
+	GetDeviceName(2, name, errmsg);
+	Check(!strcmp(name, "SelfTestEchy"), "Unchanged configuration is loaded from the cache");
+	
+	WriteSelfTestConfig("SelfTestEcho");
+	ReadSerialConfigurationFile(SELFTESTCONFIG);
+	GetDeviceName(2, name, errmsg);
+	Check(!strcmp(name, "SelfTestEcho"), "Edited configuration invalidates the cache");
+}
+
+#ifndef _WIN32
+/***************************************************************************//*!
+* \brief Send bytes from the simulated device end of a PTY
+*******************************************************************************/
+static void PeerSend (int Peer, const void *Data, int Len)
+{
+	const char *data = Data;
+	
+	while (Len > 0)
+	{
+		ssize_t count = write(Peer, data, (size_t) Len);
+		if (count < 0)
+			return;
+		data += count;
+		Len -= (int) count;
+	}
+}
+
+/***************************************************************************//*!
+* \brief Send a Modbus frame with its CRC and check the length the framer
+* 		 cuts
+*******************************************************************************/
+static void CheckModbusFrame (int Handle, int Peer, const unsigned char *Data, int Len, const char *Name)
+{
+	char errmsg[ERRLEN] = {0};
+	unsigned char frame[64];
+	SerialFrame received = {0};
+	
+	memcpy(frame, Data, (size_t) Len);
+	uint16_t crc = SerialCrc16Update(SERIALCRC16INIT, frame, Len);
+	frame[Len] = (unsigned char) (crc & 0xFF);
+	frame[Len+1] = (unsigned char) (crc >> 8);
+	PeerSend(Peer, frame, Len+2);
+	Check(GetSerialFrame(Handle, &received, Timer() + 2.0, errmsg) == Len+2 && received.dataLen == Len, Name);
+	ReleaseSerialFrame(Handle, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Framing on the receive engine: a terminator frame split across the
+* 		 end of the ring and Modbus lengths per function code
+*******************************************************************************/
+static void CheckFraming (int Handle, int Peer)
+{
+	char errmsg[ERRLEN] = {0};
+	char copy[32] = {0};
+	char *filler = 0;
+	SerialFrame frame = {0};
+	SerialFrameRule terminator = {SERIAL_FRAME_TERMINATOR, "\r\n", 2, 0, 0};
+	SerialFrameRule modbus = {SERIAL_FRAME_MODBUS_RTU};
+	unsigned int dropped = 0, crcErrors = 0;
+	const int ringSize = 4096;
+	
+	StartSerialRxEngine(Handle, ringSize, errmsg);
+	Check(!SetSerialFrameRule(Handle, &terminator, errmsg), "Terminator rule set on the receive engine");
+	
+	// The filler ends 8 bytes before the end of the ring, the next frame puts "\r" last and "\n" first
+	filler = malloc(ringSize - 8);
+	memset(filler, 'x', ringSize - 10);
+	memcpy(filler + ringSize - 10, "\r\n", 2);
+	PeerSend(Peer, filler, ringSize - 8);
+	free(filler);
+	Check(GetSerialFrame(Handle, &frame, Timer() + 2.0, errmsg) == ringSize - 8, "Frame filling the ring");
+	ReleaseSerialFrame(Handle, errmsg);
+	
+	PeerSend(Peer, "WRAPPED\r\n", 9);
+	int len = GetSerialFrame(Handle, &frame, Timer() + 2.0, errmsg);
+	Check(len == 9 && frame.dataLen == 7 && frame.part[0].len == 8 && frame.part[1].len == 1
+		  && CopySerialFrame(&frame, copy, sizeof(copy)) == 9 && !memcmp(copy, "WRAPPED\r\n", 9),
+		  "Frame with its terminator split across the end of the ring");
+	ReleaseSerialFrame(Handle, errmsg);
+	
+	Check(!SetSerialFrameRule(Handle, &modbus, errmsg), "Modbus rule set on the receive engine");
+	CheckModbusFrame(Handle, Peer, (const unsigned char[]) {0x01, 0x03, 0x04, 0x00, 0x0A, 0x00, 0x0B}, 7, "Modbus 0x03 length from the byte count");
+	CheckModbusFrame(Handle, Peer, (const unsigned char[]) {0x01, 0x06, 0x00, 0x01, 0x00, 0x02}, 6, "Modbus 0x06 echo length");
+	CheckModbusFrame(Handle, Peer, (const unsigned char[]) {0x01, 0x08, 0x00, 0x00, 0x12, 0x34}, 6, "Modbus 0x08 diagnostics length");
+	CheckModbusFrame(Handle, Peer, (const unsigned char[]) {0x01, 0x10, 0x00, 0x01, 0x00, 0x02}, 6, "Modbus 0x10 reply length");
+	CheckModbusFrame(Handle, Peer, (const unsigned char[]) {0x01, 0x83, 0x02}, 3, "Modbus exception length");
+	GetSerialFrameErrors(Handle, &dropped, &crcErrors, errmsg);
+	Check(!dropped && !crcErrors, "No bytes dropped while framing");
+	
+	SetSerialFrameRule(Handle, 0, errmsg);
+	StopSerialRxEngine(Handle, errmsg);
+}
+
+/***************************************************************************//*!
+* \brief Transactions in a row without receive engine, each on its own
+* 		 pumped ring, like the PSU queries
+*******************************************************************************/
+static void CheckTransactions (int Handle)
+{
+	char errmsg[ERRLEN] = {0};
+	char reply[32] = {0};
+	SerialFrameRule rule = {SERIAL_FRAME_TERMINATOR, "\r", 1, 0, 0};
+	
+	int len = SerialTransactTimeout(Handle, "PING1\r", 6, &rule, 2.0, reply, sizeof(reply), 0, errmsg);
+	Check(len == 5 && !strcmp(reply, "PING1"), "First transaction on a PTY echo");
+	len = SerialTransactTimeout(Handle, "PING2\r", 6, &rule, 2.0, reply, sizeof(reply), 0, errmsg);
+	Check(len == 5 && !strcmp(reply, "PING2"), "Second transaction in a row on a PTY echo");
+}
+#endif
+
+/***************************************************************************//*!
+* \brief Automated checks, PASS or FAIL is printed for each. Writes and
+* 		 reads SELFTESTCONFIG in the current directory, which replaces the
+* 		 loaded configuration.
+*
+* \return 0 if every check passed
+*******************************************************************************/
+static int RunSelfTest (char errmsg[ERRLEN])
+{
+	fnInit;
+	
+	int echoID = 0;
+	EchoDevice echo = {-1, 0};
+	
+	glbChecksRun = 0;
+	glbChecksFailed = 0;
+	CheckPureFunctions();
+	CheckConfigCache();
+	
+#ifndef _WIN32
+	tsErrChk(InitSerialHandle(1, errmsg), errmsg);
+	int peer = GetSerialLoopbackPeer(1, errmsg);
+	tsErrChk(peer < 0 ? peer : 0, errmsg);
+	CheckFraming(1, peer);
+	
+	tsErrChk(InitSerialHandle(2, errmsg), errmsg);
+	echo.peer = GetSerialLoopbackPeer(2, errmsg);
+	tsErrChk(echo.peer < 0 ? echo.peer : 0, errmsg);
+	glbEchoRunning = 1;
+	CmtScheduleThreadPoolFunction(DEFAULT_THREAD_POOL_HANDLE, EchoThread, &echo, &echoID);
+	CheckTransactions(2);
+#else
+	printf("PTY checks skipped, PTY devices are not available on Windows\n");
+#endif
+	
+	printf("%d of %d checks passed\n", glbChecksRun - glbChecksFailed, glbChecksRun);
+	tsErrChk(glbChecksFailed ? -1 : 0, "%d of %d checks failed", glbChecksFailed, glbChecksRun);
+	
+Error:
+	glbEchoRunning = 0;
+	if (echoID)
+	{
+		CmtWaitForThreadPoolFunctionCompletion(DEFAULT_THREAD_POOL_HANDLE, echoID, 0);
+		CmtReleaseThreadPoolFunctionID(DEFAULT_THREAD_POOL_HANDLE, echoID);
+	}
+	CloseSerialHandle(1, errmsg);
+	CloseSerialHandle(2, errmsg);
+	return error;
+}
+//! \cond
+/// REGION END
+
 /// REGION START UI Callbacks
 //! \endcond
 /***************************************************************************//*!
@@ -292,6 +913,41 @@ int main (int argc, char *argv[])
 		{
 			// Call to some function(s), other setup, etc.
 		}
+		else if(!strcmp(argv[i], "-stress") && i+2 < argc)
+		{
+			tsErrChk(RunStressBenchmark(argv[i+1], atof(argv[i+2]), errmsg), errmsg);
+			i += 2;
+		}
+		else if(!strcmp(argv[i], "-bench") && i+2 < argc)
+		{
+			int transactions = i+3 < argc && argv[i+3][0] != '-' ? atoi(argv[i+3]) : 0;
+			tsErrChk(RunBenchmark(argv[i+1], argv[i+2], transactions, errmsg), errmsg);
+			i += transactions ? 3 : 2;
+		}
+		else if(!strcmp(argv[i], "-decode") && i+2 < argc)
+		{
+			int format = !strcmp(argv[i+2], "smc") ? SERIAL_DECODE_SMC : !strcmp(argv[i+2], "scpi") ? SERIAL_DECODE_SCPI : SERIAL_DECODE_TEXT;
+			char *output = i+3 < argc && argv[i+3][0] != '-' ? argv[i+3] : 0;
+			int records = DecodeSerialCapture(argv[i+1], output, format, errmsg);
+			tsErrChk(records < 0 ? records : 0, errmsg);
+			fprintf (stderr, "Decoded %d records\n", records);
+			i += output ? 3 : 2;
+		}
+		else if(!strcmp(argv[i], "-test"))
+		{
+			tsErrChk(RunSelfTest(errmsg), errmsg);
+		}
+		else if(!strcmp(argv[i], "-scan") && i+1 < argc)
+		{
+			SerialScanResult results[64];
+			char *ports = i+2 < argc && argv[i+2][0] != '-' ? argv[i+2] : 0;
+			int found = ScanSerialPorts(argv[i+1], ports, 0, results, 64, errmsg);
+			tsErrChk(found < 0 ? found : 0, errmsg);
+			for (int j=0; j<found && j<64; j++)
+				fprintf (stderr, "%s @ %d: %s\n", results[j].port, results[j].baudRate, results[j].ident);
+			fprintf (stderr, "%d devices written to %s\n", found, argv[i+1]);
+			i += ports ? 2 : 1;
+		}
 	}
 	
 	/*
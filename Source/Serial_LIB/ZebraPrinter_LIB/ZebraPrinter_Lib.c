@@ -11,6 +11,8 @@
 * ------------|---------------|---------------|--------------------
 * 05-29-2020  | Chao Zhang	  | 1.0.0		  | Initial Release
 * 09-01-2020  | Chao Zhang	  | 1.0.1		  | Added Teat off, Darkness
+* 10-16-2026  | Arxtron		  | 1.0.2		  | Print measures the label once and writes it raw
+* 10-16-2026  | Arxtron		  | 1.0.3		  | Label builders append within ZP_MAXCODELEN
 *******************************************************************************/
 
 //! \cond
@@ -38,10 +40,12 @@ static int libInitialized = 0;
 //==============================================================================
 // Static functions
 
+static int zpAppend(char *Code, const char *Format, ...);
+
 //==============================================================================
 // Global variables
 
-char ZebraPrinterCode[2048] = {0};	/* 20200530Biye: Double check what the max number of chars the printer or serial lib can send/receive at once*/
+char ZebraPrinterCode[ZP_MAXCODELEN] = {0};	/* 20200530Biye: Double check what the max number of chars the printer or serial lib can send/receive at once*/
 
 //==============================================================================
 // Global functions
@@ -81,7 +85,8 @@ Error:
 * \brief Adds new content to PrintCode, only relevant parameters need to be
 * 		 set for params
 * 
-* \param [out]	PrintCode	The code to append to
+* \param [out]	PrintCode	The code to append to, ZP_MAXCODELEN bytes. Content
+* 							that does not fit is not added and returns an error.
 * \param [in]	Type		The type of content to be added
 * \param [in]	Params		The parameters related to the type of content,
 * 							only parameters relevant to the content type needs to be set
@@ -99,38 +104,38 @@ int ZebraPrinter_AddToPrintCode(char *PrintCode, ZebraPrinter_ContentType Type,
 		libErrChk (strlen(Params.font)==0,"Font cannot be blank");
 	}
 	
-	char code[2000] = {0};
+	int fits = 0;
 	
 	switch (Type)
 	{
 		case ZP_Header:
 			libErrChk (strlen(PrintCode)>0,"PrintCode already has content\n%s\nHeader has to be at the beginning of the PrintCode",PrintCode);
-			strcpy (code,"^XA");
+			fits = zpAppend (PrintCode,"^XA");
 			break;
 		case ZP_Footer:
-			strcpy (code,"\n^XZ");
+			fits = zpAppend (PrintCode,"\n^XZ");
 			break;
 		case ZP_PrintWidth:
-			sprintf (code,"\n^PW%d",Params.printWidth);
+			fits = zpAppend (PrintCode,"\n^PW%d",Params.printWidth);
 			break;
 		case ZP_TearOff:
 			libErrChk ((Params.tearOff>120 || Params.tearOff<-120),"Tear Off param outside of acceptable range -120~120");
-			sprintf (code,"\n~TA%d",Params.tearOff);
+			fits = zpAppend (PrintCode,"\n~TA%d",Params.tearOff);
 			break;
 		case ZP_Darkness:
 			libErrChk ((Params.darkness>30 || Params.darkness<0),"Darkness param outside of acceptable range -120~120");
-			sprintf (code,"\n~SD%d",Params.darkness);
+			fits = zpAppend (PrintCode,"\n~SD%d",Params.darkness);
 			break;
 		case ZP_LabelTop:
 			libErrChk ((Params.labelTop>120 || Params.labelTop<-120),"Label Top param outside of acceptable range -120~120");
-			sprintf (code,"\n^LT%d",Params.labelTop);
+			fits = zpAppend (PrintCode,"\n^LT%d",Params.labelTop);
 			break;
 		case ZP_LabelShift:
 			libErrChk ((Params.labelShift>9999 || Params.labelShift<-9999),"Label Width param outside of acceptable range -9999~9999");
-			sprintf (code,"\n^LS%d",Params.labelShift);
+			fits = zpAppend (PrintCode,"\n^LS%d",Params.labelShift);
 			break;
 		case ZP_String:
-			sprintf (code,"\n^FO%d,%d\n"	/* Location */
+			fits = zpAppend (PrintCode,"\n^FO%d,%d\n"	/* Location */
 					 "^%s,%d,%d\n"			/* Font, Height, Width */
 					 "^FD%s^FS",			/* Field Content */
 					 Params.x,Params.y,
@@ -138,7 +143,7 @@ int ZebraPrinter_AddToPrintCode(char *PrintCode, ZebraPrinter_ContentType Type,
 					 Content);
 			break;
 		case ZP_Barcode:
-			sprintf (code,"\n^FO%d,%d\n"	/* Location */
+			fits = zpAppend (PrintCode,"\n^FO%d,%d\n"	/* Location */
 					 "^%s,%d,%d,%d,%d\n"	/* Font, Height, Quality, Column, Row*/
 					 /* 20200531Biye: Format, escape char, aspect ratio not added*/
 					 "^FD%s^FS",			/* Field Content */
@@ -153,7 +158,7 @@ int ZebraPrinter_AddToPrintCode(char *PrintCode, ZebraPrinter_ContentType Type,
 			libErrChk (ERR_INVALID_CONTENT_TYPE,"Content Type %d is not valid",Type);
 			break;
 	}
-	strcat (PrintCode,code);
+	libErrChk (fits,"PrintCode would exceed %d bytes, content not added",ZP_MAXCODELEN);
 	
 Error:
 	return error;
@@ -180,17 +185,9 @@ int	ZebraPrinter_Code_String(char *x, char *y, char *font, char *height, char *w
 {
 	libInit;
 	
-	strcat(ZebraPrinterCode, "^FO"); //Start of location
-	strcat(ZebraPrinterCode, x);strcat(ZebraPrinterCode, ",");  //x
-	strcat(ZebraPrinterCode, y);  //y
-	
-	strcat(ZebraPrinterCode, "^");strcat(ZebraPrinterCode, font);strcat(ZebraPrinterCode, ","); //font
-	strcat(ZebraPrinterCode, height);strcat(ZebraPrinterCode, ",");  //height
-	strcat(ZebraPrinterCode, width);  //witdth
-	
-	strcat(ZebraPrinterCode, "^FD");strcat(ZebraPrinterCode, print_string);strcat(ZebraPrinterCode, "^FS");  //^FD**String**^FS
-	
-	libErrChk(!strcmp(ZebraPrinterCode, ""), "Code String Error!!");
+	// ^FOx,y ^font,height,width ^FD**String**^FS
+	libErrChk(zpAppend(ZebraPrinterCode, "^FO%s,%s^%s,%s,%s^FD%s^FS", x, y, font, height, width, print_string),
+			  "Code String Error!! Label would exceed %d bytes", ZP_MAXCODELEN);
 	
 Error:
 	return error;
@@ -203,20 +200,9 @@ int	ZebraPrinter_Code_DataMatrix(char *x, char *y, char *font, char *height, cha
 {
 	libInit;
 	
-	strcat(ZebraPrinterCode, "^FO"); //Start of location
-	strcat(ZebraPrinterCode, x);strcat(ZebraPrinterCode, ",");  //x
-	strcat(ZebraPrinterCode, y);  //y
-	
-	strcat(ZebraPrinterCode, "^");strcat(ZebraPrinterCode, font);strcat(ZebraPrinterCode, ","); //font
-	strcat(ZebraPrinterCode, height);strcat(ZebraPrinterCode, ",");  //height
-	
-	strcat(ZebraPrinterCode, "200,"); //quality is set to be 200, the best quality
-	strcat(ZebraPrinterCode, col);strcat(ZebraPrinterCode, ",");  //col
-	strcat(ZebraPrinterCode, row);  //row
-	
-	strcat(ZebraPrinterCode, "^FD");strcat(ZebraPrinterCode, print_string);strcat(ZebraPrinterCode, "^FS");  //^FD**String**^FS
-	
-	libErrChk(!strcmp(ZebraPrinterCode, ""), "Code String Error!!");
+	// ^FOx,y ^font,height,quality,col,row ^FD**String**^FS, quality 200 is the best
+	libErrChk(zpAppend(ZebraPrinterCode, "^FO%s,%s^%s,%s,200,%s,%s^FD%s^FS", x, y, font, height, col, row, print_string),
+			  "Code String Error!! Label would exceed %d bytes", ZP_MAXCODELEN);
 	
 Error:
 	return error;
@@ -229,9 +215,8 @@ int	ZebraPrinter_Code_End(char errmsg[ERRLEN])
 {
 	libInit;
 	
-	strcat(ZebraPrinterCode, "^XZ");	 //ZT610 Printer, end with ^XZ
-	
-	libErrChk(!strcmp(ZebraPrinterCode, ""), "Code End Error!!");
+	//ZT610 Printer, end with ^XZ
+	libErrChk(zpAppend(ZebraPrinterCode, "^XZ"), "Code End Error!! Label would exceed %d bytes", ZP_MAXCODELEN);
 	
 Error:
 	return error;
@@ -244,11 +229,13 @@ int	ZebraPrinter_Print(char *PrinterSerialName, char *PrintCode, char errmsg[ERR
 {
 	libInit;
 	
-	libErrChk (strlen(PrintCode)==0,"Empty PrintCode");
+	// Measure the label once, the checks and the write all use the same length
+	int codeLen = (int) strlen(PrintCode);
+	libErrChk (codeLen==0,"Empty PrintCode");
 	libErrChk (strncmp(PrintCode,"^XA",3)!=0,"PrintCode does not start with the expected header ^XA");
-	libErrChk (strncmp(PrintCode+(strlen(PrintCode)-3),"^XZ",3)!=0,"PrintCode does not end with the expected footer ^XZ");
+	libErrChk (codeLen<3 || strncmp(PrintCode+(codeLen-3),"^XZ",3)!=0,"PrintCode does not end with the expected footer ^XZ");
 	
-	WriteSerialDevice(PrinterSerialName, PrintCode, errmsg);
+	WriteSerialDeviceRaw(PrinterSerialName, PrintCode, codeLen, errmsg);
 	
 Error:
 	return error;
@@ -264,6 +251,29 @@ void ZebraPrinter_Close_Printer(char *Printer, char errmsg[ERRLEN])
 	
 	return;
 }
+
+/***************************************************************************//*!
+* \brief Append formatted text to a print code of ZP_MAXCODELEN bytes
+*
+* \return 0, or -1 if it does not fit and the code was left unchanged
+*******************************************************************************/
+static int zpAppend(char *Code, const char *Format, ...)
+{
+	size_t len = strlen(Code);
+	va_list args;
+	
+	if (len >= ZP_MAXCODELEN-1)
+		return -1;
+	va_start(args, Format);
+	int count = vsnprintf(Code+len, ZP_MAXCODELEN-len, Format, args);
+	va_end(args);
+	if (count < 0 || (size_t) count >= ZP_MAXCODELEN-len)
+	{
+		Code[len] = 0;
+		return -1;
+	}
+	return 0;
+}
 //! \cond
 /// REGION END
 //! \endcond
@@ -24,6 +24,9 @@
 		
 // Lib specific error codes (-20000 ~ -99998)
 #define ERR_INVALID_CONTENT_TYPE	-21001
+
+// Size of a PrintCode buffer, the label builders never write past it
+#define ZP_MAXCODELEN				2048
 		
 //==============================================================================
 // Global vaiables